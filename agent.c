@@ -0,0 +1,288 @@
+/*
+ * This file is part of ksudo, a system for limited remote command
+ * execution based on Kerberos principals.
+ *
+ * Copyright 2012 Ben Morrow <ben@morrow.me.uk>.
+ * Released under the 2-clause BSD licence.
+ *
+ * agent.c: keeping the client's service tickets fresh.
+ *
+ * get_creds only looks at a ticket when a command starts, so the first
+ * command after one expires waits for the KDC, and a run across many
+ * hosts asks for all their tickets at once. ksudo -A runs an agent
+ * which wakes every KSUDO_AGENT_INTERVAL seconds, replaces each ksudo
+ * ticket in the ccache which is still valid but expires within
+ * KSUDO_AGENT_AHEAD, since those are the hosts in use, and fetches
+ * tickets for the hosts in the -l lists which haven't got one. Hosts
+ * are done one at a time, so the KDC never sees a burst.
+ *
+ * Tickets come from the TGT, so the agent never prompts; without one
+ * it warns and tries again next time. No ticket can outlive the TGT,
+ * so in its last KSUDO_AGENT_AHEAD one which lasts as long as the TGT
+ * is as fresh as it gets. A new ticket replaces the old only once the
+ * KDC has answered, so a ksudo starting meanwhile still finds one.
+ *
+ * A host list has one host per line, with blank lines and # comments
+ * ignored, and is read afresh each time round.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ksudo.h"
+
+typedef struct agent_host {
+    struct agent_host   *next;
+    char                *host;
+} agent_host;
+
+static int          nlists  = 0;
+static const char   **lists = NULL;
+
+/* Add a -l host list */
+void
+agent_list (const char *path)
+{
+    Renew(lists, nlists + 1);
+    lists[nlists++] = path;
+}
+
+static void
+agent_want (agent_host **hosts, const char *host)
+{
+    agent_host  *h;
+
+    for (h = *hosts; h; h = h->next)
+        if (!strcmp(h->host, host))
+            return;
+
+    New(h, 1);
+    if (!(h->host = strdup(host)))
+        err(EX_OSERR, "can't copy host name");
+    h->next = *hosts;
+    *hosts  = h;
+}
+
+/* Is the ticket good until horizon, which is as far as we look ahead
+ * or the TGT's end, whichever is sooner? */
+static int
+agent_fresh (const krb5_creds *cred, time_t horizon)
+{
+    return cred->times.endtime >= horizon;
+}
+
+/* When the tickets we fetch now will have to end by */
+static time_t
+agent_horizon (krb5_ccache cc, krb5_principal cli)
+{
+    dKRBCHK;
+    const char  *realm  = krb5_principal_get_realm(k5ctx, cli);
+    time_t      horizon = time(NULL) + KSUDO_AGENT_AHEAD;
+    krb5_creds  mcred, tgt;
+
+    Zero(&mcred, 1);
+    if ((ke = krb5_make_principal(k5ctx, &mcred.server, realm,
+            KRB5_TGS_NAME, realm, NULL))
+    ) {
+        krb5_warn(k5ctx, ke, "can't build TGS principal");
+        return horizon;
+    }
+
+    if (!krb5_cc_retrieve_cred(k5ctx, cc, 0, &mcred, &tgt)) {
+        if (tgt.times.endtime < horizon)
+            horizon = tgt.times.endtime;
+        krb5_free_cred_contents(k5ctx, &tgt);
+    }
+    krb5_free_principal(k5ctx, mcred.server);
+
+    return horizon;
+}
+
+/* Want the host of every ksudo ticket in cc which will expire soon */
+static void
+agent_scan (krb5_ccache cc, time_t horizon, agent_host **hosts)
+{
+    dKRBCHK;
+    krb5_cc_cursor  cur;
+    krb5_creds      cred;
+    char            *name, *host, *at;
+
+    if ((ke = krb5_cc_start_seq_get(k5ctx, cc, &cur))) {
+        krb5_warn(k5ctx, ke, "can't read ccache");
+        return;
+    }
+
+    while (!krb5_cc_next_cred(k5ctx, cc, &cur, &cred)) {
+        if (cred.times.endtime > time(NULL) && !agent_fresh(&cred, horizon)
+            && !krb5_unparse_name(k5ctx, cred.server, &name)
+        ) {
+            if (!strncmp(name, KSUDO_SRV "/", sizeof(KSUDO_SRV))) {
+                host = name + sizeof(KSUDO_SRV);
+                if ((at = strchr(host, '@'))) *at = '\0';
+                debug("agent_scan: [%s] expires at [%ld]",
+                    host, (long)cred.times.endtime);
+                agent_want(hosts, host);
+            }
+            krb5_xfree(name);
+        }
+        krb5_free_cred_contents(k5ctx, &cred);
+    }
+
+    krb5_cc_end_seq_get(k5ctx, cc, &cur);
+}
+
+/* Does cc already hold a fresh ticket for host? */
+static int
+agent_have (krb5_ccache cc, time_t horizon, const char *host)
+{
+    dRV;
+    char            *srvname;
+    krb5_creds      mcred, cred;
+    int             ok  = 0;
+
+    SYSCHK(asprintf(&srvname, "%s/%s", KSUDO_SRV, host),
+        "can't build server principal name");
+
+    Zero(&mcred, 1);
+    if (!krb5_parse_name(k5ctx, srvname, &mcred.server)) {
+        if (!krb5_cc_retrieve_cred(k5ctx, cc, 0, &mcred, &cred)) {
+            ok = agent_fresh(&cred, horizon);
+            krb5_free_cred_contents(k5ctx, &cred);
+        }
+        krb5_free_principal(k5ctx, mcred.server);
+    }
+
+    free(srvname);
+    return ok;
+}
+
+/* Want every host in the list at path without a fresh ticket */
+static void
+agent_read_list (krb5_ccache cc, time_t horizon, const char *path,
+    agent_host **hosts)
+{
+    FILE    *f;
+    char    *line = NULL, *p, *canon;
+    size_t  linesz = 0;
+
+    if (!(f = fopen(path, "r"))) {
+        warn("can't open host list %s", path);
+        return;
+    }
+
+    while (getline(&line, &linesz, f) > 0) {
+        p = line + strspn(line, " \t");
+        p[strcspn(p, " \t\n#")] = '\0';
+        if (!*p) continue;
+
+        /* get_creds wants the canonical name, as create_socket gives */
+        if (!(canon = sock_canon(p))) continue;
+        if (!agent_have(cc, horizon, canon))
+            agent_want(hosts, canon);
+        free(canon);
+    }
+
+    if (ferror(f))
+        warn("can't read host list %s", path);
+    fclose(f);
+    Free(line);
+}
+
+/* Get a new ticket for host from the TGT */
+static void
+agent_fetch (krb5_ccache cc, krb5_principal cli, const char *host)
+{
+    dRV; dKRBCHK;
+    char            *srvname;
+    krb5_creds      mcred, old, *out;
+    krb5_kdc_flags  flags;
+
+    SYSCHK(asprintf(&srvname, "%s/%s", KSUDO_SRV, host),
+        "can't build server principal name");
+
+    Zero(&mcred, 1);
+    mcred.client = cli;
+    if ((ke = krb5_parse_name(k5ctx, srvname, &mcred.server))) {
+        krb5_warn(k5ctx, ke, "can't parse %s", srvname);
+        free(srvname);
+        return;
+    }
+
+    /* krb5_get_credentials would just hand back the old ticket, so ask
+     * the KDC directly. The old one stays until we have its
+     * replacement, since a ksudo may want it meanwhile. */
+    flags.i = 0;
+    if ((ke = krb5_get_kdc_cred(k5ctx, cc, flags, NULL, NULL, &mcred,
+            &out))
+    ) {
+        krb5_warn(k5ctx, ke, "can't get ticket for %s", srvname);
+        krb5_free_principal(k5ctx, mcred.server);
+        free(srvname);
+        return;
+    }
+
+    if (!krb5_cc_retrieve_cred(k5ctx, cc, 0, &mcred, &old)) {
+        krb5_cc_remove_cred(k5ctx, cc, 0, &old);
+        krb5_free_cred_contents(k5ctx, &old);
+    }
+    if ((ke = krb5_cc_store_cred(k5ctx, cc, out)))
+        krb5_warn(k5ctx, ke, "can't store ticket for %s", srvname);
+    else
+        debug("agent_fetch: [%s] good until [%ld]",
+            srvname, (long)out->times.endtime);
+
+    krb5_free_creds(k5ctx, out);
+    krb5_free_principal(k5ctx, mcred.server);
+    free(srvname);
+}
+
+static void
+agent_pass ()
+{
+    dKRBCHK;
+    krb5_ccache     cc;
+    krb5_principal  cli;
+    agent_host      *hosts = NULL, *h;
+    time_t          horizon;
+    int             i;
+
+    if ((ke = krb5_cc_default(k5ctx, &cc))) {
+        krb5_warn(k5ctx, ke, "can't open ccache");
+        return;
+    }
+    if ((ke = krb5_cc_get_principal(k5ctx, cc, &cli))) {
+        krb5_warn(k5ctx, ke, "no credentials, waiting");
+        krb5_cc_close(k5ctx, cc);
+        return;
+    }
+
+    horizon = agent_horizon(cc, cli);
+    agent_scan(cc, horizon, &hosts);
+    for (i = 0; i < nlists; i++)
+        agent_read_list(cc, horizon, lists[i], &hosts);
+
+    while ((h = hosts)) {
+        hosts = h->next;
+        agent_fetch(cc, cli, h->host);
+        free(h->host);
+        Free(h);
+    }
+
+    krb5_free_principal(k5ctx, cli);
+    krb5_cc_close(k5ctx, cc);
+}
+
+/* Keep the tickets fresh until we're killed */
+void
+agent_run ()
+{
+    for (;;) {
+        agent_pass();
+        sleep(KSUDO_AGENT_INTERVAL);
+    }
+}
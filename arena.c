@@ -0,0 +1,172 @@
+/*
+ * This file is part of ksudo, a system for limited remote command
+ * execution based on Kerberos principals.
+ *
+ * Copyright 2012 Ben Morrow <ben@morrow.me.uk>.
+ * Released under the 2-clause BSD licence.
+ *
+ * arena.c: per-session memory.
+ *
+ * Everything a session allocates for its whole lifetime comes from its
+ * arena, and is released in one go when the session ends. Released
+ * chunks of the standard size are kept on a free list for the next
+ * session, so a busy daemon settles down to reusing the same memory
+ * rather than going back to malloc for every connection.
+ *
+ * I/O buffers are too big to live in an arena: most sessions are idle
+ * most of the time, and an idle session has nothing buffered. Instead
+ * they are taken from a shared pool when there's data to hold and put
+ * back as soon as they are empty. mem_bytes counts everything both of
+ * these have had from malloc, so the daemon can keep within a budget.
+ */
+
+#include <stddef.h>
+
+#include "ksudo.h"
+
+struct ksudo_arena_chunk {
+    struct ksudo_arena_chunk    *next;
+    size_t                      size;
+    size_t                      used;
+    /* force the alignment of data */
+    union {
+        long double     ld;
+        void            *p;
+        long long       ll;
+    }                           data[1];
+};
+
+#define ArCHUNKHDR      offsetof(ksudo_arena_chunk, data)
+#define ArALIGN(n) \
+    (((n) + sizeof(((ksudo_arena_chunk *)0)->data[0]) - 1) \
+        & ~(sizeof(((ksudo_arena_chunk *)0)->data[0]) - 1))
+
+/* a free buffer is reused to link the free list */
+typedef union ksudo_freebuf {
+    union ksudo_freebuf *next;
+    ksudo_buf           buf;
+} ksudo_freebuf;
+
+static ksudo_arena_chunk    *arfree     = NULL;
+static int                  narfree     = 0;
+static ksudo_freebuf        *buffree    = NULL;
+static int                  nbuffree    = 0;
+
+size_t                      mem_bytes   = 0;
+
+static ksudo_arena_chunk *
+ar_chunk (size_t size)
+{
+    ksudo_arena_chunk   *c;
+
+    if (size == KSUDO_ARENA_CHUNK && arfree) {
+        c = arfree;
+        arfree = c->next;
+        narfree--;
+    }
+    else {
+        if (!(c = malloc(ArCHUNKHDR + size)))
+            err(EX_UNAVAILABLE, "malloc failed");
+        c->size = size;
+        mem_bytes += ArCHUNKHDR + size;
+    }
+
+    c->used = 0;
+    c->next = NULL;
+    mem_debug("ar_chunk [%lx] [%lu]", c, (unsigned long)size);
+    return c;
+}
+
+/* Returns zeroed memory which lasts until ar_free. */
+void *
+ar_alloc (ksudo_arena *a, size_t n)
+{
+    ksudo_arena_chunk   *c;
+    void                *p;
+
+    n = ArALIGN(n ? n : 1);
+    Assert(n < MAXALLOC);
+
+    c = a->chunks;
+    if (!c || c->size - c->used < n) {
+        if (n > KSUDO_ARENA_CHUNK) {
+            /* a big allocation gets its own chunk, behind the current
+             * one so the space left in that isn't wasted */
+            c = ar_chunk(n);
+            if (a->chunks) {
+                c->next = a->chunks->next;
+                a->chunks->next = c;
+            }
+            else
+                a->chunks = c;
+        }
+        else {
+            c = ar_chunk(KSUDO_ARENA_CHUNK);
+            c->next = a->chunks;
+            a->chunks = c;
+        }
+    }
+
+    p = (char *)c->data + c->used;
+    c->used += n;
+    memset(p, 0, n);
+    return p;
+}
+
+void
+ar_free (ksudo_arena *a)
+{
+    ksudo_arena_chunk   *c, *next;
+
+    for (c = a->chunks; c; c = next) {
+        next = c->next;
+        if (c->size == KSUDO_ARENA_CHUNK && narfree < KSUDO_ARENA_CACHE) {
+            c->next = arfree;
+            arfree  = c;
+            narfree++;
+        }
+        else {
+            mem_bytes -= ArCHUNKHDR + c->size;
+            free(c);
+        }
+    }
+    a->chunks = NULL;
+}
+
+/* Returns an empty buffer, to be given back with buf_put. */
+ksudo_buf *
+buf_get ()
+{
+    ksudo_freebuf   *f;
+
+    if ((f = buffree)) {
+        buffree = f->next;
+        nbuffree--;
+    }
+    else {
+        if (!(f = malloc(sizeof(*f))))
+            err(EX_UNAVAILABLE, "malloc failed");
+        mem_bytes += sizeof(*f);
+    }
+
+    BufINIT(&f->buf);
+    return &f->buf;
+}
+
+void
+buf_put (ksudo_buf *buf)
+{
+    ksudo_freebuf   *f  = (ksudo_freebuf *)buf;
+
+    if (!buf) return;
+
+    if (nbuffree < KSUDO_BUF_CACHE) {
+        f->next = buffree;
+        buffree = f;
+        nbuffree++;
+    }
+    else {
+        mem_bytes -= sizeof(*f);
+        free(f);
+    }
+}
@@ -0,0 +1,323 @@
+/*
+ * This file is part of ksudo, a system for limited remote command
+ * execution based on Kerberos principals.
+ *
+ * Copyright 2012 Ben Morrow <ben@morrow.me.uk>.
+ * Released under the 2-clause BSD licence.
+ *
+ * audit.c: the audit log.
+ *
+ * Each record is one line of key=value pairs. The event loop formats
+ * records straight into the slots of a ring, and a writer thread takes
+ * everything it finds there, writes it with one writev and fsyncs once
+ * for the lot. While one fsync is running the next batch builds up, so
+ * a busy server pays for far fewer fsyncs than records.
+ *
+ * There is exactly one producer (the event loop) and one consumer (the
+ * writer), so the ring needs no locks: each side owns one index and
+ * only reads the other's. The writer never allocates, which matters
+ * since the event loop forks. If the ring fills up we drop records
+ * rather than stall, and say so in the log when there is room again.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ksudo.h"
+
+struct ksudo_auditrec {
+    size_t      len;
+    /* a field didn't fit, so the record stops short */
+    unsigned    full    : 1;
+    char        line[KSUDO_AUDIT_LINE];
+};
+
+static ksudo_auditrec           ring[KSUDO_AUDIT_RING];
+/* head is the next record to write, tail the next slot to fill */
+static atomic_ulong             head, tail;
+static sem_t                    wakeup;
+static atomic_int               reopen;
+
+static const char               *path;
+static int                      fd  = -1;
+static unsigned long            ndropped;
+
+static int
+audit_openfd ()
+{
+    int     nfd;
+
+    if ((nfd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+            0600)) < 0)
+        warn("can't open audit log %s", path);
+    return nfd;
+}
+
+static void
+audit_write (unsigned long h, unsigned long t)
+{
+    struct iovec    iov[KSUDO_AUDIT_IOV];
+    ksudo_auditrec  *r;
+    int             n;
+
+    while (h != t) {
+        for (n = 0; h != t && n < KSUDO_AUDIT_IOV; n++, h++) {
+            r = &ring[h % KSUDO_AUDIT_RING];
+            iov[n].iov_base = r->line;
+            iov[n].iov_len  = r->len;
+        }
+        /* a short write to a regular file means the disk is full, and
+         * there's nothing better to do then than carry on */
+        if (fd >= 0 && writev(fd, iov, n) < 0)
+            warn("can't write audit log");
+    }
+}
+
+static void *
+audit_writer (void *arg)
+{
+    unsigned long   h, t;
+    int             nfd;
+
+    for (;;) {
+        while (sem_wait(&wakeup) < 0 && errno == EINTR) ;
+
+        if (atomic_exchange(&reopen, 0) && (nfd = audit_openfd()) >= 0) {
+            if (fd >= 0) close(fd);
+            fd = nfd;
+        }
+
+        h = atomic_load_explicit(&head, memory_order_relaxed);
+        t = atomic_load_explicit(&tail, memory_order_acquire);
+        if (h == t) continue;
+
+        audit_write(h, t);
+        if (fd >= 0 && fsync(fd) < 0)
+            warn("can't fsync audit log");
+
+        /* only now may the event loop reuse the slots */
+        atomic_store_explicit(&head, t, memory_order_release);
+    }
+
+    return NULL;
+}
+
+/* Start logging to p. The writer thread gets every signal blocked, so
+ * they keep arriving at the event loop.
+ */
+void
+audit_open (const char *p)
+{
+    pthread_t   thr;
+    sigset_t    all, old;
+    int         rv;
+
+    path = p;
+    if ((fd = audit_openfd()) < 0)
+        exit(EX_CANTCREAT);
+
+    if (sem_init(&wakeup, 0, 0) < 0)
+        err(EX_OSERR, "can't create audit semaphore");
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if ((rv = pthread_create(&thr, NULL, audit_writer, NULL))) {
+        errno = rv;
+        err(EX_OSERR, "can't start audit writer");
+    }
+    pthread_detach(thr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Have the writer reopen the log, after it's been rotated */
+void
+audit_reopen ()
+{
+    if (!path) return;
+
+    atomic_store(&reopen, 1);
+    sem_post(&wakeup);
+}
+
+/* Wait for everything queued so far to reach the disk */
+void
+audit_flush ()
+{
+    struct timespec ts  = { 0, 1000000L };
+    unsigned long   t;
+
+    if (!path) return;
+
+    t = atomic_load_explicit(&tail, memory_order_relaxed);
+    while (atomic_load_explicit(&head, memory_order_acquire) != t)
+        nanosleep(&ts, NULL);
+}
+
+static ksudo_auditrec *
+audit_slot ()
+{
+    unsigned long   t   = atomic_load_explicit(&tail, memory_order_relaxed);
+
+    if (t - atomic_load_explicit(&head, memory_order_acquire)
+            >= KSUDO_AUDIT_RING)
+        return NULL;
+
+    return &ring[t % KSUDO_AUDIT_RING];
+}
+
+static void
+audit_publish ()
+{
+    atomic_fetch_add_explicit(&tail, 1, memory_order_release);
+    sem_post(&wakeup);
+}
+
+/* Begin a record for event. Returns NULL if there's no audit log or no
+ * room, and the audit_ functions do nothing with a NULL record.
+ */
+ksudo_auditrec *
+audit_start (const char *event)
+{
+    ksudo_auditrec  *r;
+    struct timespec ts;
+    struct tm       tm;
+    char            stamp[32];
+
+    if (!path) return NULL;
+
+    if (!(r = audit_slot())) {
+        ndropped++;
+        return NULL;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    gmtime_r(&ts.tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    if (ndropped) {
+        r->len = snprintf(r->line, sizeof(r->line),
+            "time=%s.%03ldZ event=lost count=%lu\n",
+            stamp, ts.tv_nsec / 1000000L, ndropped);
+        ndropped = 0;
+        audit_publish();
+
+        if (!(r = audit_slot())) {
+            ndropped++;
+            return NULL;
+        }
+    }
+
+    r->len  = 0;
+    r->full = 0;
+    audit_add(r, "time", "%s.%03ldZ", stamp, ts.tv_nsec / 1000000L);
+    audit_add(r, "event", "%s", event);
+    return r;
+}
+
+/* Fields must leave this much room for the end of the line */
+#define AUDIT_TAIL  sizeof(" truncated=1\n")
+#define AUDIT_LIMIT (KSUDO_AUDIT_LINE - AUDIT_TAIL)
+
+/* Add key=value, with the value from fmt. A field which doesn't fit is
+ * dropped, along with everything after it.
+ */
+void
+audit_add (ksudo_auditrec *r, const char *key, const char *fmt, ...)
+{
+    va_list ap;
+    size_t  start;
+    int     n;
+
+    if (!r || r->full) return;
+    start = r->len;
+
+    n = snprintf(r->line + r->len, AUDIT_LIMIT - r->len, "%s%s=",
+        (r->len ? " " : ""), key);
+    if (n < 0 || n >= AUDIT_LIMIT - r->len) goto full;
+    r->len += n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(r->line + r->len, AUDIT_LIMIT - r->len, fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= AUDIT_LIMIT - r->len) goto full;
+    r->len += n;
+    return;
+
+  full:
+    r->len  = start;
+    r->full = 1;
+}
+
+/* Add key="value", escaping anything which would confuse a reader */
+void
+audit_str (ksudo_auditrec *r, const char *key, const char *s, size_t len)
+{
+    static const char   hex[]   = "0123456789abcdef";
+    char                *p, *end;
+    unsigned char       c;
+    size_t              start, i;
+
+    if (!r || r->full) return;
+    start = r->len;
+
+    audit_add(r, key, "\"");
+    if (r->full) return;
+
+    p   = r->line + r->len;
+    /* room for the closing quote */
+    end = r->line + AUDIT_LIMIT - 1;
+
+    for (i = 0; i < len; i++) {
+        c = s[i];
+        if (c == '"' || c == '\\') {
+            if (end - p < 2) break;
+            *p++ = '\\';
+            *p++ = c;
+        }
+        else if (c < 0x20 || c >= 0x7f) {
+            if (end - p < 4) break;
+            *p++ = '\\';
+            *p++ = 'x';
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 0xf];
+        }
+        else {
+            if (end - p < 1) break;
+            *p++ = c;
+        }
+    }
+
+    if (i < len) {
+        r->len  = start;
+        r->full = 1;
+        return;
+    }
+    *p++ = '"';
+    r->len = p - r->line;
+}
+
+/* Finish the record and hand it to the writer */
+void
+audit_commit (ksudo_auditrec *r)
+{
+    if (!r) return;
+
+    if (r->full) {
+        Copy(" truncated=1", r->line + r->len, AUDIT_TAIL - 2);
+        r->len += AUDIT_TAIL - 2;
+    }
+    r->line[r->len++] = '\n';
+    audit_publish();
+}
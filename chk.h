@@ -99,6 +99,9 @@ debug(const char *msg, ...) { }
 #define Copy(f, t, n) \
     memcpy((t), (f), (n)*(sizeof(*(t))))
 
+#define Move(f, t, n) \
+    memmove((t), (f), (n)*(sizeof(*(t))))
+
 #define Zero(v, n) \
     memset((v), 0, (n)*sizeof(*(v)))
 
@@ -0,0 +1,354 @@
+/*
+ * This file is part of ksudo, a system for limited remote command
+ * execution based on Kerberos principals.
+ *
+ * Copyright 2012 Ben Morrow <ben@morrow.me.uk>.
+ * Released under the 2-clause BSD licence.
+ *
+ * cmdq.c: fair sharing of exec slots between principals.
+ *
+ * A command which can't start at once waits on its principal's queue.
+ * When a slot comes free the principals take turns by start-time fair
+ * queueing: each has a virtual time which advances by 1/weight for
+ * every command it starts, and the waiting principal furthest behind
+ * goes next. A principal which has been idle starts level with the
+ * rest rather than with credit saved up, so a batch principal can use
+ * every slot nobody else wants, but someone running the odd command by
+ * hand still gets the next free one.
+ *
+ * Each principal may also have a token bucket, so a burst of commands
+ * is spread out even when there are slots to spare.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ksudo.h"
+
+struct ksudo_princq {
+    /* the hash chain */
+    ksudo_princq        *next;
+    /* the list of principals with commands waiting */
+    ksudo_princq        *anext;
+    ksudo_princq        **aprevp;
+
+    char                *princ;
+    unsigned long       hash;
+    unsigned            weight;
+    unsigned long long  vtime;
+    /* in thousandths of a command, as of timer_now() stamp */
+    unsigned long       tokens;
+    unsigned long       stamp;
+
+    ksudo_cmdq_ent      *head;
+    ksudo_cmdq_ent      **tail;
+    int                 nqueued;
+};
+
+typedef struct ksudo_cmdq_weight {
+    struct ksudo_cmdq_weight    *next;
+    char                        *princ;
+    unsigned                    weight;
+} ksudo_cmdq_weight;
+
+ksudo_cmdqops               cmdqops;
+
+static ksudo_princq         *princqs[KSUDO_CMDQ_HASH];
+static ksudo_princq         *active     = NULL;
+static ksudo_cmdq_weight    *weights    = NULL;
+static unsigned long long   vclock      = 0;
+static int                  nqueued     = 0;
+
+/* the token bucket, in thousandths of a command; 0 is no limit */
+static unsigned long        rate        = 0;
+static unsigned long        burst       = 1000;
+
+static ksudo_timer          wake;
+
+/* Parse a -W argument, principal=weight. Returns 0 if it isn't valid. */
+int
+cmdq_weight (const char *opt)
+{
+    ksudo_cmdq_weight   *w;
+    const char          *val;
+    char                *end;
+    long                n;
+
+    if (!(val = strrchr(opt, '=')) || val == opt) return 0;
+    n = strtol(val + 1, &end, 10);
+    if (end == val + 1 || *end || n < 1 || n > KSUDO_CMDQ_MAXWEIGHT)
+        return 0;
+
+    New(w, 1);
+    NewZ(w->princ, val - opt + 1);
+    Copy(opt, w->princ, val - opt);
+    w->weight   = n;
+    w->next     = weights;
+    weights     = w;
+    return 1;
+}
+
+/* Parse a -r argument, rate[:burst], in commands per second. Returns 0
+ * if it isn't valid.
+ */
+int
+cmdq_rate (const char *opt)
+{
+    char    *end;
+    double  r, b;
+
+    r = strtod(opt, &end);
+    if (end == opt || r <= 0 || r > KSUDO_CMDQ_MAXRATE) return 0;
+
+    if (*end == ':') {
+        opt = end + 1;
+        b   = strtod(opt, &end);
+        if (end == opt || b < 1 || b > KSUDO_CMDQ_MAXRATE) return 0;
+    }
+    else
+        b   = r < 1 ? 1 : r;
+    if (*end) return 0;
+
+    rate    = r * 1000;
+    burst   = b * 1000;
+    return 1;
+}
+
+static unsigned
+cmdq_find_weight (const char *princ)
+{
+    ksudo_cmdq_weight   *w;
+
+    for (w = weights; w; w = w->next)
+        if (!strcmp(w->princ, princ))
+            return w->weight;
+    return KSUDO_CMDQ_WEIGHT;
+}
+
+static void
+cmdq_refill (ksudo_princq *pq)
+{
+    unsigned long       now     = timer_now();
+    unsigned long long  t;
+
+    if (!rate) return;
+
+    t = pq->tokens + (unsigned long long)(now - pq->stamp)
+        * KSUDO_TICK_MS * rate / 1000;
+    pq->tokens  = t > burst ? burst : t;
+    pq->stamp   = now;
+}
+
+/* Has the principal nothing we need to remember? */
+static int
+cmdq_idle (ksudo_princq *pq)
+{
+    if (pq->nqueued) return 0;
+    cmdq_refill(pq);
+    return pq->tokens >= burst;
+}
+
+/* Find the principal's queue, creating it if need be. Idle ones on the
+ * way are thrown away.
+ */
+static ksudo_princq *
+cmdq_find (const char *princ)
+{
+    unsigned long   h   = ksudo_hash(princ, KSUDO_HASH_INIT);
+    ksudo_princq    **pp, *pq;
+
+    pp = &princqs[h % KSUDO_CMDQ_HASH];
+    while ((pq = *pp)) {
+        if (pq->hash == h && !strcmp(pq->princ, princ))
+            return pq;
+
+        if (cmdq_idle(pq)) {
+            *pp = pq->next;
+            Free(pq->princ);
+            Free(pq);
+            continue;
+        }
+        pp = &pq->next;
+    }
+
+    NewZ(pq, 1);
+    NewZ(pq->princ, strlen(princ) + 1);
+    strcpy(pq->princ, princ);
+    pq->hash    = h;
+    pq->weight  = cmdq_find_weight(princ);
+    pq->vtime   = vclock;
+    pq->tokens  = burst;
+    pq->stamp   = timer_now();
+    pq->tail    = &pq->head;
+
+    pq->next    = *pp;
+    *pp         = pq;
+    return pq;
+}
+
+/* Charge the principal for starting a command */
+static void
+cmdq_charge (ksudo_princq *pq)
+{
+    if (pq->vtime < vclock) pq->vtime = vclock;
+    vclock      = pq->vtime;
+    pq->vtime  += KSUDO_CMDQ_SCALE / pq->weight;
+
+    if (rate) pq->tokens -= 1000;
+}
+
+static ksudo_cmdq_ent *
+cmdq_pop (ksudo_princq *pq)
+{
+    ksudo_cmdq_ent  *e  = pq->head;
+
+    if (!(pq->head = e->next)) pq->tail = &pq->head;
+    pq->nqueued--;
+    nqueued--;
+    e->pq = NULL;
+
+    if (!pq->nqueued) {
+        *pq->aprevp = pq->anext;
+        if (pq->anext) pq->anext->aprevp = pq->aprevp;
+    }
+    return e;
+}
+
+static void
+cmdq_wake (int unused)
+{
+    cmdq_run();
+}
+
+/* Have cmdq_run called from ioloop, for when a slot comes free
+ * somewhere it isn't safe to start a command.
+ */
+void
+cmdq_kick ()
+{
+    if (nqueued && !wake.prevp)
+        timer_arm(&wake, 0, cmdq_wake, 0);
+}
+
+/* Start waiting commands while there are slots for them. If there are
+ * slots but every principal waiting is out of tokens, come back when
+ * the first of them has one.
+ */
+void
+cmdq_run ()
+{
+    static int      running = 0, again;
+    ksudo_princq    *pq, *best;
+    ksudo_cmdq_ent  *e;
+    unsigned long   ms, wait;
+
+    /* starting a command can free a slot, which brings us back here */
+    if (running) {
+        again = 1;
+        return;
+    }
+    running = 1;
+
+    do {
+        again = 0;
+        while (nqueued && cmdqops.room()) {
+            best = NULL;
+            wait = ULONG_MAX;
+
+            for (pq = active; pq; pq = pq->anext) {
+                cmdq_refill(pq);
+                if (rate && pq->tokens < 1000) {
+                    ms = ((1000 - pq->tokens) * 1000 + rate - 1) / rate;
+                    if (ms < wait) wait = ms;
+                    continue;
+                }
+                if (!best || (pq->vtime > vclock ? pq->vtime : vclock)
+                        < (best->vtime > vclock ? best->vtime : vclock))
+                    best = pq;
+            }
+
+            if (!best) {
+                debug("cmdq_run: [%d] waiting, next token in [%lu]ms",
+                    nqueued, wait);
+                timer_arm(&wake, wait, cmdq_wake, 0);
+                break;
+            }
+
+            cmdq_charge(best);
+            e = cmdq_pop(best);
+            debug("cmdq_run: starting [%d] for [%s]", e->sess, best->princ);
+            cmdqops.start(e->sess,
+                (timer_now() - e->since) * KSUDO_TICK_MS);
+        }
+    } while (again);
+
+    running = 0;
+}
+
+/* A command has arrived for sess from princ. Returns 0 if it may start
+ * now, which the caller must do; the position it has been given in its
+ * principal's queue, in which case cmdqops.start will be called for it
+ * later; or -1 if the queue is full.
+ */
+int
+cmdq_submit (ksudo_cmdq_ent *e, const char *princ, int sess)
+{
+    ksudo_princq    *pq     = cmdq_find(princ);
+
+    cmdq_refill(pq);
+    if (!pq->nqueued && cmdqops.room() && (!rate || pq->tokens >= 1000)) {
+        cmdq_charge(pq);
+        return 0;
+    }
+
+    if (pq->nqueued >= KSUDO_CMDQ_MAX) return -1;
+
+    e->pq       = pq;
+    e->sess     = sess;
+    e->since    = timer_now();
+    e->next     = NULL;
+    *pq->tail   = e;
+    pq->tail    = &e->next;
+
+    if (!pq->nqueued++) {
+        /* an idle principal doesn't get to keep credit from before */
+        if (pq->vtime < vclock) pq->vtime = vclock;
+        pq->anext   = active;
+        pq->aprevp  = &active;
+        if (active) active->aprevp = &pq->anext;
+        active      = pq;
+    }
+    nqueued++;
+
+    debug("cmdq_submit: [%d] queued for [%s] at [%d]",
+        sess, princ, pq->nqueued);
+    /* With a slot free we are only waiting for tokens. Don't start
+     * anything from here, since the caller hasn't finished queueing. */
+    if (cmdqops.room()) cmdq_kick();
+    return pq->nqueued;
+}
+
+/* The session has gone away while its command was queued */
+void
+cmdq_cancel (ksudo_cmdq_ent *e)
+{
+    ksudo_princq    *pq     = e->pq;
+    ksudo_cmdq_ent  **ep;
+
+    if (!pq) return;
+
+    for (ep = &pq->head; *ep != e; ep = &(*ep)->next)
+        Assert(*ep);
+
+    if (pq->head == e) {
+        cmdq_pop(pq);
+        return;
+    }
+
+    *ep = e->next;
+    if (pq->tail == &e->next) pq->tail = ep;
+    pq->nqueued--;
+    nqueued--;
+    e->pq = NULL;
+}
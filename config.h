@@ -17,4 +17,10 @@
 #define HAVE_FREE_OF_NULL
 #define HAVE_BZERO
 
+/* use kqueue(2) rather than poll(2) in ioloop */
+#define HAVE_KQUEUE
+
+/* rctl(2) and setloginclass(2), for ksudod -L */
+#define HAVE_RCTL
+
 #endif
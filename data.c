@@ -0,0 +1,735 @@
+/*
+ * This file is part of ksudo, a system for limited remote command
+ * execution based on Kerberos principals.
+ *
+ * Copyright 2012 Ben Morrow <ben@morrow.me.uk>.
+ * Released under the 2-clause BSD licence.
+ *
+ * data.c: relaying data streams over a session's msg fd.
+ *
+ * Each direction of a stream is flow-controlled separately. The sender
+ * may have at most nextwnd bytes outstanding; the receiver hands credit
+ * back with KSUDO-WINDOW as it writes data out to the OS fd. Since the
+ * initial window is KSUDO_BUFSIZ the receiver's wbuf can never
+ * overflow. A KSUDO-CLOSE from the sender means EOF; from the receiver
+ * it means the reader has gone away and the sender should stop.
+ *
+ * Output isn't always sent the moment it's read. While a stream's last
+ * DATA is still waiting for the wire, anything more read joins rbuf
+ * instead of making another small message behind it, which costs no
+ * latency since it couldn't have gone any sooner. With -C a partial
+ * message may also wait up to coalesce_ms for more, trading latency
+ * for fewer, bigger krb5_mk_priv calls on a chatty stream.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ksudo.h"
+
+KSUDO_MSGOP(msgop_data);
+KSUDO_MSGOP(msgop_window);
+KSUDO_MSGOP(msgop_close);
+
+/* how long a partial DATA may wait for more, in ms (rounded up to the
+ * timer's tick), and the size which is worth waiting for */
+unsigned long   coalesce_ms     = 0;
+size_t          coalesce_bytes  = KSUDO_BUFSIZ;
+
+/* Parse a -C argument, ms[:bytes]. Returns 0 if it isn't valid. */
+int
+kss_data_coalesce (const char *opt)
+{
+    unsigned long   ms, bytes   = KSUDO_BUFSIZ;
+    char            *end;
+
+    ms = strtoul(opt, &end, 10);
+    if (end == opt) return 0;
+
+    if (*end == ':') {
+        opt     = end + 1;
+        bytes   = strtoul(opt, &end, 10);
+        if (end == opt || !bytes || bytes > KSUDO_BUFSIZ) return 0;
+    }
+    if (*end) return 0;
+
+    coalesce_ms     = ms;
+    coalesce_bytes  = bytes;
+    return 1;
+}
+
+static void
+data_send_close (int sess, int fd)
+{
+    KSUDO_MSG   msg;
+    KSUDO_CLOSE *cl;
+
+    AsnChoice(&msg, MSG, cl, close);
+    *cl = fd;
+    write_msg(sess, &msg);
+}
+
+static void
+data_send_window (int sess, int fd, size_t incr)
+{
+    KSUDO_MSG       msg;
+    KSUDO_WINDOW    *wnd;
+
+    AsnChoice(&msg, MSG, wnd, window);
+    wnd->fd     = fd;
+    wnd->incr   = incr;
+    write_msg(sess, &msg);
+}
+
+static void
+data_close (int ksf)
+{
+    dFDOP(data);
+
+    debug("data_close [%d] session [%d] fd [%d]",
+        ksf, data->session, data->fd);
+    KssL(data->session).datafds[data->fd] = -1;
+    ksf_close(ksf);
+}
+
+/* These finish one direction of the stream. Once both are done the
+ * ksfd goes away, so the caller must not touch data afterwards.
+ */
+static void
+data_stop_send (int ksf)
+{
+    dFDOP(data);
+    int     sess    = data->session;
+
+    if (!data->rbuf) return;
+
+    buf_put(data->rbuf);
+    data->rbuf = NULL;
+    KssL(sess).nout--;
+    KsfMODE_CLR(ksf, KSFm_IN);
+
+    if (!data->wbuf) data_close(ksf);
+    kss_check_exit(sess);
+}
+
+static void
+data_stop_recv (int ksf)
+{
+    dFDOP(data);
+
+    if (!data->wbuf) return;
+
+    buf_put(data->wbuf);
+    data->wbuf = NULL;
+    KsfMODE_CLR(ksf, KSFm_OUT);
+
+    if (data->rbuf)
+        /* socketpair: let the child see EOF on its side */
+        shutdown(KsfFD(ksf), SHUT_WR);
+    else
+        data_close(ksf);
+}
+
+/* Send whatever is in rbuf. If the msg queue fills up we stop reading
+ * until msg_fd_write unblocks us.
+ */
+static void
+data_send (int ksf)
+{
+    dFDOP(data);
+    int         sess    = data->session;
+    ksudo_buf   *buf    = data->rbuf;
+    KSUDO_MSG   msg;
+    KSUDO_DATA  *d;
+
+    if (data->gather) {
+        data->gather = 0;
+        if (data->gtimer) timer_cancel(data->gtimer);
+    }
+
+    while (BufFILL(buf)) {
+        AsnChoice(&msg, MSG, d, data);
+        d->fd           = data->fd;
+        d->data.data    = BufSTART(buf);
+        d->data.length  = BufFILL(buf);
+
+        if (!write_msg(sess, &msg)) {
+            debug("data_send [%d]: blocked on msg fd", ksf);
+            KsfL(ksf).blocking  = 1;
+            KsfL(ksf).blocked   = KssMSGFD(sess);
+            KsfMODE_CLR(ksf, KSFm_IN);
+            return;
+        }
+        if (KssL(sess).tapop)
+            KssL(sess).tapop(sess, data->fd, d->data.data, d->data.length);
+        BufCONSUME(buf, d->data.length);
+    }
+
+    if (data->rclosed) {
+        data_send_close(sess, data->fd);
+        data_stop_send(ksf);
+        return;
+    }
+
+    if (data->nextwnd)  KsfMODE_SET(ksf, KSFm_IN);
+    else                KsfMODE_CLR(ksf, KSFm_IN);
+}
+
+static void
+data_gather_timeout (int ksf)
+{
+    data_send(ksf);
+}
+
+/* Send rbuf, unless it should wait for more: see the top of the file.
+ * There's no point waiting at EOF, with a frame's worth, or when the
+ * peer's window won't let us read any more.
+ */
+static void
+data_gather (int ksf)
+{
+    dFDOP(data);
+    int     sess    = data->session;
+
+    if (data->rclosed || !data->nextwnd
+        || BufFILL(data->rbuf) >= coalesce_bytes
+    ) {
+        data_send(ksf);
+        return;
+    }
+
+    if (coalesce_ms) {
+        if (!data->gather) {
+            if (!data->gtimer) ArNewZ(KssARENA(sess), data->gtimer, 1);
+            timer_arm(data->gtimer, coalesce_ms, data_gather_timeout, ksf);
+        }
+    }
+    /* kss_unblock will send it when the one in front has gone */
+    else if (!kss_msg_queued(sess, data->fd)) {
+        data_send(ksf);
+        return;
+    }
+
+    debug("data_gather [%d]: holding [%lu]",
+        ksf, (unsigned long)BufFILL(data->rbuf));
+    data->gather = 1;
+    KsfMODE_SET(ksf, KSFm_IN);
+}
+
+KSUDO_FDOP(data_fd_read)
+{
+    dFDOP(data);
+    ssize_t     n;
+
+    ckFDOP(data);
+    Assert(data->rbuf);
+
+    n = ksf_read(ksf, data->rbuf, data->nextwnd);
+    if (n < 0)
+        data->rclosed = 1;
+    else
+        data->nextwnd -= n;
+
+    data_gather(ksf);
+}
+
+/* We've written n bytes to the OS fd, so the peer may send more */
+static void
+data_wrote (int ksf, size_t n)
+{
+    dFDOP(data);
+
+    /* Don't send a window update for every write */
+    data->wndpend += n;
+    if (data->wndpend >= KSUDO_BUFSIZ/2
+        || (data->wndpend && !BufFILL(data->wbuf))
+    ) {
+        data_send_window(data->session, data->fd, data->wndpend);
+        data->rcvwnd    += data->wndpend;
+        data->wndpend   = 0;
+    }
+}
+
+/* Line mode: write the lines in wbuf, each after the prefix, with one
+ * writev. A partial line at the end waits for the rest, unless that
+ * isn't coming: at EOF, or when the peer has used up its window. What
+ * comes back is the number of bytes of wbuf written, as from ksf_write.
+ */
+static ssize_t
+data_write_lines (int ksf)
+{
+    dFDOP(data);
+    ksudo_buf       *buf    = data->wbuf;
+    struct iovec    iov[KSUDO_LINE_IOV];
+    /* for each data iovec, whether it ends a line; -1 for a prefix */
+    signed char     eol[KSUDO_LINE_IOV];
+    uchar           *p      = BufSTART(buf), *nl;
+    size_t          len, left, take, off;
+    ssize_t         rv, n   = 0;
+    int             niov    = 0, midline = data->midline, held = 0, i;
+
+    while (p < BufEND(buf) && niov + 2 <= KSUDO_LINE_IOV) {
+        left = BufEND(buf) - p;
+        if ((nl = memchr(p, '\n', left)))
+            len = nl + 1 - p;
+        else if (!data->weof && data->rcvwnd) {
+            held = 1;
+            break;
+        }
+        else
+            len = left;
+
+        if (!midline) {
+            off = niov ? 0 : data->poff;
+            iov[niov].iov_base  = (char *)data->prefix + off;
+            iov[niov].iov_len   = data->prefixlen - off;
+            eol[niov++]         = -1;
+        }
+        iov[niov].iov_base  = p;
+        iov[niov].iov_len   = len;
+        eol[niov++]         = !!nl;
+
+        midline = !nl;
+        p      += len;
+    }
+
+    if (!niov) {
+        KsfMODE_CLR(ksf, KSFm_OUT);
+        return 0;
+    }
+
+    rv = writev(KsfFD(ksf), iov, niov);
+    debug("data_write_lines [%d] [%d] iovs -> [%ld]",
+        ksf, niov, (long)rv);
+
+    if (rv == -1 && errno == EAGAIN) return 0;
+    if (rv == -1) {
+        warn("write failed");
+        return -1;
+    }
+
+    /* see how far we got, which may be part way through anything */
+    for (i = 0; i < niov && rv > 0; i++) {
+        take    = (size_t)rv < iov[i].iov_len ? (size_t)rv : iov[i].iov_len;
+        rv     -= take;
+
+        if (eol[i] < 0) {
+            data->poff += take;
+            if (take < iov[i].iov_len) break;
+            data->midline   = 1;
+            data->poff      = 0;
+        }
+        else {
+            n += take;
+            data->midline = take < iov[i].iov_len || !eol[i];
+        }
+    }
+    BufCONSUME(buf, n);
+
+    /* nothing left but the partial line, which can wait for more */
+    if (!BufFILL(buf) || (held && BufSTART(buf) == p))
+        KsfMODE_CLR(ksf, KSFm_OUT);
+    return n;
+}
+
+static ssize_t
+data_write (int ksf)
+{
+    dFDOP(data);
+
+    return data->prefix
+        ? data_write_lines(ksf)
+        : ksf_write(ksf, data->wbuf);
+}
+
+KSUDO_FDOP(data_fd_write)
+{
+    dFDOP(data);
+    int         sess    = data->session;
+    ssize_t     n;
+
+    ckFDOP(data);
+    Assert(data->wbuf);
+
+    n = data_write(ksf);
+    if (n < 0) {
+        /* the reader has gone away */
+        data_send_close(sess, data->fd);
+        data_stop_recv(ksf);
+        return;
+    }
+
+    if (!BufFILL(data->wbuf) && data->weof) {
+        data_stop_recv(ksf);
+        return;
+    }
+
+    data_wrote(ksf, n);
+}
+
+KSUDO_FDOP(data_fd_unblock)
+{
+    ckFDOP(data);
+
+    KsfL(ksf).blocking = 0;
+    data_send(ksf);
+}
+
+KSUDO_FDOP(data_fd_close)
+{
+    dFDOP(data);
+
+    ckFDOP(data);
+    if (data->gtimer) timer_cancel(data->gtimer);
+    if (data->rbuf)
+        KssL(data->session).nout--;
+    buf_put(data->rbuf);
+    buf_put(data->wbuf);
+    data->rbuf = data->wbuf = NULL;
+}
+
+ksudo_fdops ksudo_fdops_data = {
+    .read       = data_fd_read,
+    .write      = data_fd_write,
+    .close      = data_fd_close,
+    .unblock    = data_fd_unblock
+};
+
+/* Start relaying OS fd osfd as logical fd fd. send means we read from
+ * osfd and send to the peer, recv that we write what the peer sends.
+ */
+int
+kss_data_open (int sess, int fd, int osfd, int send, int recv)
+{
+    ksudo_fddata_data   *data;
+    int                 ksf, i;
+
+    Assert(fd >= 0 && fd < KSUDO_NFDS);
+    Assert(send || recv);
+
+    if (!KssL(sess).datafds) {
+        ArNewZ(KssARENA(sess), KssL(sess).datafds, KSUDO_NFDS);
+        for (i = 0; i < KSUDO_NFDS; i++)
+            KssL(sess).datafds[i] = -1;
+    }
+    Assert(KssL(sess).datafds[fd] == -1);
+
+    ArNewZ(KssARENA(sess), data, 1);
+    data->session   = sess;
+    data->fd        = fd;
+
+    if (send) {
+        data->rbuf = buf_get();
+        data->nextwnd = KSUDO_BUFSIZ;
+        KssL(sess).nout++;
+    }
+    if (recv) {
+        data->wbuf = buf_get();
+        data->rcvwnd = KSUDO_BUFSIZ;
+    }
+
+    ksf = ksf_open(osfd, (send ? KSUDO_FD_READ : KSUDO_FD_WRITE),
+        KSFt(data), data);
+    KsfL(ksf).arena = 1;
+    /* there's nothing to write yet */
+    KsfMODE_CLR(ksf, KSFm_OUT);
+    KssL(sess).datafds[fd] = ksf;
+
+    debug("kss_data_open [%d] fd [%d] -> [%d] ksf [%d] send [%d] recv [%d]",
+        sess, fd, osfd, ksf, send, recv);
+    return ksf;
+}
+
+/* Shared by every session, rather than copied into each */
+const ksudo_msgop kss_data_msgops[KSUDO_MSG_num] = {
+    KssMSGOP(data)      = msgop_data,
+    KssMSGOP(window)    = msgop_window,
+    KssMSGOP(close)     = msgop_close,
+};
+
+void
+kss_data_ops (int sess)
+{
+    KssL(sess).dataops = 1;
+}
+
+void
+kss_data_closeall (int sess)
+{
+    int     fd, ksf;
+
+    for (fd = 0; fd < KSUDO_NFDS; fd++) {
+        ksf = KssDATAFD(sess, fd);
+        if (ksf >= 0) data_close(ksf);
+    }
+}
+
+/* Send len bytes on fd, and then EOF, as though they had come from a
+ * stream of ours. len must fit in the peer's first window.
+ */
+void
+kss_data_replay (int sess, int fd, const uchar *p, size_t len)
+{
+    KSUDO_MSG   msg;
+    KSUDO_DATA  *d;
+
+    Assert(len <= KSUDO_BUFSIZ);
+
+    if (len) {
+        AsnChoice(&msg, MSG, d, data);
+        d->fd           = fd;
+        d->data.data    = (uchar *)p;
+        d->data.length  = len;
+        write_msg(sess, &msg);
+    }
+    data_send_close(sess, fd);
+}
+
+/* Put the stream's output for fd into line mode, with each line
+ * starting with prefix. prefix must last as long as the stream.
+ */
+void
+kss_data_prefix (int sess, int fd, const char *prefix)
+{
+    ksudo_fddata_data   *data;
+    int                 ksf;
+
+    if ((ksf = KssDATAFD(sess, fd)) < 0) return;
+    data = KsfDATA(ksf, data);
+
+    data->prefix    = prefix;
+    data->prefixlen = strlen(prefix);
+    data->poff      = 0;
+    data->midline   = 0;
+}
+
+/* Write out everything we've been sent, blocking if necessary. This is
+ * used just before we exit.
+ */
+void
+kss_data_flush (int sess)
+{
+    dRV;
+    int                 fd, ksf, fl;
+    ksudo_fddata_data   *data;
+
+    for (fd = 0; fd < KSUDO_NFDS; fd++) {
+        ksf = KssDATAFD(sess, fd);
+        if (ksf < 0) continue;
+        data = KsfDATA(ksf, data);
+        if (!data->wbuf) continue;
+
+        SYSCHK(fl = fcntl(KsfFD(ksf), F_GETFL, 0),
+            "can't read fd flags");
+        SYSCHK(fcntl(KsfFD(ksf), F_SETFL, fl & ~O_NONBLOCK),
+            "can't set fd blocking");
+
+        /* nothing more is coming, so line mode mustn't wait for it */
+        data->weof = 1;
+        while (BufFILL(data->wbuf))
+            if (data_write(ksf) < 0) break;
+    }
+}
+
+/* The msg queues have room again: let blocked streams carry on, and
+ * send what has gathered behind a message which has now gone */
+void
+kss_unblock (int sess)
+{
+    int     fd, ksf;
+
+    for (fd = 0; fd < KSUDO_NFDS; fd++) {
+        ksf = KssDATAFD(sess, fd);
+        if (ksf < 0 || !kss_msg_room(sess, fd)) continue;
+
+        if (KsfL(ksf).blocking)
+            KsfCALLOP(ksf, unblock);
+        else if (KsfDATA(ksf, data)->gather && !coalesce_ms
+            && !kss_msg_queued(sess, fd))
+            data_send(ksf);
+    }
+}
+
+KSUDO_MSGOP(msgop_data)
+{
+    KSUDO_DATA          *msg    = vmsg;
+    ksudo_fddata_data   *data;
+    uchar               *p      = msg->data.data;
+    size_t              len     = msg->data.length;
+    ssize_t             n;
+    int                 ksf;
+
+    ckMSGOP(data);
+
+    ksf = KssDATAFD(sess, msg->fd);
+    /* we may have closed the stream from our end */
+    if (ksf < 0 || !(data = KsfDATA(ksf, data))->wbuf) {
+        debug("msgop_data: discarding [%lu] bytes for fd [%d]",
+            (unsigned long)len, msg->fd);
+        return;
+    }
+
+    /* only this session is broken, so don't take the rest with it */
+    if (len > data->rcvwnd) {
+        warnx("session [%d] exceeded its window on fd %d", sess, msg->fd);
+        kss_err(sess, KSUDO_WINDOW_EXCEEDED,
+            "window exceeded on fd %d", msg->fd);
+        return;
+    }
+    data->rcvwnd -= len;
+
+    /* With nothing already waiting, write straight from the message
+     * and only buffer what the fd won't take. Errors are left for
+     * data_fd_write to find. Line mode always goes through wbuf. */
+    if (!BufFILL(data->wbuf) && !data->prefix) {
+        if ((n = write(KsfFD(ksf), p, len)) > 0) {
+            debug("msgop_data: wrote [%ld] of [%lu] to fd [%d]",
+                (long)n, (unsigned long)len, msg->fd);
+            p   += n;
+            len -= n;
+            data_wrote(ksf, n);
+        }
+        if (!len) return;
+    }
+
+    BufENSURE(data->wbuf, len);
+    Assert(BufFREE(data->wbuf) >= len);
+    Copy(p, BufEND(data->wbuf), len);
+    BufEXTEND(data->wbuf, len);
+    KsfMODE_SET(ksf, KSFm_OUT);
+}
+
+KSUDO_MSGOP(msgop_window)
+{
+    KSUDO_WINDOW        *msg    = vmsg;
+    ksudo_fddata_data   *data;
+    int                 ksf;
+
+    ckMSGOP(window);
+
+    ksf = KssDATAFD(sess, msg->fd);
+    if (ksf < 0 || !(data = KsfDATA(ksf, data))->rbuf) return;
+
+    data->nextwnd += msg->incr;
+    debug("msgop_window: fd [%d] +[%u] -> [%lu]",
+        msg->fd, msg->incr, (unsigned long)data->nextwnd);
+    if (!data->rclosed && !KsfL(ksf).blocking)
+        KsfMODE_SET(ksf, KSFm_IN);
+}
+
+KSUDO_MSGOP(msgop_close)
+{
+    KSUDO_CLOSE         *msg    = vmsg;
+    ksudo_fddata_data   *data;
+    int                 ksf;
+
+    ckMSGOP(close);
+
+    ksf = KssDATAFD(sess, *msg);
+    if (ksf < 0) return;
+    data = KsfDATA(ksf, data);
+
+    debug("msgop_close: fd [%d]", *msg);
+    if (data->wbuf) {
+        data->weof = 1;
+        if (!BufFILL(data->wbuf)) data_stop_recv(ksf);
+        /* line mode may be holding a partial line back */
+        else KsfMODE_SET(ksf, KSFm_OUT);
+    }
+    else
+        data_stop_send(ksf);
+}
+
+static void
+data_save_buf (ksudo_buf *buf, heim_octet_string **s)
+{
+    dKRBCHK;
+
+    NewZ(*s, 1);
+    KRBCHK(krb5_data_copy(*s, BufSTART(buf), BufFILL(buf)),
+        "can't save data buffer");
+}
+
+static void
+data_restore_buf (ksudo_buf *buf, const heim_octet_string *s)
+{
+    Assert(s->length <= BufFREE(buf));
+    Copy((uchar *)s->data, BufEND(buf), s->length);
+    BufEXTEND(buf, s->length);
+}
+
+/* Save the session's data streams for an upgrade */
+void
+kss_data_save (int sess, KSUDO_SAVED_SESSION *ss)
+{
+    ksudo_fddata_data   *data;
+    KSUDO_SAVED_DATA    *sd;
+    int                 fd, ksf;
+
+    NewZ(ss->data.val, KSUDO_NFDS);
+    ss->data.len = 0;
+
+    for (fd = 0; fd < KSUDO_NFDS; fd++) {
+        ksf = KssDATAFD(sess, fd);
+        if (ksf < 0) continue;
+        data = KsfDATA(ksf, data);
+
+        sd = &ss->data.val[ss->data.len++];
+        sd->fd          = fd;
+        sd->osfd        = KsfFD(ksf);
+        sd->rclosed     = data->rclosed;
+        sd->weof        = data->weof;
+        sd->blocking    = KsfL(ksf).blocking;
+        sd->nextwnd     = data->nextwnd;
+        sd->rcvwnd      = data->rcvwnd;
+        sd->wndpend     = data->wndpend;
+
+        if (data->rbuf) data_save_buf(data->rbuf, &sd->rbuf);
+        if (data->wbuf) data_save_buf(data->wbuf, &sd->wbuf);
+    }
+}
+
+/* Recreate the streams saved by kss_data_save, and start them moving
+ * again.
+ */
+void
+kss_data_restore (int sess, const KSUDO_SAVED_SESSION *ss)
+{
+    ksudo_fddata_data   *data;
+    KSUDO_SAVED_DATA    *sd;
+    int                 i, ksf;
+
+    for (i = 0; i < ss->data.len; i++) {
+        sd  = &ss->data.val[i];
+        ksf = kss_data_open(sess, sd->fd, sd->osfd,
+            sd->rbuf != NULL, sd->wbuf != NULL);
+        data = KsfDATA(ksf, data);
+
+        data->rclosed   = sd->rclosed;
+        data->weof      = sd->weof;
+        data->nextwnd   = sd->nextwnd;
+        data->rcvwnd    = sd->rcvwnd;
+        data->wndpend   = sd->wndpend;
+
+        if (sd->wbuf) {
+            data_restore_buf(data->wbuf, sd->wbuf);
+            if (BufFILL(data->wbuf)) KsfMODE_SET(ksf, KSFm_OUT);
+        }
+        if (!sd->rbuf) continue;
+
+        data_restore_buf(data->rbuf, sd->rbuf);
+        if (sd->blocking) {
+            KsfL(ksf).blocking  = 1;
+            KsfL(ksf).blocked   = KssMSGFD(sess);
+            KsfMODE_CLR(ksf, KSFm_IN);
+        }
+        else
+            data_send(ksf);
+    }
+}
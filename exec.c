@@ -5,6 +5,12 @@
  * exec.c: server-side process execution
  */
 
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <fcntl.h>
+#include <grp.h>
+#include <paths.h>
 #include <stdio.h>
 #include <unistd.h>
 
@@ -38,13 +44,287 @@ do_exec_debug (KSUDO_CMD *cmd, int ncmd, size_t len)
 }
 #endif
 
-void
-do_exec (KSUDO_CMD *cmd, ksudo_sdata_server *data)
+/* The ASN.1 strings are not null-terminated */
+static char *
+do_exec_str (heim_octet_string *s)
+{
+    char    *str;
+
+    NewZ(str, s->length + 1);
+    Copy((char *)s->data, str, s->length);
+    return str;
+}
+
+/* Check the fds in the env opts are in range, that we don't have two
+ * remote streams for the same fd, and that a dup only copies an fd an
+ * earlier opt has set up. Anything else in that range in the child is
+ * one of ours, and mustn't be handed to the command.
+ */
+static int
+do_exec_checkfds (int sess, KSUDO_CMD *cmd)
+{
+    int     i, fd, onto, mode;
+    int     rfds[KSUDO_NFDS], set[KSUDO_NFDS];
+
+    Zero(rfds, KSUDO_NFDS);
+    Zero(set, KSUDO_NFDS);
+    /* 0-2 always get at least /dev/null */
+    set[0] = set[1] = set[2] = 1;
+
+    for (i = 0; i < cmd->env.len; i++) {
+        KSUDO_ENV_OPT   *opt    = &cmd->env.val[i];
+
+        fd = onto = mode = 0;
+        switch (opt->element) {
+            case choice_KSUDO_ENV_OPT_rfd:
+                fd      = opt->u.rfd.fd;
+                mode    = opt->u.rfd.mode;
+                if (fd >= 0 && fd < KSUDO_NFDS && rfds[fd]++) {
+                    kss_err(sess, KSUDO_EPERM,
+                        "remote fd %d requested twice", fd);
+                    return 0;
+                }
+                break;
+            case choice_KSUDO_ENV_OPT_lfd:
+                fd      = opt->u.lfd.fd;
+                mode    = opt->u.lfd.mode;
+                break;
+            case choice_KSUDO_ENV_OPT_dup:
+                fd      = opt->u.dup.fd;
+                onto    = opt->u.dup.onto;
+                break;
+            default:
+                break;
+        }
+
+        if (fd < 0 || fd >= KSUDO_NFDS || onto < 0 || onto >= KSUDO_NFDS) {
+            kss_err(sess, KSUDO_EPERM, "bad fd number");
+            return 0;
+        }
+        if (mode < KSUDO_FD_READ || mode > KSUDO_FD_RDWR) {
+            kss_err(sess, KSUDO_EPERM, "bad fd mode");
+            return 0;
+        }
+
+        switch (opt->element) {
+            case choice_KSUDO_ENV_OPT_rfd:
+            case choice_KSUDO_ENV_OPT_lfd:
+                set[fd] = 1;
+                break;
+            case choice_KSUDO_ENV_OPT_dup:
+                if (!set[fd]) {
+                    kss_err(sess, KSUDO_EPERM, "fd %d is not open", fd);
+                    return 0;
+                }
+                set[onto] = 1;
+                break;
+            default:
+                break;
+        }
+    }
+
+    return 1;
+}
+
+/* Make a pipe for a remote fd. A KSUDO_FD_READ fd is one the child
+ * reads from. Returns -1, with errno set, if we can't.
+ */
+static int
+do_exec_pipe (KSUDO_FD_MODE mode, int *ours, int *kids)
+{
+    int     p[2];
+
+    if (mode == KSUDO_FD_RDWR) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, p) < 0)
+            return -1;
+        *ours = p[0];
+        *kids = p[1];
+    }
+    else {
+        if (pipe(p) < 0)
+            return -1;
+        *ours = p[mode == KSUDO_FD_READ ? 1 : 0];
+        *kids = p[mode == KSUDO_FD_READ ? 0 : 1];
+    }
+
+    if (fcntl(*ours, F_SETFD, FD_CLOEXEC) < 0) {
+        close(p[0]);
+        close(p[1]);
+        *ours = *kids = -1;
+        return -1;
+    }
+
+#ifdef F_SETPIPE_SZ
+    /* A bigger pipe lets the child carry on while we're waiting on the
+     * window. It's only a hint, so if we can't have it never mind. */
+    if (mode != KSUDO_FD_RDWR)
+        fcntl(*ours, F_SETPIPE_SZ, KSUDO_PIPE_SIZE);
+#endif
+
+    return 0;
+}
+
+/* We couldn't make the child's fds or the child itself. Running out
+ * of fds or processes is something the client can wait out; either
+ * way it only costs this session.
+ */
+static int
+do_exec_fail (int sess, const char *what, int *ourfds, int *kidfds)
+{
+    int     e   = errno, fd;
+
+    warn("%s", what);
+    for (fd = 0; fd < KSUDO_NFDS; fd++) {
+        if (ourfds[fd] != -1) close(ourfds[fd]);
+        if (kidfds[fd] != -1) close(kidfds[fd]);
+    }
+
+    if (e == EMFILE || e == ENFILE || e == EAGAIN || e == ENOMEM)
+        kss_busy(sess, KSUDO_BUSY_RETRY);
+    else
+        kss_err(sess, KSUDO_ENOEXEC, "can't start command");
+    return 0;
+}
+
+static void
+do_exec_open (KSUDO_ENVOPT_LOCALFD *lfd)
 {
     dRV;
-    int     ncmd, i;
-    size_t  len = 0, n;
-    char    **cmdv, *cmds, *p;
+    int     fd;
+    char    *path;
+
+    static const int lfd_flags[3] = {
+        O_RDONLY,
+        O_WRONLY | O_CREAT | O_TRUNC,
+        O_RDWR | O_CREAT
+    };
+
+    path = do_exec_str(&lfd->path);
+    debug("do_exec_open [%d] [%s] mode [%d]", lfd->fd, path, lfd->mode);
+
+    if ((fd = open(path, lfd_flags[lfd->mode], 0666)) < 0)
+        err(lfd->mode == KSUDO_FD_READ ? EX_NOINPUT : EX_CANTCREAT,
+            "%s", path);
+
+    if (fd != lfd->fd) {
+        SYSCHK(dup2(fd, lfd->fd), "can't dup2");
+        close(fd);
+    }
+    Free(path);
+}
+
+/* Runs in the child. Become the target user. This must happen before
+ * do_exec_env, so local files are opened with the user's permissions.
+ */
+static void
+do_exec_setuid (ksudo_pwent *pw)
+{
+    dRV;
+
+    setenv("HOME",      pw->dir,    1);
+    setenv("SHELL",     pw->shell,  1);
+    setenv("USER",      pw->name,   1);
+    setenv("LOGNAME",   pw->name,   1);
+
+    /* ksudod not running as root is only useful for testing */
+    if (geteuid() == pw->uid && getegid() == pw->gid) return;
+
+    SYSCHK(setgroups(pw->ngroups, pw->groups), "can't set groups");
+    SYSCHK(setgid(pw->gid), "can't set gid");
+    SYSCHK(setuid(pw->uid), "can't set uid");
+}
+
+/* Runs in the child. Set up the fds the client asked for, in the order
+ * it asked for them. Anything in 0-2 not otherwise mentioned gets
+ * /dev/null, and everything else of ours is closed. Files are opened
+ * here rather than in ksudod so they are subject to the same
+ * permissions as the command itself.
+ */
+static void
+do_exec_env (KSUDO_CMD *cmd, int *kidfds)
+{
+    dRV;
+    int     i, fd, null;
+    int     set[KSUDO_NFDS];
+    char    *dir;
+
+    reset_signals();
+    Zero(set, KSUDO_NFDS);
+
+    /* First get everything out of the way of the fds we're about to
+     * install, so the dup2s below can't clobber anything we need.
+     */
+    for (fd = 0; fd < KSUDO_NFDS; fd++) {
+        if (kidfds[fd] == -1) continue;
+        SYSCHK(i = fcntl(kidfds[fd], F_DUPFD_CLOEXEC, KSUDO_NFDS),
+            "can't move fd");
+        close(kidfds[fd]);
+        kidfds[fd] = i;
+    }
+
+    SYSCHK(null = open(_PATH_DEVNULL, O_RDWR), "can't open /dev/null");
+    SYSCHK(i = fcntl(null, F_DUPFD_CLOEXEC, KSUDO_NFDS), "can't move fd");
+    close(null);
+    null = i;
+
+    for (fd = 0; fd < 3; fd++)
+        SYSCHK(dup2(null, fd), "can't dup2");
+
+    for (i = 0; i < cmd->env.len; i++) {
+        KSUDO_ENV_OPT   *opt    = &cmd->env.val[i];
+
+        switch (opt->element) {
+            case choice_KSUDO_ENV_OPT_cwd:
+                dir = do_exec_str(&opt->u.cwd);
+                if (chdir(dir) < 0)
+                    err(EX_NOINPUT, "can't chdir to %s", dir);
+                Free(dir);
+                break;
+
+            case choice_KSUDO_ENV_OPT_rfd:
+                fd = opt->u.rfd.fd;
+                SYSCHK(dup2(kidfds[fd], fd), "can't dup2");
+                set[fd] = 1;
+                break;
+
+            case choice_KSUDO_ENV_OPT_lfd:
+                do_exec_open(&opt->u.lfd);
+                set[opt->u.lfd.fd] = 1;
+                break;
+
+            case choice_KSUDO_ENV_OPT_dup:
+                SYSCHK(dup2(opt->u.dup.fd, opt->u.dup.onto),
+                    "can't dup2");
+                set[opt->u.dup.onto] = 1;
+                break;
+
+            default:
+                debug("do_exec_env: ignoring env opt [%d]", opt->element);
+                break;
+        }
+    }
+
+    /* Whatever is left is ours: listen sockets, other sessions'
+     * connections, the kqueue. */
+    for (fd = 3; fd < KSUDO_NFDS; fd++)
+        if (!set[fd]) close(fd);
+    closefrom(KSUDO_NFDS);
+}
+
+/* Returns 0 if the command was refused, in which case a KSUDO-ERR has
+ * already been sent.
+ */
+int
+do_exec (int sess, KSUDO_CMD *cmd)
+{
+    dKSSOP(server);
+    dRV;
+    int             ncmd, i, fd, e;
+    size_t          len = 0, n;
+    char            **cmdv, *cmds, *p, *user;
+    int             ourfds[KSUDO_NFDS], kidfds[KSUDO_NFDS];
+    KSUDO_FD_MODE   modes[KSUDO_NFDS];
+    ksudo_pwent     *pw;
 
     ncmd = cmd->cmd.len;
     for (i = 0; i < ncmd; i++) {
@@ -57,11 +337,59 @@ do_exec (KSUDO_CMD *cmd, ksudo_sdata_server *data)
     do_exec_debug(cmd, ncmd, len);
 #endif
 
-    SYSCHK(data->pid = fork(), "fork failed");
-    if (rv != 0) return;
+    if (!do_exec_checkfds(sess, cmd)) return 0;
+
+    user    = do_exec_str(&cmd->user);
+    pw      = pwcache_get(user);
+    e       = errno;
+    Free(user);
+    /* NSS may be down for a moment; that isn't the user's fault */
+    if (!pw && e) {
+        kss_busy(sess, KSUDO_BUSY_RETRY);
+        return 0;
+    }
+    if (!pw) {
+        kss_err(sess, KSUDO_ENOENT, "no such user %.*s",
+            (int)cmd->user.length, (char *)cmd->user.data);
+        return 0;
+    }
+
+    for (fd = 0; fd < KSUDO_NFDS; fd++)
+        ourfds[fd] = kidfds[fd] = -1;
+
+    for (i = 0; i < cmd->env.len; i++) {
+        KSUDO_ENV_OPT   *opt    = &cmd->env.val[i];
+
+        if (opt->element != choice_KSUDO_ENV_OPT_rfd) continue;
+
+        fd          = opt->u.rfd.fd;
+        modes[fd]   = opt->u.rfd.mode;
+        if (do_exec_pipe(modes[fd], &ourfds[fd], &kidfds[fd]) < 0)
+            return do_exec_fail(sess, "can't create pipe",
+                ourfds, kidfds);
+    }
+
+    if ((data->pid = fork()) < 0) {
+        data->pid = 0;
+        return do_exec_fail(sess, "fork failed", ourfds, kidfds);
+    }
+    if (data->pid != 0) {
+        for (fd = 0; fd < KSUDO_NFDS; fd++) {
+            if (ourfds[fd] == -1) continue;
+
+            close(kidfds[fd]);
+            kss_data_open(sess, fd, ourfds[fd],
+                modes[fd] != KSUDO_FD_READ, modes[fd] != KSUDO_FD_WRITE);
+        }
+        return 1;
+    }
 
     debug("do_exec: done fork [%d]", (int)getpid());
 
+    limit_child(data->princ);
+    do_exec_setuid(pw);
+    do_exec_env(cmd, kidfds);
+
     /* the ASN.1 structures are not null-terminated */
     NewZ(cmds, len + ncmd);
     NewZ(cmdv, ncmd + 1);
@@ -0,0 +1,262 @@
+/*
+ * This file is part of ksudo, a system for limited remote command
+ * execution based on Kerberos principals.
+ *
+ * Copyright 2012 Ben Morrow <ben@morrow.me.uk>.
+ * Released under the 2-clause BSD licence.
+ *
+ * hostcache.c: a per-user cache of target hosts for the client.
+ *
+ * Every ksudo run would otherwise do a getaddrinfo with AI_CANONNAME
+ * before it can even start connecting. The answers are kept in a small
+ * file of fixed-size entries, which is mapped read-only to look a host
+ * up. Entries last KSUDO_HCACHE_TTL seconds.
+ *
+ * The file is never written in place: an update writes a new copy and
+ * renames it over the old one, so a reader sees either the old file or
+ * the new one and never half of each. Since it lives in a shared
+ * directory we only trust a file which is ours and not writable by
+ * anyone else; anything else is ignored.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <paths.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ksudo.h"
+
+#define HCACHE_MAGIC    0x6b736863UL    /* "kshc" */
+#define HCACHE_VERSION  1
+
+typedef struct {
+    time_t                  expires;
+    char                    host[MAXHOSTNAMELEN];
+    char                    canon[MAXHOSTNAMELEN];
+    int                     naddr;
+    socklen_t               addrlen[KSUDO_HCACHE_NADDR];
+    struct sockaddr_storage addr[KSUDO_HCACHE_NADDR];
+} hcache_ent;
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    version;
+    hcache_ent  ents[KSUDO_HCACHE_NENT];
+} hcache_file;
+
+/* What hcache_lookup returns: an addrinfo list for sock_connect, with
+ * everything it points to in the same allocation. ai must come first
+ * so hcache_free can find the whole thing.
+ */
+typedef struct {
+    struct addrinfo         ai[KSUDO_HCACHE_NADDR];
+    struct sockaddr_storage addr[KSUDO_HCACHE_NADDR];
+    char                    canon[MAXHOSTNAMELEN];
+} hcache_res;
+
+/* set to 0 by ksudo -N */
+int     hostcache   = 1;
+
+static char *
+hcache_path ()
+{
+    static char     *path;
+    const char      *dir;
+
+    if (path) return path;
+
+    if (!(dir = getenv("TMPDIR")) || !*dir)
+        dir = _PATH_TMP;
+    if (asprintf(&path, "%s%sksudo-hosts.%ld", dir,
+            (dir[strlen(dir) - 1] == '/' ? "" : "/"), (long)geteuid()) < 0)
+        err(EX_UNAVAILABLE, "can't build host cache path");
+
+    return path;
+}
+
+/* Map the cache file, if there's a valid one. Returns NULL if not. */
+static const hcache_file *
+hcache_map ()
+{
+    const hcache_file   *hc;
+    struct stat         sb;
+    int                 fd;
+
+    if ((fd = open(hcache_path(), O_RDONLY | O_NOFOLLOW)) < 0)
+        return NULL;
+
+    if (fstat(fd, &sb) < 0
+        || sb.st_uid != geteuid()
+        || (sb.st_mode & (S_IWGRP | S_IWOTH))
+        || sb.st_size != sizeof(hcache_file)
+    ) {
+        debug("hcache_map: ignoring [%s]", hcache_path());
+        close(fd);
+        return NULL;
+    }
+
+    hc = mmap(NULL, sizeof(hcache_file), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hc == MAP_FAILED) return NULL;
+
+    if (hc->magic != HCACHE_MAGIC || hc->version != HCACHE_VERSION) {
+        munmap((void *)hc, sizeof(hcache_file));
+        return NULL;
+    }
+    return hc;
+}
+
+static void
+hcache_unmap (const hcache_file *hc)
+{
+    munmap((void *)hc, sizeof(hcache_file));
+}
+
+/* Look up host. Returns an addrinfo list to be freed with hcache_free,
+ * with the canonical name in the first entry, or NULL if host isn't
+ * cached or has expired.
+ */
+struct addrinfo *
+hcache_lookup (const char *host)
+{
+    const hcache_file   *hc;
+    const hcache_ent    *e;
+    hcache_res          *r  = NULL;
+    time_t              now;
+    int                 i;
+
+    if (!hostcache || strlen(host) >= MAXHOSTNAMELEN) return NULL;
+    if (!(hc = hcache_map())) return NULL;
+
+    now = time(NULL);
+    for (i = 0; i < KSUDO_HCACHE_NENT; i++) {
+        e = &hc->ents[i];
+        if (e->expires > now && e->naddr > 0
+            && e->naddr <= KSUDO_HCACHE_NADDR
+            && !strncmp(e->host, host, MAXHOSTNAMELEN)
+        )
+            break;
+    }
+
+    if (i == KSUDO_HCACHE_NENT) {
+        debug("hcache_lookup: [%s] not cached", host);
+        hcache_unmap(hc);
+        return NULL;
+    }
+
+    NewZ(r, 1);
+    Copy(e->canon, r->canon, MAXHOSTNAMELEN);
+    r->canon[MAXHOSTNAMELEN - 1] = '\0';
+
+    for (i = 0; i < e->naddr; i++) {
+        if (e->addrlen[i] > sizeof(r->addr[i])) break;
+        Copy((char *)&e->addr[i], (char *)&r->addr[i], e->addrlen[i]);
+
+        r->ai[i].ai_family      = r->addr[i].ss_family;
+        r->ai[i].ai_socktype    = SOCK_STREAM;
+        r->ai[i].ai_protocol    = IPPROTO_TCP;
+        r->ai[i].ai_addr        = (struct sockaddr *)&r->addr[i];
+        r->ai[i].ai_addrlen     = e->addrlen[i];
+        if (i) r->ai[i - 1].ai_next = &r->ai[i];
+    }
+    r->ai[0].ai_canonname = r->canon;
+    hcache_unmap(hc);
+
+    debug("hcache_lookup: [%s] -> [%s], [%d] addrs", host, r->canon, i);
+    return r->ai;
+}
+
+void
+hcache_free (struct addrinfo *res)
+{
+    Free((hcache_res *)res);
+}
+
+/* Remember res, with its canonical name, as the answer for host. This
+ * replaces any entry for host, or else the one which expires first.
+ * Failing to write the cache isn't an error.
+ */
+void
+hcache_store (const char *host, const struct addrinfo *res)
+{
+    const hcache_file       *old;
+    hcache_file             *hc;
+    hcache_ent              *e;
+    const struct addrinfo   *r;
+    char                    *tmp;
+    time_t                  now;
+    ssize_t                 n;
+    int                     fd, i, victim;
+
+    if (!hostcache || !res->ai_canonname
+        || strlen(host) >= MAXHOSTNAMELEN
+        || strlen(res->ai_canonname) >= MAXHOSTNAMELEN
+    )
+        return;
+
+    NewZ(hc, 1);
+    if ((old = hcache_map())) {
+        *hc = *old;
+        hcache_unmap(old);
+    }
+    hc->magic   = HCACHE_MAGIC;
+    hc->version = HCACHE_VERSION;
+
+    now = time(NULL);
+    for (i = 0, victim = 0; i < KSUDO_HCACHE_NENT; i++) {
+        if (!strncmp(hc->ents[i].host, host, MAXHOSTNAMELEN)) {
+            victim = i;
+            break;
+        }
+        if (hc->ents[i].expires < hc->ents[victim].expires)
+            victim = i;
+    }
+
+    e = &hc->ents[victim];
+    Zero(e, 1);
+    e->expires = now + KSUDO_HCACHE_TTL;
+    strcpy(e->host, host);
+    strcpy(e->canon, res->ai_canonname);
+    for (r = res; r && e->naddr < KSUDO_HCACHE_NADDR; r = r->ai_next) {
+        if (r->ai_addrlen > sizeof(e->addr[0])) continue;
+        e->addrlen[e->naddr] = r->ai_addrlen;
+        Copy((char *)r->ai_addr, (char *)&e->addr[e->naddr],
+            r->ai_addrlen);
+        e->naddr++;
+    }
+
+    if (asprintf(&tmp, "%s.XXXXXX", hcache_path()) < 0)
+        err(EX_UNAVAILABLE, "can't build host cache path");
+
+    /* mkstemp gives us mode 0600 */
+    if ((fd = mkstemp(tmp)) < 0) {
+        debug("hcache_store: can't create [%s]: %s", tmp, strerror(errno));
+        goto out;
+    }
+    n = write(fd, hc, sizeof(*hc));
+    close(fd);
+
+    if (n != sizeof(*hc) || rename(tmp, hcache_path()) < 0) {
+        debug("hcache_store: can't write [%s]: %s",
+            hcache_path(), strerror(errno));
+        unlink(tmp);
+        goto out;
+    }
+    debug("hcache_store: [%s] -> [%s]", host, res->ai_canonname);
+
+  out:
+    Free(tmp);
+    Free(hc);
+}
@@ -9,16 +9,37 @@
 #include <sys/wait.h>
 #include <arpa/inet.h>
 
+#include "config.h"
+#ifdef HAVE_KQUEUE
+#  include <sys/event.h>
+#endif
+
 #include <fcntl.h>
 #include <signal.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #include "ksudo.h"
 
 int             nksfds      = 0;
+/* the number of ksfds actually open */
+static int      nksfopen    = 0;
 ksudo_fd        *ksfds;
 struct pollfd   *pollfds;
 
+#ifdef HAVE_KQUEUE
+/* how many events we take from the kernel at once */
+#  define KQ_NEVENTS    64
+
+static int              kq          = -1;
+/* ksfds whose events have changed since we last told the kernel */
+static int              *kqdirty    = NULL;
+static int              nkqdirty    = 0;
+static int              szkqdirty   = 0;
+static struct kevent    *kqchanges  = NULL;
+static int              szkqchanges = 0;
+#endif
+
 int
 ksf_open (int fd, KSUDO_FD_MODE mode, KSF_TYPE type, void *data)
 {
@@ -66,12 +87,17 @@ ksf_open (int fd, KSUDO_FD_MODE mode, KSF_TYPE type, void *data)
     bzero(ksf, sizeof *ksf);
     ksf->ops        = type;
     ksf->data       = data;
+    KsfDIRTY(i);
 
     SYSCHK(fdflags = fcntl(fd, F_GETFL, 0),
         "can't read fd flags");
     SYSCHK(fcntl(fd, F_SETFL, fdflags | O_NONBLOCK),
         "can't set fd nonblocking");
+    /* don't leak other sessions' fds into our children */
+    SYSCHK(fcntl(fd, F_SETFD, FD_CLOEXEC),
+        "can't set fd close-on-exec");
 
+    nksfopen++;
     KsfCALLOP(i, open);
     debug("ksf_open fd [%d] ops [%lx] data [%lx]",
         fd, type, data);
@@ -84,41 +110,61 @@ ksf_close (int ix)
 {
     debug("ksf_close [%d]", ix);
     KsfCALLOP(ix, close);
-    Free(KsfDATAv(ix));
+    if (!KsfL(ix).arena)
+        Free(KsfDATAv(ix));
+    KsfDATAv(ix)    = NULL;
+    close(KsfFD(ix));
     KsfPOLL(ix).fd  = -1;
+    nksfopen--;
 }
 
-void
-ksf_read (int ix, ksudo_buf *buf)
+/* Read at most max bytes into buf. Returns the number of bytes read
+ * (0 if the read would have blocked), or -1 on EOF or error. The
+ * caller is responsible for closing the ksfd.
+ */
+ssize_t
+ksf_read (int ix, ksudo_buf *buf, size_t max)
 {
-    dRV;
+    ssize_t         rv;
+    size_t          len;
     int             fd      = KsfFD(ix);
 
     BufENSURE(buf, KSUDO_BUFSIZ);
-    if (!BufFREE(buf)) goto out;
+    len = BufFREE(buf) < max ? BufFREE(buf) : max;
+    if (!len) {
+        rv = 0;
+        goto out;
+    }
 
-    rv = read(fd, BufEND(buf), BufFREE(buf));
+    rv = read(fd, BufEND(buf), len);
     debug("ksf_read [%d] [%lx] [%ld] -> [%d]", 
-        fd, BufEND(buf), BufFREE(buf), rv);
+        fd, BufEND(buf), len, rv);
 
-    if (rv == -1 && errno == EAGAIN) return;
-    SYSCHK(rv, "read failed");
+    if (rv == -1 && errno == EAGAIN) return 0;
+    if (rv == -1) {
+        warn("read failed");
+        return -1;
+    }
 
     if (rv == 0) {
         debug("ksf_read: EOF on [%d]", ix);
-        ksf_close(ix);
+        return -1;
     }
 
     BufEXTEND(buf, rv);
 
   out:
     if (!BufFREE(buf)) KsfMODE_CLR(ix, KSFm_IN);
+    return rv;
 }
 
-void
+/* Write as much of buf as we can. Returns the number of bytes
+ * written, or -1 on error.
+ */
+ssize_t
 ksf_write (int ix, ksudo_buf *buf)
 {
-    dRV;
+    ssize_t         rv      = 0;
     int             fd      = KsfFD(ix);
 
     if (!BufFILL(buf)) goto out;
@@ -127,24 +173,152 @@ ksf_write (int ix, ksudo_buf *buf)
     debug("ksf_write [%d] [%lx] [%ld] -> [%d]", 
         fd, BufSTART(buf), BufFILL(buf), rv);
 
-    if (rv == -1 && errno == EAGAIN) return;
-    SYSCHK(rv, "write failed");
+    if (rv == -1 && errno == EAGAIN) return 0;
+    if (rv == -1) {
+        warn("write failed");
+        return -1;
+    }
 
     BufCONSUME(buf, rv);
 
   out:
     if (!BufFILL(buf)) KsfMODE_CLR(ix, KSFm_OUT);
+    return rv;
 }
 
+#ifdef HAVE_KQUEUE
+
 void
-ioloop ()
+ksf_dirty (int ix)
+{
+    if (nkqdirty == szkqdirty) {
+        szkqdirty = szkqdirty ? szkqdirty * 2 : 16;
+        Renew(kqdirty, szkqdirty);
+    }
+    kqdirty[nkqdirty++]     = ix;
+    KsfL(ix).kqdirty        = 1;
+}
+
+/* Turn the dirty list into a changelist for kevent. Closing an fd
+ * takes its events out of the kqueue, so a closed ksfd needs nothing.
+ */
+static int
+kq_changes ()
+{
+    int     i, ix, n = 0;
+    short   want, have;
+
+    if (szkqchanges < 2 * nkqdirty) {
+        szkqchanges = 2 * szkqdirty;
+        Renew(kqchanges, szkqchanges);
+    }
+
+    for (i = 0; i < nkqdirty; i++) {
+        ix = kqdirty[i];
+        if (KsfFD(ix) == -1 || !KsfL(ix).kqdirty) continue;
+        KsfL(ix).kqdirty = 0;
+
+        want = KsfPOLL(ix).events;
+        have = KsfL(ix).kqevents;
+
+#define KQCHANGE(m, filt) \
+        if ((want ^ have) & (m)) \
+            EV_SET(&kqchanges[n++], KsfFD(ix), (filt), \
+                (want & (m)) ? EV_ADD|EV_ENABLE : EV_DISABLE, \
+                0, 0, (void *)(intptr_t)ix)
+
+        KQCHANGE(KSFm_IN,   EVFILT_READ);
+        KQCHANGE(KSFm_OUT,  EVFILT_WRITE);
+#undef KQCHANGE
+
+        KsfL(ix).kqevents = want;
+    }
+
+    nkqdirty = 0;
+    return n;
+}
+
+/* Pass our changes to the kernel and wait for events in one syscall.
+ * Only ksfds which are actually ready come back, so unlike poll this
+ * costs nothing for idle sessions.
+ */
+static void
+io_wait ()
+{
+    dRV;
+    struct kevent   ev[KQ_NEVENTS];
+    struct timespec ts, *tsp    = NULL;
+    int             ms, nch, i, ix;
+
+    if (kq == -1) {
+        SYSCHK(kq = kqueue(), "can't create kqueue");
+        /* an upgrade would otherwise inherit it */
+        SYSCHK(fcntl(kq, F_SETFD, FD_CLOEXEC),
+            "can't set kqueue close-on-exec");
+    }
+
+    if ((ms = timer_next()) != INFTIM) {
+        ts.tv_sec   = ms / 1000;
+        ts.tv_nsec  = (ms % 1000) * 1000000L;
+        tsp         = &ts;
+    }
+
+    nch = kq_changes();
+    rv  = kevent(kq, kqchanges, nch, ev, KQ_NEVENTS, tsp);
+    if (rv < 0 && errno != EINTR) SYSCHK(rv, "kevent failed");
+
+    for (i = 0; i < rv; i++) {
+        ix = (intptr_t)ev[i].udata;
+
+        if (ev[i].flags & EV_ERROR) {
+            warnx("kevent failed for [%d]: %s",
+                (int)ev[i].ident, strerror(ev[i].data));
+            continue;
+        }
+
+        /* an earlier op may have closed it, or stopped wanting this
+         * event, and the ix may even have been reused */
+        if (KsfFD(ix) != (int)ev[i].ident) continue;
+
+        if (ev[i].filter == EVFILT_READ && KsfMODE_IS(ix, KSFm_IN))
+            KsfCALLOP(ix, read);
+        if (ev[i].filter == EVFILT_WRITE && KsfMODE_IS(ix, KSFm_OUT))
+            KsfCALLOP(ix, write);
+    }
+}
+
+#else
+
+static void
+io_wait ()
 {
     dRV;
     int i;
 
+    rv = poll(pollfds, nksfds, timer_next());
+    if (rv < 0 && errno != EINTR) SYSCHK(rv, "poll failed");
+
+    for (i = 0; i < nksfds; i++) {
+        short   ev  = KsfPOLL(i).revents;
+        KsfPOLL(i).revents = 0;
+
+        /* an earlier op may have closed it */
+        if (KsfFD(i) == -1) continue;
+
+        if (ev & POLLIN)    KsfCALLOP(i, read);
+        if (ev & POLLOUT)   KsfCALLOP(i, write);
+    }
+}
+
+#endif
+
+/* Returns when there is nothing left to do */
+void
+ioloop ()
+{
     setup_signals();
 
-    while (1) {
+    while (nksfopen) {
         handle_signals();
 
         /* There is a race here: if a signal comes in between the
@@ -153,16 +327,8 @@ ioloop ()
          * solution is pselect(2), which means mucking about with signal
          * masks and select fd_sets.
          */
+        io_wait();
 
-        rv = poll(pollfds, nksfds, INFTIM);
-        if (rv < 0 && errno != EINTR) SYSCHK(rv, "poll failed");
-
-        for (i = 0; i < nksfds; i++) {
-            short   ev  = KsfPOLL(i).revents;
-            KsfPOLL(i).revents = 0;
-
-            if (ev & POLLIN)    KsfCALLOP(i, read);
-            if (ev & POLLOUT)   KsfCALLOP(i, write);
-        }
+        timer_run();
     }
 }
@@ -10,6 +10,7 @@
 
 #include <netdb.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include "ksudo.h"
 
@@ -25,13 +26,33 @@ int                     sigwant[1];
 ksudo_sigop             sigops[1];
 volatile sig_atomic_t   sigcaught[1];
 
+/* env opts from the command line */
+static int              envc    = 0;
+static KSUDO_ENV_OPT    *envv   = NULL;
+
+/* report the command's resource usage, like time -l */
+static int              showtime    = 0;
+/* send the CMD straight after the AP-REQ */
+static int              pipeline    = 0;
+/* put "server: " before each line of the command's output */
+static char             *lineprefix = NULL;
+
 static KSUDO_SOP(sop_read_creds);
 
+KSUDO_MSGOP(msgop_err);
 KSUDO_MSGOP(msgop_exit);
+KSUDO_MSGOP(msgop_queued);
+
+static const ksudo_msgop client_msgops[KSUDO_MSG_num] = {
+    KssMSGOP(err)       = msgop_err,
+    KssMSGOP(exit)      = msgop_exit,
+    KssMSGOP(queued)    = msgop_queued,
+};
 
 void    get_creds   (const char *host, krb5_creds *cred);
 void    init        ();
-void    send_cmd    ();
+void    open_stdio  (int sess);
+void    send_cmd    (int sess);
 void    send_creds  (krb5_auth_context *k5a, krb5_creds *cred);
 void    usage       ();
 
@@ -106,41 +127,111 @@ get_creds (const char *host, krb5_creds *cred)
     free(srvname);
 }
 
+/* Our own stdin, stdout and stderr are relayed to the remote command,
+ * unless the command line redirected them on the server.
+ */
+static const KSUDO_FD_MODE stdio_modes[3] = {
+    KSUDO_FD_READ, KSUDO_FD_WRITE, KSUDO_FD_WRITE
+};
+
+/* Which of the remote command's stdio fds has the command line
+ * redirected on the server?
+ */
+static void
+stdio_redirected (ksudo_sdata_client *data, int *redir)
+{
+    KSUDO_ENV_OPT   *opt;
+    int             i, fd;
+
+    Zero(redir, 3);
+    for (i = 0; i < data->envc; i++) {
+        opt = &data->envv[i];
+        fd  = opt->element == choice_KSUDO_ENV_OPT_lfd ? opt->u.lfd.fd
+            : opt->element == choice_KSUDO_ENV_OPT_dup ? opt->u.dup.onto
+            : -1;
+        if (fd >= 0 && fd < 3) redir[fd] = 1;
+    }
+}
+
 void
-send_cmd (char *usr, int cmdc, char **cmdv)
+send_cmd (int sess)
 {
-    dRV; dKRBCHK;
-    KSUDO_MSG   msg, decode;
-    KSUDO_CMD   *cmd;
-    int         i;
-    size_t      len, outlen;
-    krb5_data   der, packet;
+    dKSSOP(client);
+    KSUDO_MSG       msg;
+    KSUDO_CMD       *cmd;
+    KSUDO_ENV_OPT   *opt;
+    int             i, fd, nenv;
+    int             redir[3];
+
+    stdio_redirected(data, redir);
 
     msg.element         = choice_KSUDO_MSG_cmd;
     cmd = &msg.u.cmd;
-    cmd->user.length    = strlen(usr);
-    cmd->user.data      = strdup(usr);
-    cmd->env.len        = 0;
-    cmd->env.val        = NULL;
-    cmd->cmd.len        = cmdc;
-
-    New(cmd->cmd.val, cmdc);
-    for (i = 0; i < cmdc; i++) {
-        cmd->cmd.val[i].length  = strlen(cmdv[i]);
-        cmd->cmd.val[i].data    = strdup(cmdv[i]);
+    cmd->user.length    = strlen(data->usr);
+    cmd->user.data      = strdup(data->usr);
+    cmd->cmd.len        = data->cmdc;
+
+    New(cmd->cmd.val, data->cmdc);
+    for (i = 0; i < data->cmdc; i++) {
+        cmd->cmd.val[i].length  = strlen(data->cmdv[i]);
+        cmd->cmd.val[i].data    = strdup(data->cmdv[i]);
     }
 
-    write_msg(0, &msg);
+    New(cmd->env.val, data->envc + 3);
+    nenv = 0;
+    for (fd = 0; fd < 3; fd++) {
+        if (redir[fd]) continue;
+
+        opt = &cmd->env.val[nenv++];
+        opt->element        = choice_KSUDO_ENV_OPT_rfd;
+        opt->u.rfd.fd       = fd;
+        opt->u.rfd.mode     = stdio_modes[fd];
+    }
+    for (i = 0; i < data->envc; i++)
+        copy_KSUDO_ENV_OPT(&data->envv[i], &cmd->env.val[nenv++]);
+    cmd->env.len = nenv;
+
+    write_msg(sess, &msg);
     free_KSUDO_MSG(&msg);
 }
 
+/* Start relaying our stdio. This waits for the AP-REP even when the
+ * CMD didn't, so nothing of ours goes out until the server has proved
+ * who it is.
+ */
+void
+open_stdio (int sess)
+{
+    dKSSOP(client);
+    int     fd;
+    int     redir[3];
+
+    stdio_redirected(data, redir);
+    for (fd = 0; fd < 3; fd++) {
+        if (redir[fd]) continue;
+        kss_data_open(sess, fd, fd,
+            stdio_modes[fd] == KSUDO_FD_READ,
+            stdio_modes[fd] == KSUDO_FD_WRITE);
+        if (lineprefix && stdio_modes[fd] == KSUDO_FD_WRITE)
+            kss_data_prefix(sess, fd, lineprefix);
+    }
+}
+
 void
 send_creds (krb5_auth_context *k5a, krb5_creds *cred)
 {
     dKRBCHK;
     krb5_data               *packet;
+    ssize_t                 n;
+
+    /* Have mk_req choose a subkey for the session. The server keys
+     * KSUDO-PRIV with it too, so we can encrypt the CMD before we've
+     * seen the AP-REP. */
+    KRBCHK(krb5_auth_con_addflags(k5ctx, *k5a,
+            KRB5_AUTH_CONTEXT_USE_SUBKEY, NULL),
+        "can't set auth context flags");
 
-    New(packet, 1);
+    packet = pkt_get(0);
     KRBCHK(krb5_mk_req_extended(k5ctx, k5a, 0, NULL, cred, packet),
         "can't build AP-REQ");
 
@@ -149,6 +240,18 @@ send_creds (krb5_auth_context *k5a, krb5_creds *cred)
         (long)packet->length, HEX(0), HEX(1), HEX(2), HEX(3), HEX(4),
         HEX(5), HEX(6), HEX(7), HEX(8));
 #undef HEX
+
+    /* with Fast Open this is where we connect */
+    n = sock_sendfirst(KsfFD(KssMSGFD(0)), packet->data, packet->length);
+    if (n == packet->length) {
+        pkt_put(packet);
+        return;
+    }
+    if (n) {
+        Move((char *)packet->data + n, (char *)packet->data,
+            packet->length - n);
+        packet->length -= n;
+    }
     MbfPUSH(KssMBUF(0), packet);
 }
 
@@ -164,32 +267,112 @@ static KSUDO_SOP(sop_read_creds)
         HEX(5), HEX(6), HEX(7), HEX(8));
 #undef HEX
 
-    KRBCHK(krb5_rd_rep(k5ctx, KssK5A(sess), pkt, &ep),
-        "can't read AP-REP");
+    if ((ke = krb5_rd_rep(k5ctx, KssK5A(sess), pkt, &ep))) {
+        KRB_ERROR   kerr;
+
+        /* an overloaded server answers with a KRB-ERROR instead */
+        if (!krb5_rd_error(k5ctx, pkt, &kerr)) {
+            ke = krb5_error_from_rd_error(k5ctx, &kerr, NULL);
+            if (ke == KRB5KDC_ERR_SVC_UNAVAILABLE)
+                errx(EX_TEMPFAIL, "%s", kerr.e_text ? *kerr.e_text
+                    : "server busy");
+        }
+        krb5_err(k5ctx, EX_UNAVAILABLE, ke, "can't read AP-REP");
+    }
     krb5_free_ap_rep_enc_part(k5ctx, ep);
 
     debug("done AP exchange");
 
-    send_cmd(data->usr, data->cmdc, data->cmdv);
+    if (!pipeline) send_cmd(sess);
+    open_stdio(sess);
 
-    KssSETOP(sess, exit, msgop_exit);
+    KssSETOPS(sess, client_msgops);
+    kss_data_ops(sess);
     KssNEXT(sess, sop_dispatch_msg);
 }
 
+KSUDO_MSGOP(msgop_err)
+{
+    dMSGOP(client, ERR);
+    int     ex;
+
+    ckMSGOP(err);
+    switch (msg->code) {
+        case KSUDO_ENOENT:  ex = EX_NOUSER;         break;
+        case KSUDO_EACCES:
+        case KSUDO_EPERM:   ex = EX_NOPERM;         break;
+        case KSUDO_ENOEXEC: ex = EX_UNAVAILABLE;    break;
+        case KSUDO_EBUSY:   ex = EX_TEMPFAIL;       break;
+        default:            ex = EX_PROTOCOL;       break;
+    }
+
+    kss_data_flush(sess);
+
+    if (msg->retry)
+        errx(ex, "server error: %.*s, retry in %u seconds",
+            (int)msg->msg.length, (char *)msg->msg.data, *msg->retry);
+    errx(ex, "server error: %.*s",
+        (int)msg->msg.length, (char *)msg->msg.data);
+}
+
+/* The server has no exec slot for us yet. Only say so to a terminal,
+ * or with -T, so scripts don't see it.
+ */
+KSUDO_MSGOP(msgop_queued)
+{
+    dMSGOP(client, QUEUED);
+
+    ckMSGOP(queued);
+    debug("QUEUED position [%u] waited [%u]", msg->position, msg->waited);
+    if (!showtime && !isatty(2)) return;
+
+    if (msg->position)
+        warnx("waiting for the server, position %u", msg->position);
+    else
+        warnx("started after %u.%03u seconds",
+            msg->waited / 1000, msg->waited % 1000);
+}
+
+static void
+print_rusage (KSUDO_RUSAGE *ru)
+{
+#define TV(t) (unsigned long)(t).sec, (unsigned long)(t).usec / 10000
+    fprintf(stderr, "%10lu.%02lu real %10lu.%02lu user %10lu.%02lu sys\n",
+        TV(ru->real), TV(ru->utime), TV(ru->stime));
+#undef TV
+    fprintf(stderr, "%10lu  %s\n", (unsigned long)ru->maxrss,
+        "maximum resident set size");
+    fprintf(stderr, "%10lu  %s\n", (unsigned long)ru->inblock,
+        "block input operations");
+    fprintf(stderr, "%10lu  %s\n", (unsigned long)ru->oublock,
+        "block output operations");
+    fprintf(stderr, "%10lu  %s\n", (unsigned long)ru->nvcsw,
+        "voluntary context switches");
+    fprintf(stderr, "%10lu  %s\n", (unsigned long)ru->nivcsw,
+        "involuntary context switches");
+}
+
 KSUDO_MSGOP(msgop_exit)
 {
     dMSGOP(client, EXIT);
 
     ckMSGOP(exit);
-    switch(msg->element) {
-        case choice_KSUDO_EXIT_status:
-            debug("EXIT STATUS [%lu]", msg->u.status);
-            exit(msg->u.status);
+    kss_data_flush(sess);
+
+    if (showtime) {
+        if (msg->rusage)    print_rusage(msg->rusage);
+        else                warnx("server sent no resource usage");
+    }
+
+    switch(msg->how.element) {
+        case choice_KSUDO_EXIT_HOW_status:
+            debug("EXIT STATUS [%lu]", msg->how.u.status);
+            exit(msg->how.u.status);
             break;
 
-        case choice_KSUDO_EXIT_signal: {
+        case choice_KSUDO_EXIT_HOW_signal: {
             dRV;
-            int                     ksig = msg->u.signal;
+            int                     ksig = msg->how.u.signal;
             const ksudo_sigmapping *sig;
             
             if (!ksig)
@@ -206,7 +389,7 @@ KSUDO_MSGOP(msgop_exit)
         }
 
         default:
-            debug("UNKNOWN EXIT [%lu]", msg->element);
+            debug("UNKNOWN EXIT [%lu]", msg->how.element);
             break;
     }
 }
@@ -224,37 +407,159 @@ create_client_sock(const char *srv, char **canon)
 void
 usage ()
 {
-    errx(EX_USAGE, "Usage: ksudo server user cmd");
+    errx(EX_USAGE, "Usage: ksudo [-NPpT] [-o sockopt] [-u socket] [-C dir] "
+        "[-r fd:path] [-w fd:path] [-d fd:onto] server user cmd\n"
+        "       ksudo -A [-N] [-l hostlist]...");
+}
+
+/* Parse the "fd:" at the start of an option argument */
+static int
+parse_fd (char **arg)
+{
+    char    *end;
+    long    fd;
+
+    fd = strtol(*arg, &end, 10);
+    if (end == *arg || *end != ':' || fd < 0 || fd >= KSUDO_NFDS)
+        usage();
+
+    *arg = end + 1;
+    return fd;
+}
+
+static KSUDO_ENV_OPT *
+add_envopt ()
+{
+    KSUDO_ENV_OPT   *opt;
+
+    Renew(envv, envc + 1);
+    opt = &envv[envc++];
+    Zero(opt, 1);
+    return opt;
+}
+
+static void
+add_lfd (char *arg, KSUDO_FD_MODE mode)
+{
+    KSUDO_ENV_OPT   *opt;
+    int             fd;
+
+    fd  = parse_fd(&arg);
+    opt = add_envopt();
+    opt->element        = choice_KSUDO_ENV_OPT_lfd;
+    opt->u.lfd.fd       = fd;
+    opt->u.lfd.mode     = mode;
+    AsnString(opt->u.lfd.path, arg);
 }
 
 int
 main (int argc, char **argv)
 {
-    dKRBCHK;
-    char                *srv, *canon;
+    dRV; dKRBCHK;
+    char                *srv, *canon, *end;
     ksudo_sdata_client  *sdata;
-    int                 sock;
+    KSUDO_ENV_OPT       *opt;
+    int                 sock, ch, fd, agent = 0;
     krb5_creds          cred;
 
-    if (argc < 4) usage();
-    srv = argv[1];
+    while ((ch = getopt(argc, argv, "AC:d:l:No:Ppr:Tu:w:")) != -1) {
+        switch (ch) {
+            case 'A':
+                agent = 1;
+                break;
+
+            case 'C':
+                opt = add_envopt();
+                opt->element = choice_KSUDO_ENV_OPT_cwd;
+                AsnString(opt->u.cwd, optarg);
+                break;
+
+            case 'd':
+                fd  = parse_fd(&optarg);
+                opt = add_envopt();
+                opt->element    = choice_KSUDO_ENV_OPT_dup;
+                opt->u.dup.fd   = fd;
+                opt->u.dup.onto = strtol(optarg, &end, 10);
+                if (end == optarg || *end || opt->u.dup.onto < 0
+                    || opt->u.dup.onto >= KSUDO_NFDS)
+                    usage();
+                break;
+
+            case 'l':
+                agent_list(optarg);
+                break;
+
+            case 'N':
+                hostcache = 0;
+                break;
+
+            case 'o':
+                if (!sock_option(optarg)) usage();
+                break;
+
+            case 'P':
+                lineprefix = "";
+                break;
+
+            case 'p':
+                pipeline = 1;
+                break;
+
+            case 'r':
+                add_lfd(optarg, KSUDO_FD_READ);
+                break;
+
+            case 'T':
+                showtime = 1;
+                break;
+
+            case 'u':
+                sockpath = optarg;
+                break;
+
+            case 'w':
+                add_lfd(optarg, KSUDO_FD_WRITE);
+                break;
+
+            default:
+                usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (agent) {
+        if (argc) usage();
+        init();
+        agent_run();
+    }
+
+    if (argc < 3) usage();
+    srv = argv[0];
+    if (lineprefix)
+        SYSCHK(asprintf(&lineprefix, "%s: ", srv),
+            "can't build line prefix");
 
     init();
 
     create_client_sock(srv, &canon);
 
     sdata = KssDATA(0, client);
-    sdata->usr  = argv[2];
-    sdata->cmdv = argv + 3;
-    sdata->cmdc = argc - 3;
+    sdata->usr  = argv[1];
+    sdata->cmdv = argv + 2;
+    sdata->cmdc = argc - 2;
+    sdata->envc = envc;
+    sdata->envv = envv;
 
     get_creds(canon, &cred);
     free(canon);
 
     send_creds(&KssK5A(0), &cred);
     krb5_free_cred_contents(k5ctx, &cred);
+    if (pipeline) send_cmd(0);
 
     ioloop();
 
-    krb5_free_context(k5ctx);
+    /* msgop_exit doesn't return */
+    errx(EX_UNAVAILABLE, "lost connection to server");
 }
@@ -9,12 +9,16 @@
 #ifndef __ksudo_h_not_asn1__
 #define __ksudo_h_not_asn1__
 
+#include <sys/types.h>
+
 #include <err.h>
 #include <errno.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <sysexits.h>
+#include <time.h>
 
 #include <krb5.h>
 
@@ -27,9 +31,31 @@
 #define KSUDO_SRV       "ksudo"
 #define KSUDO_PORT      "8487"
 
+#ifndef KSUDO_POLICY
+#  define KSUDO_POLICY  "/usr/local/etc/ksudo.policy"
+#endif
+
+/* ksudod also listens here, for clients on the same host */
+#ifndef KSUDO_SOCKET
+#  define KSUDO_SOCKET  "/var/run/ksudod.sock"
+#endif
+
 /* I might implement variable-sized buffers later */
 #define KSUDO_BUFSIZ    10240
 
+/* Logical fd numbers within a session run from 0 to KSUDO_NFDS-1 */
+#define KSUDO_NFDS      10
+
+/* Admission control defaults for ksudod. A cap of 0 means no limit. */
+#define KSUDO_BACKLOG       128
+#define KSUDO_MAX_HANDSHAKE 64
+#define KSUDO_MAX_CHILDREN  256
+#define KSUDO_MAX_BUFFERED  (64*1024*1024)
+/* buffers, arenas and queued messages, over all sessions */
+#define KSUDO_MAX_MEMORY    (1024*1024*1024UL)
+/* the retry hint sent with KSUDO_EBUSY, in seconds */
+#define KSUDO_BUSY_RETRY    5
+
 extern krb5_context         k5ctx;
 
 typedef unsigned char       uchar;
@@ -67,6 +93,9 @@ typedef struct {
         BufINIT(b); \
     } while (0)
 
+/* the number of free buffers buf_put keeps for reuse */
+#define KSUDO_BUF_CACHE 256
+
 /* Attempt to ensure BufFREE is at least n. This may not succeed, so be
  * sure to check BufFREE afterwards.
  */
@@ -103,53 +132,113 @@ typedef struct {
         } \
     } while (0)
 
+/* This is a queue of encrypted packets waiting to be written to a msg
+ * fd. ptr points to the first unwritten byte of the packet at the head.
+ *
+ * Every queued packet comes from pkt_get and goes back with pkt_put,
+ * which keeps it for reuse, and carries its own link. pkt.data points
+ * into buf if the packet fits; otherwise, or if krb5 filled it in, the
+ * data is separate and pkt_put frees it. pkt must come first, so the
+ * packet can be found from the krb5_data.
+ */
+#define KSUDO_PKT_SIZE  (KSUDO_BUFSIZ + 64)
+#define KSUDO_PKT_CACHE 256
+
+typedef struct ksudo_msgq {
+    krb5_data           pkt;
+    struct ksudo_msgq   *next;
+    uchar               buf[KSUDO_PKT_SIZE];
+} ksudo_msgq;
+
 typedef struct {
-    krb5_data   *cur;
+    ksudo_msgq  *head;
+    ksudo_msgq  **tail;
     void        *ptr;
-    krb5_data   *next;
+    int         len;
 } ksudo_msgbuf;
 
-#define MbfCUR(b)       ((b)->cur)
-#define MbfCURp(b)      (MbfCUR(b) ? MbfCUR(b)->data : NULL)
-#define MbfCURl(b)      (MbfCUR(b) ? MbfCUR(b)->length : 0)
+/* The number of DATA messages we will queue for one stream before
+ * write_msg starts refusing them. Control messages are always queued.
+ */
+#define KSUDO_MSGQ_MAX  4
+/* The maximum number of packets passed to a single writev */
+#define KSUDO_MSGQ_IOV  8
+
+#define MbfCUR(b)       ((b)->head ? &(b)->head->pkt : NULL)
+#define MbfCURp(b)      ((b)->head ? (b)->head->pkt.data : NULL)
+#define MbfCURl(b)      ((b)->head ? (b)->head->pkt.length : 0)
 
 #define MbfPTR(b)       ((b)->ptr)
 #define MbfPTRl(b)      (MbfCURl(b) - (MbfPTR(b) - MbfCURp(b)))
 
-#define MbfNEXT(b)      ((b)->next)
-#define MbfNEXTp(b)     (MbfNEXT(b) ? MbfNEXT(b)->data : NULL)
-#define MbfNEXTl(b)     (MbfNEXT(b) ? MbfNEXT(b)->length : 0)
-#define MbfLEFT(b)      (MbfPTRl(b) + MbfNEXTl(b))
-
-#define MbfAVAIL(b)     (!MbfNEXT(b))
+#define MbfLEFT(b)      ((b)->head ? MbfPTRl(b) : 0)
+#define MbfAVAIL(b)     ((b)->len < KSUDO_MSGQ_MAX)
 
-#define NewMsgBuf(b)    NewZ(b, 1)
+#define MbfINIT(b) \
+    do { \
+        (b)->head   = NULL; \
+        (b)->tail   = &(b)->head; \
+        (b)->ptr    = NULL; \
+        (b)->len    = 0; \
+    } while (0)
 
-#define MbfPUSH(b, d) \
+/* Outgoing messages wait here, still as plaintext DER, until there is
+ * room on the wire queue. They are only encrypted as they move across,
+ * so the KRB-PRIV sequence numbers are in the order the peer sees.
+ *
+ * Control messages (WINDOW, SIGNAL, CMD) go first. DATA and CLOSE are
+ * queued per logical fd, so a CLOSE can't overtake its stream's data,
+ * and the streams share the link by deficit round-robin. EXIT and ERR
+ * wait until every stream has drained.
+ */
+typedef struct {
+    ksudo_msgbuf    ctl;
+    ksudo_msgbuf    data[KSUDO_NFDS];
+    ksudo_msgbuf    last;
+
+    /* DATA and CLOSE messages queued, over all the streams */
+    int             ndata;
+    /* the stream DRR is serving, and whether it has had its quantum */
+    int             cur;
+    unsigned        fresh   : 1;
+    size_t          deficit[KSUDO_NFDS];
+} ksudo_msgsched;
+
+/* The DRR quantum: one full DATA message */
+#define KSUDO_SCHED_QUANTUM     KSUDO_PKT_SIZE
+
+#define SchedINIT(s) \
     do { \
-        Assert(MbfAVAIL(b)); \
-        if (MbfCUR(b)) \
-            (b)->next = (d); \
-        else { \
-            (b)->cur = (d); \
-            (b)->ptr = (d)->data; \
+        int __i; \
+        \
+        MbfINIT(&(s)->ctl); \
+        MbfINIT(&(s)->last); \
+        for (__i = 0; __i < KSUDO_NFDS; __i++) { \
+            MbfINIT(&(s)->data[__i]); \
+            (s)->deficit[__i] = 0; \
         } \
+        (s)->ndata  = 0; \
+        (s)->cur    = 0; \
+        (s)->fresh  = 1; \
     } while (0)
 
-#define MbfCONSUME(b, n) \
+#define NewMsgBuf(b) \
     do { \
-        Assert(MbfCUR(b)); \
-        if ((n) < MbfPTRl(b)) \
-            (b)->ptr += (n); \
-        else { \
-            Assert(MbfLEFT(b) <= (n)); \
-            Assert(MbfNEXT(b) || (n) == MbfPTRl(b)); \
-            \
-            (b)->ptr = MbfNEXTp(b) + ((n) - MbfPTRl(b)); \
-            krb5_free_data(k5ctx, MbfCUR(b)); \
-            (b)->cur = MbfNEXT(b); \
-            (b)->next = NULL; \
-        } \
+        New(b, 1); \
+        MbfINIT(b); \
+    } while (0)
+
+#define MbfPUSH(b, d) \
+    do { \
+        ksudo_msgq  *__q    = (ksudo_msgq *)(d); \
+        \
+        msgq_bytes  += __q->pkt.length; \
+        __q->next   = NULL; \
+        *(b)->tail  = __q; \
+        (b)->tail   = &__q->next; \
+        if ((b)->head == __q) \
+            (b)->ptr = __q->pkt.data; \
+        (b)->len++; \
     } while (0)
 
 typedef void (*ksudo_fdop)(int);
@@ -168,12 +257,21 @@ typedef struct {
 typedef struct {
     unsigned    blocking    : 1;
     unsigned    wndsent     : 1;
+    /* data belongs to a session arena, so don't free it */
+    unsigned    arena       : 1;
 
     ksudo_fdops     *ops;
     void            *data;
 
     /* the ix of the ksfd we are blocked on */
     int             blocked;
+
+#ifdef HAVE_KQUEUE
+    /* on the list of ksfds whose events have changed */
+    unsigned        kqdirty     : 1;
+    /* the events the kqueue currently has enabled */
+    short           kqevents;
+#endif
 } ksudo_fd;
 
 #define KsfL(f)     (ksfds[(f)])
@@ -208,19 +306,109 @@ typedef struct {
      (m) == KSFm_OUT        ? "OUT" : \
      "???")
 
+/* pollfds[].events is always the set of events we want. With kqueue
+ * changes are collected and passed to the kernel in one go, the next
+ * time round ioloop.
+ */
+#ifdef HAVE_KQUEUE
+#  define KsfDIRTY(f) \
+    do { \
+        if (!KsfL(f).kqdirty) ksf_dirty(f); \
+    } while (0)
+#else
+#  define KsfDIRTY(f) NOOP
+#endif
+
 #define KsfMODE_IS(f, m)    (KsfPOLL(f).events & (m))
 #define KsfMODE_SET(f, m) \
     do { \
         debug("KsfMODE_SET [%d] [%s]", (f), decode_ksfmode(m)); \
         KsfPOLL(f).events |= (m); \
+        KsfDIRTY(f); \
     } while (0)
 #define KsfMODE_CLR(f, m) \
     do { \
         debug("KsfMODE_CLR [%d] [%s]", (f), decode_ksfmode(m)); \
         KsfPOLL(f).events &= ~(m); \
+        KsfDIRTY(f); \
+    } while (0)
+
+typedef struct ksudo_arena_chunk ksudo_arena_chunk;
+typedef struct {
+    ksudo_arena_chunk   *chunks;
+} ksudo_arena;
+
+/* An idle session fits in one chunk. Buffers don't come from the arena,
+ * so this only needs to be big enough for the session's own state. */
+#define KSUDO_ARENA_CHUNK   4096
+/* the number of free chunks we keep around for new sessions */
+#define KSUDO_ARENA_CACHE   1024
+
+#define ArINIT(a)           ((a)->chunks = NULL)
+#define ArNewZ(a, v, n) \
+    do { \
+        (v) = ar_alloc((a), sizeof(*(v)) * (n)); \
+        mem_debug("ArNewZ [%lx]", (v)); \
     } while (0)
 
 typedef void (*ksudo_sop) (int, krb5_data *);
+typedef void (*ksudo_endop) (int);
+typedef void (*ksudo_timerop) (int);
+typedef void (*ksudo_tapop) (int, int, const uchar *, size_t);
+typedef void (*ksudo_exitop) (int, int);
+
+typedef struct ksudo_timer {
+    struct ksudo_timer  *next;
+    struct ksudo_timer  **prevp;
+    unsigned long       expires;
+    ksudo_timerop       op;
+    int                 arg;
+} ksudo_timer;
+
+#define KSUDO_TICK_MS               100
+/* these are in seconds */
+#define KSUDO_HANDSHAKE_TIMEOUT     30
+#define KSUDO_IDLE_TIMEOUT          300
+#define KSUDO_KILL_GRACE            5
+#define KSUDO_KEEPIDLE              60
+#define KSUDO_KEEPINTVL             10
+#define KSUDO_KEEPCNT               6
+/* how long to stop accepting when we're out of fds, in ms */
+#define KSUDO_ACCEPT_BACKOFF        1000
+
+/* Socket options, set with -o name[=value] */
+typedef struct {
+    unsigned    nodelay     : 1;
+    unsigned    fastopen    : 1;
+    /* 0 leaves the system default */
+    int         sndbuf;
+    int         rcvbuf;
+    /* in microseconds, where SO_BUSY_POLL exists */
+    int         busypoll;
+} ksudo_sockopts;
+
+/* Resource limits for commands, set with -L name[=value]. 0 is no
+ * limit. The names and units are rctl(8)'s.
+ */
+typedef struct {
+    /* set if any limit is */
+    unsigned    any         : 1;
+    /* share one set of limits between all a principal's commands */
+    unsigned    principal   : 1;
+    uintmax_t   pcpu;
+    uintmax_t   memoryuse;
+    uintmax_t   readbps;
+    uintmax_t   writebps;
+} ksudo_limits;
+
+/* the size we ask for on a child's pipes, where that can be set */
+#define KSUDO_PIPE_SIZE             (256 * 1024)
+
+/* the first fd passed by systemd socket activation */
+#define KSUDO_LISTEN_FDS_START      3
+
+/* the pending-SYN queue for Fast Open on a listening socket */
+#define KSUDO_TFO_QLEN              64
 
 #define KSUDO_SOP(n)    void n (int sess, krb5_data *pkt)
 #define dKSSOP(t)       ksudo_sdata_ ## t *data = KssDATA(sess, t)
@@ -234,12 +422,37 @@ typedef void (*ksudo_msgop) (int, unsigned int, void *);
                         KSUDO_ ## mt *msg = vmsg
 #define ckMSGOP(t)      Assert(msgtype == choice_KSUDO_MSG_ ## t)
         /* XXX this should come from the ASN.1 */
-#define KSUDO_MSG_num   7
+#define KSUDO_MSG_num   8
 
 typedef struct {
     ksudo_sop   state;
     void        *data;
-    ksudo_msgop msgop[KSUDO_MSG_num];
+    /* a static table, indexed by message type less 1; and whether the
+     * data stream ops in kss_data_msgops apply too */
+    const ksudo_msgop   *msgops;
+    unsigned    dataops : 1;
+    /* called from kss_close to free anything in data */
+    ksudo_endop endop;
+    /* if set, these see every DATA we send from a stream, and the
+     * status just before the EXIT goes */
+    ksudo_tapop     tapop;
+    ksudo_exitop    exitop;
+
+    ksudo_arena arena;
+    /* close the session once the msg queue is empty */
+    unsigned    closing : 1;
+    /* don't pass on any more packets until kss_resume */
+    unsigned    held    : 1;
+    /* the peer sent a packet we couldn't read; msg_dispatch closes the
+     * session */
+    unsigned    badmsg  : 1;
+    /* bumped each time the slot is reused, so a job which finishes
+     * late can tell its session has gone */
+    unsigned    gen;
+
+    ksudo_timer     *timer;
+    /* timer_now() when we last read or wrote the msg fd */
+    unsigned long   lastio;
 
     krb5_auth_context   k5a;
 
@@ -247,6 +460,14 @@ typedef struct {
     int     msgfd;
     int     *datafds;
     int     ttyfd;
+
+    /* the number of data streams we are still sending from */
+    int     nout;
+    /* the child has gone, but we haven't sent the EXIT yet */
+    unsigned    exited  : 1;
+    int         status;
+    /* the child's resource usage, to go in the EXIT */
+    KSUDO_RUSAGE    *rusage;
 } ksudo_session;
 
 #define KssL(s)         (sessions[(s)])
@@ -258,23 +479,27 @@ typedef struct {
 #define KssDATAv(s)     (KssL(s).data)
 #define KssDATA(s, t)   ((ksudo_sdata_ ## t *)KssDATAv(s))
 #define KssK5A(s)       (KssL(s).k5a)
+#define KssARENA(s)     (&KssL(s).arena)
 
 #define KssMSGFD(s)     (KssL(s).msgfd)
 #define KssMSGFDs(s, f) (KssL(s).msgfd = (f))
 #define KssMBUF(s)      (&KsfDATA(KssL(s).msgfd, msg)->wbuf)
 
+#define KssDATAFD(s, f) \
+    ((f) >= 0 && (f) < KSUDO_NFDS && KssL(s).datafds \
+        ? KssL(s).datafds[(f)] : -1)
+
 #define KssINIT(s, t, f, o) \
     do { \
         ksudo_sdata_ ## t *__sdata; \
         Assert(!KssOK(s)); \
-        NewZ(__sdata, 1); \
+        ArINIT(KssARENA(s)); \
+        ArNewZ(KssARENA(s), __sdata, 1); \
         kss_init((s), (f), (o), (void *)(__sdata)); \
     } while (0)
 
-#define KssSETOP(s, t, o) \
-    do { \
-        KssL(s).msgop[choice_KSUDO_MSG_ ## t - 1] = (o); \
-    } while (0)
+#define KssSETOPS(s, t)     (KssL(s).msgops = (t))
+#define KssMSGOP(t)         [choice_KSUDO_MSG_ ## t - 1]
 
 #define KssCALLOP(s, m) \
     do { \
@@ -283,7 +508,9 @@ typedef struct {
         \
         __msgtype = (m).element; \
         Assert(__msgtype <= KSUDO_MSG_num); \
-        __msgop = KssL(s).msgop[__msgtype - 1]; \
+        __msgop = KssL(s).msgops ? KssL(s).msgops[__msgtype - 1] : NULL; \
+        if (!__msgop && KssL(s).dataops) \
+            __msgop = kss_data_msgops[__msgtype - 1]; \
         debug("CALL MSGOP [%u] [%lx]", __msgtype, (unsigned long)__msgop); \
         Assert(__msgop); \
         __msgop((s), __msgtype, (void *)&(m).u); \
@@ -318,17 +545,36 @@ typedef struct {
 #define KSUDO_SIGNAL_num 26
 const ksudo_sigmapping ksudo_sigmap[KSUDO_SIGNAL_num];
 
+typedef ksudo_sop (*ksudo_admitop) (int);
+
 typedef struct {
-   ksudo_sop    startop;
+   ksudo_sop        startop;
+   ksudo_endop      endop;
+   ksudo_timerop    timeoutop;
+   /* if set, decides which sop a new session starts in */
+   ksudo_admitop    admitop;
+   /* to start accepting again after running out of fds */
+   ksudo_timer      backoff;
 } ksudo_fddata_listen;
 
 typedef struct {
     int             session;
-    ksudo_buf       rbuf;
+    /* from buf_get, only while there's something in it */
+    ksudo_buf       *rbuf;
+    /* encrypted packets ready for writev */
     ksudo_msgbuf    wbuf;
+    ksudo_msgsched  sched;
 } ksudo_fddata_msg;
 
+/* A data stream. rbuf holds data read from the OS fd which has yet to
+ * be sent to the peer, wbuf holds data from the peer waiting to be
+ * written to the OS fd. Each is NULL if we aren't (or are no longer)
+ * relaying data in that direction.
+ */
 typedef struct {
+    unsigned    rclosed     : 1;
+    unsigned    weof        : 1;
+
     int         session;
     /* our logical fd number within the session */
     int         fd;
@@ -336,25 +582,195 @@ typedef struct {
     ksudo_buf   *rbuf;
     ksudo_buf   *wbuf;
 
-    /* wbuf->start last time we sent a window update */
-    uchar       *lastwnd;
-    /* the maximum size of our next packet */
+    /* how much more the peer is prepared to accept from us */
     size_t      nextwnd;
+    /* how much more we are prepared to accept from the peer */
+    size_t      rcvwnd;
+    /* bytes written to the OS fd since we last sent a window update */
+    size_t      wndpend;
+
+    /* rbuf is being held back to make a bigger DATA; gtimer is the
+     * most it will wait, if coalescing is on */
+    unsigned    gather      : 1;
+    ksudo_timer *gtimer;
+
+    /* Line mode: each line written to the OS fd starts with prefix.
+     * midline means wbuf starts part way through a line whose prefix
+     * has gone; otherwise poff bytes of its prefix have. */
+    const char  *prefix;
+    size_t      prefixlen;
+    size_t      poff;
+    unsigned    midline     : 1;
 } ksudo_fddata_data;
 
+/* the most iovecs line mode gives one writev, two for each line */
+#define KSUDO_LINE_IOV  256
+
+/* Commands waiting for an exec slot. Each principal has a queue of up
+ * to KSUDO_CMDQ_MAX, and a weight, set with -W, for its share of the
+ * slots. A weight of 1 counts as KSUDO_CMDQ_SCALE in virtual time.
+ */
+#define KSUDO_CMDQ_MAX          64
+#define KSUDO_CMDQ_HASH         256
+#define KSUDO_CMDQ_WEIGHT       1
+#define KSUDO_CMDQ_MAXWEIGHT    1000
+#define KSUDO_CMDQ_SCALE        (1UL << 20)
+/* in commands per second, for -r */
+#define KSUDO_CMDQ_MAXRATE      1000000
+
+typedef struct ksudo_princq ksudo_princq;
+
+typedef struct ksudo_cmdq_ent {
+    struct ksudo_cmdq_ent   *next;
+    /* the queue we're on, or NULL */
+    ksudo_princq            *pq;
+    int                     sess;
+    /* timer_now() when we were queued */
+    unsigned long           since;
+} ksudo_cmdq_ent;
+
+typedef struct {
+    /* is there an exec slot free? */
+    int     (*room)     ();
+    /* start sess's queued command, which waited for ms */
+    void    (*start)    (int sess, unsigned long ms);
+} ksudo_cmdqops;
+
+typedef struct ksudo_rcache_ent ksudo_rcache_ent;
+
+/* A session's interest in a cached result: either it is running the
+ * command which will make it, or it is waiting for somebody else to */
+typedef struct ksudo_rcache_wait {
+    struct ksudo_rcache_wait    *next;
+    struct ksudo_rcache_wait    **prevp;
+    ksudo_rcache_ent            *ent;
+    int                         sess;
+    unsigned                    filling : 1;
+} ksudo_rcache_wait;
+
+typedef struct {
+    /* answer sess with a result: its exit status, the fds it closes,
+     * and what it wrote to fd 1 */
+    void    (*hit)      (int sess, int status, unsigned fds,
+                            const uchar *out, size_t len);
+    /* there is no result for sess after all, so it must run its own
+     * command; if it's now filling, for the others waiting too */
+    void    (*miss)     (int sess);
+} ksudo_rcacheops;
+
+/* The result cache: the most entries, and the most output one may
+ * hold, which must fit in the peer's first window on fd 1 */
+#define KSUDO_RCACHE_NENT       1024
+#define KSUDO_RCACHE_HASH       256
+#define KSUDO_RCACHE_OUT        KSUDO_BUFSIZ
+/* the longest a policy may keep a result, in seconds */
+#define KSUDO_RCACHE_MAXTTL     86400
+
 typedef void ksudo_sdata_any;
 
 typedef struct {
-    char    *usr;
-    int     cmdc;
-    char    **cmdv;
+    char            *usr;
+    int             cmdc;
+    char            **cmdv;
+    int             envc;
+    KSUDO_ENV_OPT   *envv;
 } ksudo_sdata_client;
 
 typedef struct {
     krb5_ticket     *tkt;
+    /* the client principal, unparsed */
+    char            *princ;
     pid_t           pid;
+
+    /* the wall-clock limit on the command, if any */
+    ksudo_timer     *cmdtimer;
+    unsigned        termsent    : 1;
+    /* when the command started, for the real time in its rusage */
+    struct timespec started;
+
+    /* which admission count this session is holding */
+    unsigned        handshake   : 1;
+    unsigned        shedding    : 1;
+    unsigned        child       : 1;
+
+    /* the client came in on the Unix-domain socket, as this user */
+    unsigned        local       : 1;
+    uid_t           peeruid;
+    gid_t           peergid;
+    /* host:port, or uid:gid for a local client, for the audit log */
+    char            *peer;
+
+    /* a command waiting for an exec slot, with the session held */
+    unsigned        queued      : 1;
+    KSUDO_CMD       *cmd;
+    ksudo_cmdq_ent  qent;
+
+    /* waiting, held, for an identical command's result; cmd is kept
+     * in case it never comes */
+    unsigned            waiting : 1;
+    ksudo_rcache_wait   rcw;
 } ksudo_sdata_server;
 
+typedef struct ksudo_policy ksudo_policy;
+
+/* Cached passwd and group data for a target user */
+typedef struct ksudo_pwent {
+    struct ksudo_pwent  *next;
+    unsigned long       hash;
+    time_t              expires;
+
+    char                *name;
+    unsigned            found   : 1;
+    uid_t               uid;
+    gid_t               gid;
+    char                *dir;
+    char                *shell;
+    int                 ngroups;
+    gid_t               *groups;
+} ksudo_pwent;
+
+#define KSUDO_PWCACHE_TTL       300
+#define KSUDO_PWCACHE_NEGTTL    30
+#define KSUDO_PWCACHE_MAX       1024
+
+/* A job for a worker thread. Embed this at the start of a struct with
+ * whatever else the job needs. run is called with the worker's own
+ * krb5 context and keytab, or with NULL if it's running on the event
+ * loop; done is always called on the event loop.
+ */
+typedef struct {
+    krb5_context    ctx;
+    krb5_keytab     kt;
+} ksudo_wctx;
+
+typedef struct ksudo_job ksudo_job;
+struct ksudo_job {
+    void            (*run) (ksudo_job *job, ksudo_wctx *w);
+    void            (*done) (ksudo_job *job);
+    ksudo_job       *next;
+};
+
+/* The audit log: the longest record, the number of records which can
+ * be waiting for the writer, and the most written by one writev */
+#define KSUDO_AUDIT_LINE        2048
+#define KSUDO_AUDIT_RING        1024
+#define KSUDO_AUDIT_IOV         64
+
+typedef struct ksudo_auditrec ksudo_auditrec;
+
+/* the client's cache of target hosts */
+#define KSUDO_HCACHE_TTL        600
+#define KSUDO_HCACHE_NENT       64
+#define KSUDO_HCACHE_NADDR      4
+
+/* the client's ticket agent: how often it wakes, and how long before
+ * a ticket expires it gets another, in seconds. This must leave get_creds
+ * a good margin. */
+#define KSUDO_AGENT_INTERVAL    60
+#define KSUDO_AGENT_AHEAD       600
+
+#define KSUDO_HASH_INIT 2166136261UL
+
 extern int              nksfds;
 extern ksudo_fd         *ksfds;
 extern struct pollfd    *pollfds;
@@ -362,41 +778,174 @@ extern struct pollfd    *pollfds;
 extern ksudo_fdops
     ksudo_fdops_listen,
     ksudo_fdops_msg,
-    ksudo_fdops_data;
+    ksudo_fdops_data,
+    ksudo_fdops_worker;
 
 extern int              nsessions;
 extern ksudo_session    *sessions;
 
+extern ksudo_sockopts   sockopts;
+extern const char       *sockpath;
+
+/* bytes of encrypted packets waiting on every msg queue */
+extern size_t           msgq_bytes;
+
 extern const int        nsigs;
 extern int              sigwant[];
 extern ksudo_sigop      sigops[];
 extern volatile sig_atomic_t sigcaught[];
 
+/* agent.c */
+void            agent_list      (const char *path);
+void            agent_run       ();
+
+/* arena.c */
+extern size_t   mem_bytes;
+void            *ar_alloc       (ksudo_arena *a, size_t n);
+void            ar_free         (ksudo_arena *a);
+ksudo_buf       *buf_get        ();
+void            buf_put         (ksudo_buf *buf);
+
+/* audit.c */
+void            audit_open      (const char *path);
+void            audit_reopen    ();
+void            audit_flush     ();
+ksudo_auditrec  *audit_start    (const char *event);
+void            audit_add       (ksudo_auditrec *r, const char *key,
+                                    const char *fmt, ...);
+void            audit_str       (ksudo_auditrec *r, const char *key,
+                                    const char *s, size_t len);
+void            audit_commit    (ksudo_auditrec *r);
+
+/* cmdq.c */
+extern ksudo_cmdqops    cmdqops;
+int     cmdq_weight     (const char *opt);
+int     cmdq_rate       (const char *opt);
+void    cmdq_kick       ();
+void    cmdq_run        ();
+int     cmdq_submit     (ksudo_cmdq_ent *e, const char *princ, int sess);
+void    cmdq_cancel     (ksudo_cmdq_ent *e);
+
+/* data.c */
+extern const ksudo_msgop    kss_data_msgops[KSUDO_MSG_num];
+extern unsigned long        coalesce_ms;
+extern size_t               coalesce_bytes;
+int     kss_data_coalesce   (const char *opt);
+int     kss_data_open   (int sess, int fd, int osfd, int send, int recv);
+void    kss_data_ops    (int sess);
+void    kss_data_closeall   (int sess);
+void    kss_data_flush  (int sess);
+void    kss_data_replay (int sess, int fd, const uchar *p, size_t len);
+void    kss_data_prefix (int sess, int fd, const char *prefix);
+void    kss_data_save   (int sess, KSUDO_SAVED_SESSION *ss);
+void    kss_data_restore    (int sess, const KSUDO_SAVED_SESSION *ss);
+void    kss_unblock     (int sess);
+
 /* exec.c */
-void    do_exec         (KSUDO_CMD *cmd, ksudo_sdata_server *data);
+int     do_exec         (int sess, KSUDO_CMD *cmd);
+
+/* hostcache.c */
+extern int      hostcache;
+struct addrinfo *hcache_lookup  (const char *host);
+void            hcache_free     (struct addrinfo *res);
+void            hcache_store    (const char *host, const struct addrinfo *res);
 
 /* io.c */
 int     ksf_open        (int fd, KSUDO_FD_MODE mode, KSF_TYPE type, 
                             void *data);
 void    ksf_close       (int ix);
-void    ksf_read        (int ix, ksudo_buf *buf);
-void    ksf_write       (int ix, ksudo_buf *buf);
+#ifdef HAVE_KQUEUE
+void    ksf_dirty       (int ix);
+#endif
+ssize_t ksf_read        (int ix, ksudo_buf *buf, size_t max);
+ssize_t ksf_write       (int ix, ksudo_buf *buf);
 void    ioloop          ();
 
+/* limit.c */
+extern ksudo_limits limits;
+int     limit_option    (const char *opt);
+void    limit_init      ();
+void    limit_child     (const char *princ);
+void    limit_account   (ksudo_auditrec *r, const char *princ, pid_t pid);
+void    limit_release   (const char *princ, pid_t pid);
+
+/* listen.c */
+void    kss_accept      (int cli, ksudo_fddata_listen *data);
+
 /* msg.c */
+krb5_data   *pkt_get    (size_t len);
+void    pkt_put         (krb5_data *pkt);
 int     read_msg        (int sess, krb5_data *pkt, KSUDO_MSG *msg);
+int     read_msg_inplace    (int sess, krb5_data *pkt, KSUDO_MSG *msg,
+                            krb5_data *der);
 int     write_msg       (int sess, KSUDO_MSG *msg);
+void    kss_resume      (int sess);
+int     kss_msg_room    (int sess, int fd);
+int     kss_msg_queued  (int sess, int fd);
+void    kss_msg_save    (int sess, KSUDO_SAVED_SESSION *ss);
+void    kss_msg_restore (int sess, const KSUDO_SAVED_SESSION *ss);
+
+/* policy.c */
+unsigned long   ksudo_hash  (const char *s, unsigned long h);
+ksudo_policy    *policy_load    (const char *path);
+void            policy_free     (ksudo_policy *pol);
+int             policy_check    (ksudo_policy *pol, const char *princ,
+                                    KSUDO_CMD *cmd);
+unsigned        policy_cache_ttl    (ksudo_policy *pol, KSUDO_CMD *cmd);
+
+/* pwcache.c */
+ksudo_pwent *pwcache_get    (const char *user);
+void        pwcache_flush   ();
+
+/* rcache.c */
+extern ksudo_rcacheops  rcacheops;
+int     rcache_submit   (ksudo_rcache_wait *w, KSUDO_CMD *cmd,
+                            unsigned ttl, int sess);
+void    rcache_tap      (ksudo_rcache_wait *w, int fd, const uchar *p,
+                            size_t len);
+void    rcache_done     (ksudo_rcache_wait *w, int status);
+void    rcache_cancel   (ksudo_rcache_wait *w);
 
 /* session.c */
+void    kss_err         (int sess, KSUDO_ERR_CODE code,
+                            const char *fmt, ...);
+void    kss_busy        (int sess, unsigned retry);
 void    kss_exit        (int sess, int status);
+void    kss_reap        (int sess, int status, const KSUDO_RUSAGE *ru);
+void    kss_check_exit  (int sess);
+void    kss_close       (int sess);
+int     kss_new         ();
+void    kss_save        (int sess, KSUDO_SAVED_SESSION *ss);
+void    kss_restore     (int sess, const KSUDO_SAVED_SESSION *ss);
 void    kss_init        (int sess, int fd, ksudo_sop start, void *data);
 KSUDO_SOP(sop_dispatch_msg);
 
 /* signal.c */
 void    setup_signals   ();
 void    handle_signals  ();
+void    reset_signals   ();
 
 /* sock.c */
 int     create_socket   (const char *host, int flags, char **canon);
+int     create_listen_sockets   (const char *host, int backlog,
+                                    char **canon, int **socks);
+int     create_unix_listen_socket   (const char *path, int backlog);
+int     sock_keepalive  (int sock);
+int     sock_option     (const char *opt);
+int     sock_tune       (int sock);
+ssize_t sock_sendfirst  (int sock, const void *buf, size_t len);
+char    *sock_canon     (const char *host);
+
+/* worker.c */
+void    worker_start    (int n);
+int     worker_submit   (ksudo_job *job);
+
+/* timer.c */
+void            timer_arm       (ksudo_timer *t, unsigned long ms,
+                                    ksudo_timerop op, int arg);
+void            timer_cancel    (ksudo_timer *t);
+unsigned long   timer_now       ();
+void            timer_run       ();
+int             timer_next      ();
 
 #endif
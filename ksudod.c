@@ -9,12 +9,18 @@
 
 #include <sys/param.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
 
+#include <fcntl.h>
+#include <string.h>
 #include <limits.h>
 #include <netdb.h>
+#include <paths.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -26,12 +32,40 @@ krb5_context        k5ctx;
 krb5_keytab         k5kt;
 krb5_principal      myprinc;
 
+const char          *policyfile = KSUDO_POLICY;
+const char          *auditfile  = NULL;
+ksudo_policy        *policy;
+/* wall-clock limit on commands, in seconds; 0 for none */
+int                 cmdtimeout  = 0;
+/* threads for verifying AP-REQs; 0 does it in ioloop */
+int                 nworkers    = 0;
+
+/* Admission control. Each cap is 0 for no limit. */
+int                 backlog         = KSUDO_BACKLOG;
+int                 maxhandshake    = KSUDO_MAX_HANDSHAKE;
+int                 maxchildren     = KSUDO_MAX_CHILDREN;
+size_t              maxbuffered     = KSUDO_MAX_BUFFERED;
+size_t              maxmemory       = KSUDO_MAX_MEMORY;
+
+static int              nhandshake  = 0;
+static int              nshedding   = 0;
+static int              nchildren   = 0;
+static unsigned long    nshed       = 0;
+static unsigned long    nrefused    = 0;
+static unsigned long    nbusy       = 0;
+
+/* our original command line, to re-exec ourself on SIGUSR2 */
+static int              upargc;
+static char             **upargv;
+
 KSUDO_SIGOP(sigop_chld);
+KSUDO_SIGOP(sigop_hup);
+KSUDO_SIGOP(sigop_usr2);
 
-const int               nsigs       = 1;
-int                     sigwant[]   = { SIGCHLD };
-ksudo_sigop             sigops[]    = { sigop_chld };
-volatile sig_atomic_t   sigcaught[1];
+const int               nsigs       = 3;
+int                     sigwant[]   = { SIGCHLD, SIGHUP, SIGUSR2 };
+ksudo_sigop             sigops[]    = { sigop_chld, sigop_hup, sigop_usr2 };
+volatile sig_atomic_t   sigcaught[3];
 
 void            init            ();
 void            ksudod          (int clisock);
@@ -40,7 +74,11 @@ void            usage           ();
 
 static KSUDO_SOP(sop_read_cred);
 static KSUDO_SOP(sop_read_cmd);
+static KSUDO_SOP(sop_shed);
 
+/* Called when the first connection arrives, so a daemon started on
+ * demand can get its listening sockets going without waiting for krb5.
+ */
 void
 init ()
 {
@@ -58,15 +96,221 @@ init ()
         "can't build server principal");
 }
 
+/* Convert the rusage of a child started at started for the EXIT
+ * message */
+static void
+server_rusage (const struct timespec *started, struct rusage *ru,
+    KSUDO_RUSAGE *kru)
+{
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+        err(EX_OSERR, "can't read the clock");
+
+    now.tv_sec  -= started->tv_sec;
+    now.tv_nsec -= started->tv_nsec;
+    if (now.tv_nsec < 0) {
+        now.tv_sec--;
+        now.tv_nsec += 1000000000L;
+    }
+
+    kru->real.sec   = now.tv_sec;
+    kru->real.usec  = now.tv_nsec / 1000;
+    kru->utime.sec  = ru->ru_utime.tv_sec;
+    kru->utime.usec = ru->ru_utime.tv_usec;
+    kru->stime.sec  = ru->ru_stime.tv_sec;
+    kru->stime.usec = ru->ru_stime.tv_usec;
+    kru->maxrss     = ru->ru_maxrss;
+    kru->inblock    = ru->ru_inblock;
+    kru->oublock    = ru->ru_oublock;
+    kru->nvcsw      = ru->ru_nvcsw;
+    kru->nivcsw     = ru->ru_nivcsw;
+}
+
+/* Begin an audit record about a client and its command */
+static ksudo_auditrec *
+server_audit_who (const char *event, const char *princ, const char *peer,
+    pid_t pid)
+{
+    ksudo_auditrec  *r;
+
+    if (!(r = audit_start(event))) return NULL;
+
+    if (princ)
+        audit_str(r, "principal", princ, strlen(princ));
+    if (peer)
+        audit_str(r, "peer", peer, strlen(peer));
+    if (pid)
+        audit_add(r, "pid", "%ld", (long)pid);
+    return r;
+}
+
+/* Begin an audit record about sess */
+static ksudo_auditrec *
+server_audit (int sess, const char *event)
+{
+    dKSSOP(server);
+
+    return server_audit_who(event, data->princ, data->peer, data->pid);
+}
+
+static void
+server_audit_cmd (int sess, const char *event, KSUDO_CMD *cmd)
+{
+    ksudo_auditrec  *r;
+    char            key[16];
+    int             i;
+
+    if (!(r = server_audit(sess, event))) return;
+
+    audit_str(r, "user", cmd->user.data, cmd->user.length);
+    for (i = 0; i < cmd->cmd.len; i++) {
+        snprintf(key, sizeof(key), "arg%d", i);
+        audit_str(r, key, cmd->cmd.val[i].data, cmd->cmd.val[i].length);
+    }
+    audit_commit(r);
+}
+
+static void
+server_audit_exit (const char *princ, const char *peer, pid_t pid,
+    int stat, const KSUDO_RUSAGE *kru)
+{
+    ksudo_auditrec      *r;
+
+    if (!(r = server_audit_who("exit", princ, peer, pid))) return;
+
+    if (WIFSIGNALED(stat))
+        audit_add(r, "signal", "%d", WTERMSIG(stat));
+    else
+        audit_add(r, "status", "%d", WEXITSTATUS(stat));
+
+#define TV(k, tv) audit_add(r, k, "%lu.%06lu", \
+    (unsigned long)(tv).sec, (unsigned long)(tv).usec)
+    TV("real", kru->real);
+    TV("user", kru->utime);
+    TV("sys", kru->stime);
+#undef TV
+    audit_add(r, "maxrss", "%lu", (unsigned long)kru->maxrss);
+    limit_account(r, princ, pid);
+    audit_commit(r);
+}
+
+/* A command whose client has hung up. It has had a SIGHUP, but needn't
+ * take it, so it stays here until sigop_chld reaps it and it can be
+ * audited and its limits released like any other. Until then it still
+ * holds its exec slot, and cmdtimeout still applies, so hanging up
+ * isn't a way round either.
+ */
+typedef struct server_orphan {
+    struct server_orphan    *next;
+    pid_t                   pid;
+    char                    *princ;
+    char                    *peer;
+    struct timespec         started;
+    unsigned                child       : 1;
+    unsigned                termsent    : 1;
+    ksudo_timer             kill;
+} server_orphan;
+
+static server_orphan    *orphans    = NULL;
+
+static server_orphan *
+server_orphan_find (pid_t pid)
+{
+    server_orphan   *o;
+
+    for (o = orphans; o; o = o->next)
+        if (o->pid == pid) break;
+    return o;
+}
+
+/* As server_cmd_timeout, for an orphan */
+static void
+server_orphan_timeout (int pid)
+{
+    server_orphan   *o;
+
+    if (!(o = server_orphan_find(pid))) return;
+
+    if (o->termsent) {
+        debug("server_orphan_timeout: killing [%ld]", (long)pid);
+        kill(pid, SIGKILL);
+        return;
+    }
+
+    debug("server_orphan_timeout: terminating [%ld]", (long)pid);
+    kill(pid, SIGTERM);
+    o->termsent = 1;
+    timer_arm(&o->kill, KSUDO_KILL_GRACE * 1000,
+        server_orphan_timeout, pid);
+}
+
+/* Take over the command of a session which is going away, with its
+ * exec slot and whatever is left of its time limit */
+static void
+server_orphan_add (ksudo_sdata_server *data)
+{
+    server_orphan   *o;
+    long            left;
+
+    NewZ(o, 1);
+    o->pid      = data->pid;
+    o->princ    = data->princ;
+    o->peer     = data->peer;
+    o->started  = data->started;
+    o->child    = data->child;
+    o->termsent = data->termsent;
+    o->next     = orphans;
+    orphans     = o;
+
+    if (data->cmdtimer && data->cmdtimer->prevp) {
+        left = (long)(data->cmdtimer->expires - timer_now());
+        timer_arm(&o->kill, left > 0 ? left * KSUDO_TICK_MS : 0,
+            server_orphan_timeout, o->pid);
+    }
+
+    data->pid   = 0;
+    data->child = 0;
+    data->princ = data->peer = NULL;
+}
+
+/* Returns 0 if kid wasn't an orphan */
+static int
+server_orphan_reap (pid_t kid, int stat, struct rusage *ru)
+{
+    server_orphan   **op, *o;
+    KSUDO_RUSAGE    kru;
+
+    for (op = &orphans; (o = *op); op = &o->next)
+        if (o->pid == kid) break;
+    if (!o) return 0;
+
+    debug("server_orphan_reap: [%ld] for [%s]", (long)kid, o->princ);
+    *op = o->next;
+    timer_cancel(&o->kill);
+    if (o->child) nchildren--;
+
+    server_rusage(&o->started, ru, &kru);
+    server_audit_exit(o->princ, o->peer, kid, stat, &kru);
+    limit_release(o->princ, kid);
+
+    Free(o->princ);
+    Free(o->peer);
+    Free(o);
+    return 1;
+}
+
 KSUDO_SIGOP(sigop_chld)
 {
     dRV;
     int                 stat, i;
     pid_t               kid;
     ksudo_sdata_server  *data;
+    struct rusage       ru;
+    KSUDO_RUSAGE        kru;
 
     while (1) {
-        kid = waitpid(-1, &stat, WNOHANG);
+        kid = wait4(-1, &stat, WNOHANG, &ru);
         if (kid == 0)               break;
         if (kid < 0) {
             if (errno == ECHILD)    break;
@@ -82,20 +326,338 @@ KSUDO_SIGOP(sigop_chld)
             data = KssDATA(i, server);
             if (data->pid == kid) {
                 debug("child belonged to [%d]", i);
-                kss_exit(i, stat);
+                server_rusage(&data->started, &ru, &kru);
+                server_audit_exit(data->princ, data->peer, kid,
+                    stat, &kru);
+                limit_release(data->princ, kid);
+
+                data->pid = 0;
+                if (data->cmdtimer) timer_cancel(data->cmdtimer);
+                if (data->child) {
+                    data->child = 0;
+                    nchildren--;
+                }
+                kss_reap(i, stat, &kru);
                 break;
             }
         }
+
+        /* One handed over by a ksudod which didn't save its orphans
+         * is in neither list, but a per-command class only needs the
+         * pid. */
+        if (i == nsessions && !server_orphan_reap(kid, stat, &ru))
+            limit_release(NULL, kid);
     }
+
+    cmdq_run();
 }
 
-static KSUDO_SOP(sop_read_cred)
+/* Reload the policy. Checks are only made when a KSUDO-CMD arrives, so
+ * sessions already running are unaffected. If the new file is broken
+ * we keep the old policy. Cached passwd data is thrown away too, so a
+ * HUP picks up changes to group membership at once.
+ */
+KSUDO_SIGOP(sigop_hup)
+{
+    ksudo_policy    *pol;
+
+    pwcache_flush();
+    audit_reopen();
+
+    if (!(pol = policy_load(policyfile))) {
+        warnx("keeping old policy");
+        return;
+    }
+
+    policy_free(policy);
+    policy = pol;
+    debug("reloaded policy from [%s]", policyfile);
+}
+
+/* Give back whatever admission counts the session holds */
+static void
+server_release (ksudo_sdata_server *data, int children)
+{
+    if (data->handshake) {
+        data->handshake = 0;
+        nhandshake--;
+    }
+    if (data->shedding) {
+        data->shedding = 0;
+        nshedding--;
+    }
+    if (children && data->child) {
+        data->child = 0;
+        nchildren--;
+    }
+}
+
+/* Is the daemon using more memory than it's allowed? */
+static int
+server_overmemory ()
+{
+    return maxmemory && mem_bytes + msgq_bytes >= maxmemory;
+}
+
+/* Decide how to treat a new connection. Past maxhandshake we don't
+ * even verify the AP-REQ, but answer it with a KRB-ERROR telling the
+ * client to come back later; past twice that, or past maxmemory, we
+ * just hang up.
+ */
+static ksudo_sop
+server_admit (int sess)
+{
+    dKSSOP(server);
+
+    if (!k5ctx) init();
+
+    if (server_overmemory()) {
+        nrefused++;
+        debug("server_admit: refusing [%d], [%lu] bytes in use",
+            sess, (unsigned long)(mem_bytes + msgq_bytes));
+        return NULL;
+    }
+
+    if (!maxhandshake || nhandshake < maxhandshake) {
+        data->handshake = 1;
+        nhandshake++;
+        return sop_read_cred;
+    }
+
+    if (nshedding >= maxhandshake) {
+        nrefused++;
+        debug("server_admit: refusing [%d], [%lu] so far", sess, nrefused);
+        return NULL;
+    }
+
+    data->shedding = 1;
+    nshedding++;
+    nshed++;
+    debug("server_admit: shedding [%d], [%lu] so far", sess, nshed);
+    return sop_shed;
+}
+
+/* Is there room to take another command? Waiting for a child slot is
+ * cmdq's business.
+ */
+static int
+server_overloaded ()
+{
+    if (maxbuffered && msgq_bytes >= maxbuffered)
+        return 1;
+    if (server_overmemory())
+        return 1;
+    return 0;
+}
+
+/* The session timer. Until we have a command it's the handshake
+ * deadline; after that it fires every KSUDO_IDLE_TIMEOUT and closes
+ * the session if nothing has been heard from the client and there's
+ * no command still running.
+ */
+static void
+server_timeout (int sess)
 {
     dKSSOP(server);
+    unsigned long   idle;
+    ksudo_sop       state   = KssSTATE(sess);
+
+    if ((state == sop_read_cred || state == sop_read_cmd
+            || state == sop_shed)
+        && !data->queued && !data->waiting
+    ) {
+        debug("server_timeout: [%d] handshake timed out", sess);
+        kss_close(sess);
+        return;
+    }
+
+    idle = (timer_now() - KssL(sess).lastio) * KSUDO_TICK_MS;
+    if (!data->pid && !data->queued && !data->waiting
+        && idle >= KSUDO_IDLE_TIMEOUT * 1000
+    ) {
+        debug("server_timeout: [%d] idle for [%lu]ms", sess, idle);
+        kss_close(sess);
+        return;
+    }
+
+    timer_arm(KssL(sess).timer, KSUDO_IDLE_TIMEOUT * 1000
+        - (idle < KSUDO_IDLE_TIMEOUT * 1000 ? idle : 0),
+        server_timeout, sess);
+}
+
+/* The command has run for cmdtimeout seconds. Ask it nicely first;
+ * if it's still there KSUDO_KILL_GRACE seconds later, don't.
+ */
+static void
+server_cmd_timeout (int sess)
+{
+    dKSSOP(server);
+
+    if (!data->pid) return;
+
+    if (data->termsent) {
+        debug("server_cmd_timeout: killing [%ld]", (long)data->pid);
+        kill(data->pid, SIGKILL);
+        return;
+    }
+
+    debug("server_cmd_timeout: terminating [%ld]", (long)data->pid);
+    kill(data->pid, SIGTERM);
+    data->termsent = 1;
+    timer_arm(data->cmdtimer, KSUDO_KILL_GRACE * 1000,
+        server_cmd_timeout, sess);
+}
+
+/* Called from kss_close. If the client has gone away the command goes
+ * with it; it becomes an orphan for sigop_chld to reap, and counts
+ * against maxchildren until then.
+ */
+static void
+server_end (int sess)
+{
+    dKSSOP(server);
+
+    if (data->queued) cmdq_cancel(&data->qent);
+    rcache_cancel(&data->rcw);
+    if (data->cmd) {
+        free_KSUDO_CMD(data->cmd);
+        Free(data->cmd);
+        data->cmd = NULL;
+    }
+    data->queued    = 0;
+    data->waiting   = 0;
+
+    if (data->pid) {
+        debug("server_end: killing [%ld]", (long)data->pid);
+        audit_commit(server_audit(sess, "hangup"));
+        kill(data->pid, SIGHUP);
+        server_orphan_add(data);
+    }
+    if (data->cmdtimer) timer_cancel(data->cmdtimer);
+    server_release(data, 1);
+    if (data->tkt)
+        krb5_free_ticket(k5ctx, data->tkt);
+    Free(data->princ);
+    Free(data->peer);
+
+    /* we may have freed a slot, but we're in the middle of kss_close */
+    cmdq_kick();
+}
+
+/* Verifying an AP-REQ means reading the keytab and decrypting the
+ * ticket, which is slow enough that a burst of new connections would
+ * hold up everybody else's data. So it goes to a worker, in an auth
+ * context of its own; the session's packets are held until it's done.
+ */
+typedef struct {
+    ksudo_job           job;
+    int                 sess;
+    unsigned            gen;
+    krb5_data           req;
+
+    krb5_error_code     ke;
+    krb5_auth_context   ac;
+    krb5_ticket         *tkt;
+    krb5_data           rep;
+} server_vjob;
+
+static void
+server_verify (ksudo_job *job, ksudo_wctx *w)
+{
+    server_vjob     *v      = (server_vjob *)job;
+    krb5_context    ctx     = w ? w->ctx : k5ctx;
+    krb5_keytab     kt      = w ? w->kt : k5kt;
+
+    if ((v->ke = krb5_auth_con_init(ctx, &v->ac)))
+        return;
+    if ((v->ke = krb5_rd_req(ctx, &v->ac, &v->req, myprinc, kt, NULL,
+            &v->tkt)))
+        return;
+    v->ke = krb5_mk_rep(ctx, v->ac, &v->rep);
+}
+
+static void
+server_verified (ksudo_job *job)
+{
+    server_vjob         *v      = (server_vjob *)job;
+    int                 sess    = v->sess;
+    ksudo_sdata_server  *data;
     dKRBCHK;
-    krb5_principal  cliprinc;
-    char            *cliname;
-    krb5_data       *aprep;
+    krb5_principal      cliprinc;
+    char                *cliname;
+    krb5_data           *aprep;
+    int                 gone;
+
+    krb5_data_free(&v->req);
+
+    gone = !KssOK(sess) || KssL(sess).gen != v->gen;
+    if (gone || v->ke) {
+        if (gone)
+            debug("server_verified: [%d] has gone", sess);
+        else
+            krb5_warn(k5ctx, v->ke, "can't verify AP-REQ");
+        if (v->ac)  krb5_auth_con_free(k5ctx, v->ac);
+        if (v->tkt) krb5_free_ticket(k5ctx, v->tkt);
+        krb5_data_free(&v->rep);
+        Free(v);
+        /* A bad, expired or replayed AP-REQ only costs the client its
+         * session. We have no key to send a KSUDO-ERR with, so just
+         * hang up. */
+        if (!gone) kss_close(sess);
+        return;
+    }
+    data = KssDATA(sess, server);
+
+    krb5_auth_con_free(k5ctx, KssK5A(sess));
+    KssK5A(sess)    = v->ac;
+    data->tkt       = v->tkt;
+
+    /* the session owns the auth context and ticket now, and kss_close
+     * frees them */
+    if ((ke = krb5_ticket_get_client(k5ctx, data->tkt, &cliprinc))) {
+        krb5_warn(k5ctx, ke, "can't read client principal from ticket");
+        goto fail;
+    }
+    ke = krb5_unparse_name(k5ctx, cliprinc, &cliname);
+    krb5_free_principal(k5ctx, cliprinc);
+    if (ke) {
+        krb5_warn(k5ctx, ke, "can't unparse client principal");
+        goto fail;
+    }
+
+    if (data->local)
+        debug("Got a ticket from [%s] for local uid [%ld] gid [%ld]",
+            cliname, (long)data->peeruid, (long)data->peergid);
+    else
+        debug("Got a ticket from [%s]", cliname);
+
+    data->princ = cliname;
+
+    aprep = pkt_get(0);
+    *aprep = v->rep;
+    Free(v);
+
+    /* A pipelining client will have sent its CMD behind the AP-REQ,
+     * and msg_dispatch will hand it to sop_read_cmd as soon as we
+     * return or resume. The AP-REP is queued first, so the client
+     * still sees it before any output. */
+    MbfPUSH(KssMBUF(sess), aprep);
+    KsfMODE_SET(KssMSGFD(sess), KSFm_OUT);
+    KssNEXT(sess, sop_read_cmd);
+
+    if (KssL(sess).held) kss_resume(sess);
+    return;
+
+  fail:
+    krb5_data_free(&v->rep);
+    Free(v);
+    kss_close(sess);
+}
+
+static KSUDO_SOP(sop_read_cred)
+{
+    dKRBCHK;
+    server_vjob     *v;
 
 #define HEX(n) (int)((uchar*)pkt->data)[n]
     debug("AP-REQ pkt [%lx] length [%ld], start [%x%x%x%x%x%x%x%x%x]",
@@ -104,50 +666,274 @@ static KSUDO_SOP(sop_read_cred)
         HEX(6), HEX(7), HEX(8));
 #undef HEX
 
-    KRBCHK(krb5_rd_req(k5ctx, &KssK5A(sess), pkt, myprinc, 
-            k5kt, NULL, &data->tkt),
-        "can't verify AP-REQ");
+    NewZ(v, 1);
+    v->job.run  = server_verify;
+    v->job.done = server_verified;
+    v->sess     = sess;
+    v->gen      = KssL(sess).gen;
+    KRBCHK(krb5_data_copy(&v->req, pkt->data, pkt->length),
+        "can't copy AP-REQ");
 
-    KRBCHK(krb5_ticket_get_client(k5ctx, data->tkt, &cliprinc),
-        "can't read client principal from ticket");
-    KRBCHK(krb5_unparse_name(k5ctx, cliprinc, &cliname),
-        "can't unparse client principal");
+    /* with no workers this has all happened already */
+    if (worker_submit(&v->job))
+        KssL(sess).held = 1;
+}
 
-    debug("Got a ticket from [%s]", cliname);
+/* Answer the AP-REQ of a connection we haven't room for */
+static KSUDO_SOP(sop_shed)
+{
+    dRV; dKRBCHK;
+    krb5_data   *reply;
+    char        *text;
 
-    free(cliname);
-    krb5_free_principal(k5ctx, cliprinc);
+    if (KssL(sess).closing) return;
 
-    New(aprep, 1);
-    KRBCHK(krb5_mk_rep(k5ctx, KssK5A(sess), aprep),
-        "can't build AP-REP");
+    SYSCHK(asprintf(&text, "server busy, retry in %d seconds",
+            KSUDO_BUSY_RETRY),
+        "can't format error message");
 
-    MbfPUSH(KssMBUF(sess), aprep);
+    reply = pkt_get(0);
+    KRBCHK(krb5_mk_error(k5ctx, KRB5KDC_ERR_SVC_UNAVAILABLE, text,
+            NULL, NULL, myprinc, NULL, NULL, reply),
+        "can't build KRB-ERROR");
+    free(text);
+
+    MbfPUSH(KssMBUF(sess), reply);
     KsfMODE_SET(KssMSGFD(sess), KSFm_OUT);
-    KssNEXT(sess, sop_read_cmd);
+    KssL(sess).closing = 1;
+}
+
+static void
+server_send_queued (int sess, unsigned position, unsigned long waited)
+{
+    KSUDO_MSG       msg;
+    KSUDO_QUEUED    *q;
+
+    AsnChoice(&msg, MSG, q, queued);
+    q->position = position;
+    q->waited   = waited > 0xffffffffUL ? 0xffffffffUL : waited;
+    write_msg(sess, &msg);
+}
+
+/* the session's tapop: keep what a command being cached sends */
+static void
+server_tap (int sess, int fd, const uchar *p, size_t len)
+{
+    rcache_tap(&KssDATA(sess, server)->rcw, fd, p, len);
+}
+
+/* the session's exitop: the command being cached is done */
+static void
+server_exited (int sess, int status)
+{
+    rcache_done(&KssDATA(sess, server)->rcw, status);
+}
+
+static void
+server_start (int sess, KSUDO_CMD *cmd)
+{
+    dKSSOP(server);
+
+    if (!do_exec(sess, cmd)) {
+        server_audit_cmd(sess, "fail", cmd);
+        return;
+    }
+
+    if (clock_gettime(CLOCK_MONOTONIC, &data->started) < 0)
+        err(EX_OSERR, "can't read the clock");
+    data->child = 1;
+    nchildren++;
+    server_audit_cmd(sess, "start", cmd);
+    if (data->rcw.filling) {
+        KssL(sess).tapop    = server_tap;
+        KssL(sess).exitop   = server_exited;
+    }
+    kss_data_ops(sess);
+    KssNEXT(sess, sop_dispatch_msg);
+    server_timeout(sess);
+
+    if (cmdtimeout) {
+        ArNewZ(KssARENA(sess), data->cmdtimer, 1);
+        timer_arm(data->cmdtimer, cmdtimeout * 1000UL,
+            server_cmd_timeout, sess);
+    }
+}
+
+/* cmdqops: the exec slots are the maxchildren */
+static int
+server_room ()
+{
+    return !maxchildren || nchildren < maxchildren;
+}
+
+/* cmdqops: a queued command's turn has come */
+static void
+server_dequeue (int sess, unsigned long waited)
+{
+    dKSSOP(server);
+    KSUDO_CMD   *cmd    = data->cmd;
+
+    debug("server_dequeue: [%d] waited [%lu]ms", sess, waited);
+    data->queued    = 0;
+    data->cmd       = NULL;
+
+    server_send_queued(sess, 0, waited);
+    server_start(sess, cmd);
+    free_KSUDO_CMD(cmd);
+    Free(cmd);
+
+    if (KssOK(sess)) kss_resume(sess);
+}
+
+/* Start cmd, or queue it for an exec slot, or tell the client to
+ * come back later */
+static void
+server_submit (int sess, KSUDO_CMD *cmd)
+{
+    dKSSOP(server);
+    int         pos;
+
+    if (server_overloaded()
+        || (pos = cmdq_submit(&data->qent, data->princ, sess)) < 0
+    ) {
+        server_audit_cmd(sess, "busy", cmd);
+        nbusy++;
+        debug("server_submit: [%d] busy, [%d] children [%lu] bytes queued",
+            sess, nchildren, (unsigned long)msgq_bytes);
+        kss_busy(sess, KSUDO_BUSY_RETRY);
+    }
+    else if (pos) {
+        /* hold anything the client sends behind the CMD until the
+         * command starts */
+        server_audit_cmd(sess, "queued", cmd);
+        server_send_queued(sess, pos, 0);
+        New(data->cmd, 1);
+        if (copy_KSUDO_CMD(cmd, data->cmd))
+            errx(EX_UNAVAILABLE, "can't copy KSUDO-CMD");
+        data->queued        = 1;
+        KssL(sess).held     = 1;
+    }
+    else
+        server_start(sess, cmd);
+}
+
+/* rcacheops: answer sess with what an identical command sent, without
+ * running anything */
+static void
+server_cached (int sess, int status, unsigned fds, const uchar *out,
+    size_t len)
+{
+    dKSSOP(server);
+    int     fd;
+
+    if (data->waiting) {
+        server_audit_cmd(sess, "cached", data->cmd);
+        free_KSUDO_CMD(data->cmd);
+        Free(data->cmd);
+        data->cmd       = NULL;
+        data->waiting   = 0;
+    }
+
+    for (fd = 0; fd < KSUDO_NFDS; fd++)
+        if (fds & (1U << fd))
+            kss_data_replay(sess, fd, out, fd == 1 ? len : 0);
+
+    /* there are no streams, so any input is thrown away */
+    kss_data_ops(sess);
+    KssNEXT(sess, sop_dispatch_msg);
+    kss_exit(sess, status);
+
+    if (KssL(sess).held) kss_resume(sess);
+}
+
+/* rcacheops: the command sess was waiting on gave no result it can
+ * use, so it runs its own */
+static void
+server_uncached (int sess)
+{
+    dKSSOP(server);
+    KSUDO_CMD   *cmd    = data->cmd;
+
+    debug("server_uncached: [%d] running its own", sess);
+    data->waiting   = 0;
+    data->cmd       = NULL;
+
+    server_submit(sess, cmd);
+    free_KSUDO_CMD(cmd);
+    Free(cmd);
+
+    if (KssOK(sess) && !data->queued) kss_resume(sess);
 }
 
 static KSUDO_SOP(sop_read_cmd)
 {
     dKSSOP(server);
-    dRV;
     KSUDO_MSG   msg;
+    unsigned    ttl;
+    int         rv;
 
-    read_msg(sess, pkt, &msg); 
-    if (msg.element != choice_KSUDO_MSG_cmd)
-        errx(EX_PROTOCOL, "KSUDO-MSG is not a KSUDO-CMD");
+    if (!read_msg(sess, pkt, &msg)) return;
+    if (msg.element != choice_KSUDO_MSG_cmd) {
+        warnx("session [%d] sent something other than a KSUDO-CMD", sess);
+        kss_err(sess, KSUDO_EPERM, "expected a command");
+        free_KSUDO_MSG(&msg);
+        return;
+    }
 
-    do_exec(&msg.u.cmd, data);
+    server_release(data, 0);
+
+    if (!policy_check(policy, data->princ, &msg.u.cmd)) {
+        server_audit_cmd(sess, "deny", &msg.u.cmd);
+        kss_err(sess, KSUDO_EACCES, "%s may not run that command as %.*s",
+            data->princ, (int)msg.u.cmd.user.length,
+            (char *)msg.u.cmd.user.data);
+    }
+    else if ((ttl = policy_cache_ttl(policy, &msg.u.cmd))
+        && (rv = rcache_submit(&data->rcw, &msg.u.cmd, ttl, sess))
+    ) {
+        if (rv == 1)
+            server_audit_cmd(sess, "cached", &msg.u.cmd);
+        else {
+            /* as for a queued command, hold anything behind the CMD */
+            server_audit_cmd(sess, "waiting", &msg.u.cmd);
+            New(data->cmd, 1);
+            if (copy_KSUDO_CMD(&msg.u.cmd, data->cmd))
+                errx(EX_UNAVAILABLE, "can't copy KSUDO-CMD");
+            data->waiting       = 1;
+            KssL(sess).held     = 1;
+        }
+    }
+    else
+        server_submit(sess, &msg.u.cmd);
 
     free_KSUDO_MSG(&msg);
 }
 
+static ksudo_fddata_listen *
+server_ldata ()
+{
+    ksudo_fddata_listen *ldata;
+
+    NewZ(ldata, 1);
+    ldata->startop = sop_read_cred;
+    ldata->endop   = server_end;
+    ldata->timeoutop = server_timeout;
+    ldata->admitop = server_admit;
+    return ldata;
+}
+
+static void
+listen_on (int sck)
+{
+    debug("listening on [%d]", sck);
+    ksf_open(sck, KSUDO_FD_READ, KSFt(listen), server_ldata());
+}
+
 void
 create_listen_socks (char *host)
 {
     dRV;
-    int                 sck;
-    ksudo_fddata_listen *ldata;
+    int     *socks, n, i;
 
     if (!host) {
         New(host, MAXHOSTNAMELEN);
@@ -155,30 +941,542 @@ create_listen_socks (char *host)
             "can't get my hostname");
     }
 
-    sck = create_socket(host, AI_PASSIVE|AI_CANONNAME, &myname);
-    SYSCHK(listen(sck, 10), "can't listen on socket");
-    debug("got listen socket [%d] for [%s]", sck, myname);
+    n = create_listen_sockets(host, backlog, &myname, &socks);
+    debug("got [%d] listen sockets for [%s]", n, myname);
 
-    NewZ(ldata, 1);
-    ldata->startop = sop_read_cred;
-    ksf_open(sck, KSUDO_FD_READ, KSFt(listen), ldata);
+    for (i = 0; i < n; i++)
+        listen_on(socks[i]);
+    Free(socks);
+}
+
+/* Use listening sockets passed to us by systemd, as described in
+ * sd_listen_fds(3). Returns the number found.
+ */
+static int
+inherited_socks ()
+{
+    const char  *pid, *fds;
+    int         n, i;
+
+    if (!(pid = getenv("LISTEN_PID")) || atol(pid) != (long)getpid())
+        return 0;
+    if (!(fds = getenv("LISTEN_FDS")) || (n = atoi(fds)) <= 0)
+        return 0;
+
+    /* these mustn't leak into our children */
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    for (i = 0; i < n; i++)
+        listen_on(KSUDO_LISTEN_FDS_START + i);
+    return n;
+}
+
+/* Run from inetd. stdin is either a listening socket ("wait") or a
+ * single connection ("nowait"). Either way inetd has put the socket on
+ * stdout and stderr too, so move it out of the way before anything
+ * gets written there.
+ */
+static void
+inetd_socks ()
+{
+    dRV;
+    int         sck, null, acc;
+    socklen_t   len = sizeof(acc);
+
+    if (getsockopt(0, SOL_SOCKET, SO_ACCEPTCONN, &acc, &len) < 0)
+        err(EX_USAGE, "-i needs a socket on stdin");
+
+    SYSCHK(sck = dup(0), "can't dup stdin");
+    SYSCHK(null = open(_PATH_DEVNULL, O_RDWR), "can't open /dev/null");
+    SYSCHK(dup2(null, 0), "can't dup /dev/null");
+    SYSCHK(dup2(null, 1), "can't dup /dev/null");
+    SYSCHK(dup2(null, 2), "can't dup /dev/null");
+    if (null > 2) close(null);
+
+    if (acc)
+        listen_on(sck);
+    else
+        kss_accept(sck, server_ldata());
+}
+
+/* Upgrades.
+ *
+ * On SIGUSR2 we re-exec ourself in place, so the new binary keeps our
+ * pid and can still reap the commands we started. Everything needed to
+ * carry on is written to an unlinked temporary file as a
+ * KSUDO-SAVED-STATE, and the new process is told where to find it with
+ * -U. The listening sockets and every fd belonging to a session stay
+ * open across the exec, so clients see nothing but a short pause.
+ * Sessions still in the AP-REQ exchange are dropped: the krb5 replay
+ * cache won't let the client simply send it again, but they haven't
+ * started anything yet and can reconnect.
+ */
+
+static void
+server_cloexec (const KSUDO_SAVED_STATE *st, int on)
+{
+    const KSUDO_SAVED_SESSION   *ss;
+    int                         i, j;
+
+#define CLOEXEC(fd) fcntl((fd), F_SETFD, on ? FD_CLOEXEC : 0)
+    for (i = 0; i < st->listen.len; i++)
+        CLOEXEC(st->listen.val[i]);
+
+    for (i = 0; i < st->sessions.len; i++) {
+        ss = &st->sessions.val[i];
+        CLOEXEC(ss->msgfd);
+        for (j = 0; j < ss->data.len; j++)
+            CLOEXEC(ss->data.val[j].osfd);
+    }
+#undef CLOEXEC
+}
+
+/* Milliseconds since started, for the saved state */
+static unsigned long
+server_elapsed (const struct timespec *started)
+{
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+        err(EX_OSERR, "can't read the clock");
+    return (now.tv_sec - started->tv_sec) * 1000
+        + (now.tv_nsec - started->tv_nsec) / 1000000;
+}
+
+/* The other way round: when something elapsed ms ago started */
+static void
+server_started (unsigned long elapsed, struct timespec *started)
+{
+    if (clock_gettime(CLOCK_MONOTONIC, started) < 0)
+        err(EX_OSERR, "can't read the clock");
+    started->tv_sec    -= elapsed / 1000;
+    started->tv_nsec   -= (elapsed % 1000) * 1000000L;
+    if (started->tv_nsec < 0) {
+        started->tv_sec--;
+        started->tv_nsec += 1000000000L;
+    }
+}
+
+/* How long a restored command has left before cmdtimeout, or before
+ * the KILL if it has had its TERM already */
+static unsigned long
+server_time_left (unsigned long elapsed, int termsent)
+{
+    if (termsent)
+        return KSUDO_KILL_GRACE * 1000;
+    if (elapsed < cmdtimeout * 1000UL)
+        return cmdtimeout * 1000UL - elapsed;
+    return 0;
+}
+
+static void
+server_save (int sess, KSUDO_SAVED_SESSION *ss)
+{
+    dKSSOP(server);
+
+    ss->running     = KssSTATE(sess) == sop_dispatch_msg;
+    ss->pid         = data->pid;
+    ss->termsent    = data->termsent;
+    AsnString(ss->princ, data->princ);
+    if (data->peer) {
+        New(ss->peeraddr, 1);
+        AsnString(*ss->peeraddr, data->peer);
+    }
+    if (data->local) {
+        New(ss->peer, 1);
+        ss->peer->uid   = data->peeruid;
+        ss->peer->gid   = data->peergid;
+    }
+
+    if (ss->running)
+        ss->elapsed = server_elapsed(&data->started);
+
+    kss_save(sess, ss);
+}
+
+static void
+server_save_orphan (server_orphan *o, KSUDO_SAVED_ORPHAN *so)
+{
+    so->pid         = o->pid;
+    so->elapsed     = server_elapsed(&o->started);
+    so->termsent    = o->termsent;
+    so->child       = o->child;
+    AsnString(so->princ, o->princ);
+    if (o->peer) {
+        New(so->peeraddr, 1);
+        AsnString(*so->peeraddr, o->peer);
+    }
+}
+
+static void
+server_upgrade ()
+{
+    dRV; dKRBCHK;
+    KSUDO_SAVED_STATE   st;
+    krb5_data           der;
+    size_t              len, outlen;
+    char                path[]  = _PATH_TMP "ksudod.XXXXXX";
+    char                fdstr[16];
+    char                **av;
+    int                 fd, i, n;
+    ksudo_sop           state;
+    server_orphan       *o;
+
+    Zero(&st, 1);
+    New(st.listen.val, nksfds);
+    New(st.sessions.val, nsessions);
+    st.listen.len = st.sessions.len = 0;
+
+    for (i = 0; i < nksfds; i++)
+        if (KsfFD(i) != -1 && KsfIS(i, listen))
+            st.listen.val[st.listen.len++] = KsfFD(i);
+
+    for (i = 0; i < nsessions; i++) {
+        if (!KssOK(i)) continue;
+
+        /* a queued or waiting command would need its CMD saving too,
+         * and the client can always try again */
+        state = KssSTATE(i);
+        if ((state != sop_read_cmd && state != sop_dispatch_msg)
+            || KssDATA(i, server)->queued || KssDATA(i, server)->waiting
+        ) {
+            debug("server_upgrade: dropping [%d]", i);
+            continue;
+        }
+        Zero(&st.sessions.val[st.sessions.len], 1);
+        server_save(i, &st.sessions.val[st.sessions.len++]);
+    }
+
+    /* hung-up commands keep their slots and time limits too */
+    if (orphans) {
+        for (o = orphans, n = 0; o; o = o->next) n++;
+        NewZ(st.orphans, 1);
+        NewZ(st.orphans->val, n);
+        for (o = orphans; o; o = o->next)
+            server_save_orphan(o, &st.orphans->val[st.orphans->len++]);
+    }
+
+    len = length_KSUDO_SAVED_STATE(&st);
+    KRBCHK(krb5_data_alloc(&der, len), "can't allocate DER buffer");
+    KRBCHK(encode_KSUDO_SAVED_STATE(der.data + len - 1, len, &st, &outlen),
+        "can't DER-encode KSUDO-SAVED-STATE");
+    if (outlen != len)
+        Panic("DER-encoding came out the wrong length");
+
+    if ((fd = mkstemp(path)) < 0) {
+        warn("can't create upgrade state file");
+        goto fail;
+    }
+    unlink(path);
+
+    for (outlen = 0; outlen < len; outlen += rv) {
+        if ((rv = write(fd, (char *)der.data + outlen, len - outlen)) < 0) {
+            warn("can't write upgrade state");
+            close(fd);
+            goto fail;
+        }
+    }
+    SYSCHK(lseek(fd, 0, SEEK_SET), "can't rewind upgrade state");
+    snprintf(fdstr, sizeof(fdstr), "%d", fd);
+
+    /* argv[0] -U fd, then the rest of the original options less any -U
+     * from a previous upgrade */
+    New(av, upargc + 3);
+    av[0] = upargv[0];
+    av[1] = "-U";
+    av[2] = fdstr;
+    for (i = 1, n = 3; i < upargc; i++) {
+        if (!strcmp(upargv[i], "-U")) {
+            i++;
+            continue;
+        }
+        if (!strncmp(upargv[i], "-U", 2)) continue;
+        av[n++] = upargv[i];
+    }
+    av[n] = NULL;
+
+    debug("server_upgrade: [%d] listeners [%d] sessions in [%d]",
+        st.listen.len, st.sessions.len, fd);
+    /* the new process starts a new writer */
+    audit_flush();
+    server_cloexec(&st, 0);
+    execvp(av[0], av);
+
+    warn("can't exec %s", av[0]);
+    server_cloexec(&st, 1);
+    Free(av);
+    close(fd);
+
+  fail:
+    krb5_data_free(&der);
+    free_KSUDO_SAVED_STATE(&st);
+}
+
+KSUDO_SIGOP(sigop_usr2)
+{
+    server_upgrade();
+}
+
+static void
+server_restore_session (const KSUDO_SAVED_SESSION *ss)
+{
+    ksudo_sdata_server  *data;
+    int                 i;
+
+    i = kss_new();
+    KssINIT(i, server, ss->msgfd,
+        ss->running ? sop_dispatch_msg : sop_read_cmd);
+    KssL(i).endop = server_end;
+
+    data = KssDATA(i, server);
+    data->pid       = ss->pid;
+    data->termsent  = ss->termsent;
+    if (ss->peer) {
+        data->local     = 1;
+        data->peeruid   = ss->peer->uid;
+        data->peergid   = ss->peer->gid;
+    }
+    if (!(data->princ = strndup(ss->princ.data, ss->princ.length)))
+        err(EX_OSERR, "can't copy principal");
+    if (ss->peeraddr && !(data->peer = strndup(ss->peeraddr->data,
+            ss->peeraddr->length)))
+        err(EX_OSERR, "can't copy peer address");
+
+    kss_restore(i, ss);
+    ArNewZ(KssARENA(i), KssL(i).timer, 1);
+
+    if (!ss->running) {
+        data->handshake = 1;
+        nhandshake++;
+        timer_arm(KssL(i).timer, KSUDO_HANDSHAKE_TIMEOUT * 1000,
+            server_timeout, i);
+        return;
+    }
+
+    server_started(ss->elapsed, &data->started);
+
+    kss_data_ops(i);
+    server_timeout(i);
+
+    if (!data->pid) return;
+    data->child = 1;
+    nchildren++;
+
+    if (cmdtimeout) {
+        ArNewZ(KssARENA(i), data->cmdtimer, 1);
+        timer_arm(data->cmdtimer,
+            server_time_left(ss->elapsed, data->termsent),
+            server_cmd_timeout, i);
+    }
+}
+
+static void
+server_restore_orphan (const KSUDO_SAVED_ORPHAN *so)
+{
+    server_orphan   *o;
+
+    NewZ(o, 1);
+    o->pid      = so->pid;
+    o->termsent = so->termsent;
+    o->child    = so->child;
+    if (!(o->princ = strndup(so->princ.data, so->princ.length)))
+        err(EX_OSERR, "can't copy principal");
+    if (so->peeraddr && !(o->peer = strndup(so->peeraddr->data,
+            so->peeraddr->length)))
+        err(EX_OSERR, "can't copy peer address");
+    server_started(so->elapsed, &o->started);
+
+    o->next     = orphans;
+    orphans     = o;
+    if (o->child) nchildren++;
+
+    if (cmdtimeout)
+        timer_arm(&o->kill, server_time_left(so->elapsed, o->termsent),
+            server_orphan_timeout, o->pid);
+}
+
+/* Pick up where the process which exec'd us left off */
+static void
+server_restore (int fd)
+{
+    dRV; dKRBCHK;
+    KSUDO_SAVED_STATE   st;
+    struct stat         sb;
+    krb5_data           der;
+    size_t              got;
+    ssize_t             n;
+    int                 i;
+
+    SYSCHK(fstat(fd, &sb), "can't stat upgrade state");
+    KRBCHK(krb5_data_alloc(&der, sb.st_size),
+        "can't allocate upgrade state buffer");
+    for (got = 0; got < der.length; got += n) {
+        SYSCHK(n = read(fd, (char *)der.data + got, der.length - got),
+            "can't read upgrade state");
+        if (!n) errx(EX_DATAERR, "upgrade state is truncated");
+    }
+    close(fd);
+
+    KRBCHK(decode_KSUDO_SAVED_STATE(der.data, der.length, &st, NULL),
+        "can't decode KSUDO-SAVED-STATE");
+    krb5_data_free(&der);
+
+    debug("server_restore: [%d] listeners [%d] sessions",
+        st.listen.len, st.sessions.len);
+
+    for (i = 0; i < st.listen.len; i++)
+        listen_on(st.listen.val[i]);
+
+    if (st.sessions.len) init();
+    for (i = 0; i < st.sessions.len; i++)
+        server_restore_session(&st.sessions.val[i]);
+    for (i = 0; st.orphans && i < st.orphans->len; i++)
+        server_restore_orphan(&st.orphans->val[i]);
+
+    free_KSUDO_SAVED_STATE(&st);
+
+    /* any commands which exited during the exec will have had their
+     * SIGCHLD discarded */
+    sigop_chld();
 }
 
 void
 usage ()
 {
-    errx(EX_USAGE, "Usage: ksudod hostname");
+    errx(EX_USAGE, "Usage: ksudod [-p policy] [-t secs] [-b backlog] "
+        "[-H handshakes] [-c children] [-m bytes] [-M bytes] "
+        "[-C ms[:bytes]] [-L limit] [-W princ=weight] [-r rate[:burst]] "
+        "[-o sockopt] "
+        "[-i] [-a auditlog] [-w workers] [-u socket] [-U fd] [hostname]");
 }
 
 int
 main (int argc, char **argv)
 {
-    if (argc > 2) usage();
+    int     ch, inetd = 0, restore = -1;
+
+    upargc = argc;
+    upargv = argv;
+
+    while ((ch = getopt(argc, argv, "a:b:c:C:H:iL:m:M:o:p:r:t:u:U:w:W:")) != -1) {
+        switch (ch) {
+            case 'p':
+                policyfile = optarg;
+                break;
+
+            case 'a':
+                auditfile = optarg;
+                break;
+
+            case 'w':
+                nworkers = atoi(optarg);
+                if (nworkers < 0) usage();
+                break;
+
+            case 'W':
+                if (!cmdq_weight(optarg)) usage();
+                break;
+
+            case 'r':
+                if (!cmdq_rate(optarg)) usage();
+                break;
+
+            case 't':
+                cmdtimeout = atoi(optarg);
+                if (cmdtimeout <= 0) usage();
+                break;
+
+            case 'b':
+                backlog = atoi(optarg);
+                if (backlog <= 0) usage();
+                break;
+
+            case 'H':
+                maxhandshake = atoi(optarg);
+                if (maxhandshake < 0) usage();
+                break;
+
+            case 'c':
+                maxchildren = atoi(optarg);
+                if (maxchildren < 0) usage();
+                break;
+
+            case 'm':
+                maxbuffered = strtoul(optarg, NULL, 10);
+                break;
 
-    init();
-    create_listen_socks(argc > 1 ? argv[1] : NULL);
+            case 'M':
+                maxmemory = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'C':
+                if (!kss_data_coalesce(optarg)) usage();
+                break;
+
+            case 'L':
+                if (!limit_option(optarg)) usage();
+                break;
+
+            case 'o':
+                if (!sock_option(optarg)) usage();
+                break;
+
+            case 'i':
+                inetd = 1;
+                break;
+
+            case 'u':
+                sockpath = optarg;
+                break;
+
+            case 'U':
+                restore = atoi(optarg);
+                if (restore < 0) usage();
+                break;
+
+            default:
+                usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc > 1) usage();
+
+    if (!(policy = policy_load(policyfile)))
+        errx(EX_CONFIG, "can't load policy");
+
+    /* a client going away shouldn't take us with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    cmdqops.room    = server_room;
+    cmdqops.start   = server_dequeue;
+    rcacheops.hit   = server_cached;
+    rcacheops.miss  = server_uncached;
+
+    limit_init();
+    if (auditfile) audit_open(auditfile);
+    worker_start(nworkers);
+
+    /* With inherited sockets we never need to look up our own address.
+     * If we weren't given a name, krb5 will canonicalize the local
+     * hostname itself. */
+    if (argc > 0) myname = argv[0];
+
+    if (restore >= 0)
+        server_restore(restore);
+    else if (inetd)
+        inetd_socks();
+    else if (!inherited_socks()) {
+        create_listen_socks(myname);
+        if (*sockpath)
+            listen_on(create_unix_listen_socket(sockpath, backlog));
+    }
 
     ioloop();
 
-    krb5_free_context(k5ctx);
+    audit_flush();
+    if (k5ctx) krb5_free_context(k5ctx);
 }
@@ -0,0 +1,191 @@
+/*
+ * This file is part of ksudo, a system for limited remote command
+ * execution based on Kerberos principals.
+ *
+ * Copyright 2012 Ben Morrow <ben@morrow.me.uk>.
+ * Released under the 2-clause BSD licence.
+ *
+ * limit.c: resource limits for commands, with rctl(8).
+ *
+ * Without limits a runaway command competes with ksudod itself for CPU
+ * and memory, and every session's relay slows down with it. Each
+ * command is put into a login class of its own, or one shared by all
+ * the commands of a principal, and RCTL rules are set on the class.
+ * Unlike rules on a process, these cover everything the command forks
+ * as one, and the class's racct usage is there to log when it exits.
+ *
+ * Everything here needs a kernel with RACCT and RCTL, and ksudod
+ * running as root.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include "config.h"
+#ifdef HAVE_RCTL
+#  include <sys/rctl.h>
+#endif
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ksudo.h"
+
+ksudo_limits    limits;
+
+/* Parse one -L argument, name[=value]. The names are rctl's own. Returns
+ * 0 if it isn't valid.
+ */
+int
+limit_option (const char *opt)
+{
+    const char  *val;
+    char        *end;
+    size_t      len;
+    uintmax_t   n   = 1;
+
+    if ((val = strchr(opt, '='))) {
+        len = val - opt;
+        n   = strtoumax(++val, &end, 10);
+        if (end == val || *end || n == UINTMAX_MAX)
+            return 0;
+    }
+    else
+        len = strlen(opt);
+
+#define OPT(s) (len == sizeof(s) - 1 && !strncmp(opt, (s), len))
+    if      (OPT("principal"))  limits.principal    = !!n;
+    else if (OPT("pcpu"))       limits.pcpu         = n;
+    else if (OPT("memoryuse"))  limits.memoryuse    = n;
+    else if (OPT("readbps"))    limits.readbps      = n;
+    else if (OPT("writebps"))   limits.writebps     = n;
+    else
+        return 0;
+#undef OPT
+
+    if (limits.pcpu || limits.memoryuse || limits.readbps
+        || limits.writebps)
+        limits.any = 1;
+
+    return 1;
+}
+
+#ifdef HAVE_RCTL
+
+/* The login class for a command: the principal's, or the command's own */
+static void
+limit_class (char *buf, size_t len, const char *princ, pid_t pid)
+{
+    if (limits.principal)
+        snprintf(buf, len, "ksudo.p%08lx",
+            ksudo_hash(princ, KSUDO_HASH_INIT) & 0xffffffffUL);
+    else
+        snprintf(buf, len, "ksudo.c%ld", (long)pid);
+}
+
+static void
+limit_rule (const char *class, const char *res, const char *action,
+    uintmax_t n)
+{
+    char    rule[128];
+
+    if (!n) return;
+
+    snprintf(rule, sizeof(rule), "loginclass:%s:%s:%s=%ju",
+        class, res, action, n);
+    debug("limit_rule: [%s]", rule);
+    if (rctl_add_rule(rule, strlen(rule) + 1, NULL, 0) < 0)
+        err(EX_OSERR, "can't add rctl rule %s", rule);
+}
+
+/* Make sure the kernel can enforce the limits we've been given, before
+ * we accept any connections.
+ */
+void
+limit_init ()
+{
+    char    filter[64], buf[1024];
+
+    if (!limits.any) return;
+
+    snprintf(filter, sizeof(filter), "process:%ld", (long)getpid());
+    if (rctl_get_racct(filter, strlen(filter) + 1, buf, sizeof(buf)) < 0)
+        err(EX_UNAVAILABLE, "can't use rctl for command limits");
+}
+
+/* Runs in the child, while it is still root. Everything it starts
+ * from here on is in the class.
+ */
+void
+limit_child (const char *princ)
+{
+    char    class[MAXLOGNAME], filter[MAXLOGNAME + 16];
+
+    if (!limits.any) return;
+
+    limit_class(class, sizeof(class), princ, getpid());
+    if (setloginclass(class) < 0)
+        err(EX_OSERR, "can't set login class %s", class);
+
+    /* a principal's class may have rules from a previous ksudod with
+     * different limits */
+    snprintf(filter, sizeof(filter), "loginclass:%s", class);
+    rctl_remove_rule(filter, strlen(filter) + 1, NULL, 0);
+
+    /* pcpu can only be throttled, which is what deny does for it */
+    limit_rule(class, "pcpu",       "deny",     limits.pcpu);
+    limit_rule(class, "memoryuse",  "deny",     limits.memoryuse);
+    limit_rule(class, "readbps",    "throttle", limits.readbps);
+    limit_rule(class, "writebps",   "throttle", limits.writebps);
+}
+
+/* Add the class's usage to an audit record. For a principal's class
+ * this is everything its commands have used so far.
+ */
+void
+limit_account (ksudo_auditrec *r, const char *princ, pid_t pid)
+{
+    char    class[MAXLOGNAME], filter[MAXLOGNAME + 16], buf[1024];
+
+    if (!limits.any || !r) return;
+
+    limit_class(class, sizeof(class), princ, pid);
+    snprintf(filter, sizeof(filter), "loginclass:%s", class);
+    if (rctl_get_racct(filter, strlen(filter) + 1, buf, sizeof(buf)) < 0) {
+        debug("limit_account: can't read racct for [%s]: %s",
+            class, strerror(errno));
+        return;
+    }
+    audit_str(r, "racct", buf, strnlen(buf, sizeof(buf)));
+}
+
+/* The command has exited. A class of its own isn't needed any more. */
+void
+limit_release (const char *princ, pid_t pid)
+{
+    char    class[MAXLOGNAME], filter[MAXLOGNAME + 16];
+
+    if (!limits.any || limits.principal) return;
+
+    limit_class(class, sizeof(class), princ, pid);
+    snprintf(filter, sizeof(filter), "loginclass:%s", class);
+    rctl_remove_rule(filter, strlen(filter) + 1, NULL, 0);
+}
+
+#else
+
+void
+limit_init ()
+{
+    if (limits.any)
+        errx(EX_UNAVAILABLE, "command limits need rctl(8)");
+}
+
+void limit_child     (const char *princ) { }
+void limit_account   (ksudo_auditrec *r, const char *princ, pid_t pid) { }
+void limit_release   (const char *princ, pid_t pid) { }
+
+#endif
@@ -13,6 +13,7 @@
 
 #include <fcntl.h>
 #include <netdb.h>
+#include <stdio.h>
 #include <unistd.h>
 
 #include "ksudo.h"
@@ -20,50 +21,137 @@
 int             nsessions   = 0;
 ksudo_session   *sessions   = NULL;
 
-KSUDO_FDOP(listen_fd_read)
+/* Start a server session on cli, a connection accepted either by us or
+ * by inetd.
+ */
+void
+kss_accept (int cli, ksudo_fddata_listen *data)
 {
-    dFDOP(listen);  dRV;
-    int     cli, i;
+    dRV;
+    int     i;
     struct sockaddr_storage raddr;
     struct sockaddr         *raddrp;
     socklen_t               raddrlen;
     char    host[NI_MAXHOST], srv[NI_MAXSERV];
-
-    ckFDOP(listen);
+    uid_t   uid;
+    gid_t   gid;
 
     raddrp      = (struct sockaddr *)&raddr;
     raddrlen    = sizeof(raddr);
-    SYSCHK(cli = accept(KsfFD(ksf), raddrp, &raddrlen), 
-        "can't accept connection");
+    /* The client may have reset the connection already. That's its
+     * problem, not ours, so just drop it. */
+    if (getpeername(cli, raddrp, &raddrlen) < 0) {
+        warn("can't get client address");
+        close(cli);
+        return;
+    }
 
-    GAICHK(getnameinfo(raddrp, raddrlen, host, sizeof(host),
-            srv, sizeof(srv), 0),
-        "can't resolve client address");
+    /* A local client has no address worth resolving, and TCP options
+     * don't apply; but the kernel can tell us who it is. */
+    if (raddrp->sa_family == AF_UNIX) {
+        if (getpeereid(cli, &uid, &gid) < 0) {
+            warn("can't get client credentials");
+            close(cli);
+            return;
+        }
+        snprintf(host, sizeof(host), "uid %ld", (long)uid);
+        snprintf(srv, sizeof(srv), "gid %ld", (long)gid);
+    }
+    else {
+        if (sock_keepalive(cli) < 0 || sock_tune(cli) < 0) {
+            close(cli);
+            return;
+        }
+
+        /* a DNS lookup here would stall every other session */
+        if ((rv = getnameinfo(raddrp, raddrlen, host, sizeof(host),
+                srv, sizeof(srv), NI_NUMERICHOST | NI_NUMERICSERV))
+        ) {
+            warnx("can't format client address: %s", gai_strerror(rv));
+            close(cli);
+            return;
+        }
+    }
     debug("accepted connection from [%s]:[%s]", host, srv);
 
-    for (i = 0; i < nsessions; i++)
-        if (!KssOK(i))
-            break;
+    i = kss_new();
+    KssINIT(i, server, cli, data->startop);
+    KssL(i).endop = data->endop;
 
-    if (i == nsessions) {
-        int j;
+    {
+        ksudo_sdata_server  *sdata  = KssDATA(i, server);
 
-        if (sessions) {
-            nsessions *= 2;
-            Renew(sessions, nsessions);
+        if (raddrp->sa_family == AF_UNIX) {
+            sdata->local    = 1;
+            sdata->peeruid  = uid;
+            sdata->peergid  = gid;
+            SYSCHK(asprintf(&sdata->peer, "%ld:%ld", (long)uid, (long)gid),
+                "can't format peer");
         }
-        else {
-            nsessions = 8; 
-            New(sessions, 8);
+        else
+            SYSCHK(asprintf(&sdata->peer, "%s:%s", host, srv),
+                "can't format peer");
+    }
+
+    if (data->admitop) {
+        ksudo_sop   start   = data->admitop(i);
+
+        if (!start) {
+            debug("refused connection from [%s]:[%s]", host, srv);
+            kss_close(i);
+            return;
         }
+        KssNEXT(i, start);
+    }
 
-        for (j = i; j < nsessions; j++)
-            /* don't use NULL, since that might not be a function
-             * pointer type */
-            sessions[j].state = KSSs_NONE;
+    if (data->timeoutop) {
+        ArNewZ(KssARENA(i), KssL(i).timer, 1);
+        timer_arm(KssL(i).timer, KSUDO_HANDSHAKE_TIMEOUT * 1000,
+            data->timeoutop, i);
     }
+}
 
-    KssINIT(i, server, cli, data->startop);
+static void
+listen_wake (int ksf)
+{
+    debug("listen_wake: [%d] accepting again", ksf);
+    KsfMODE_SET(ksf, KSFm_IN);
+}
+
+KSUDO_FDOP(listen_fd_read)
+{
+    dFDOP(listen);
+    int     cli;
+
+    ckFDOP(listen);
+
+    if ((cli = accept(KsfFD(ksf), NULL, NULL)) < 0) {
+        switch (errno) {
+            /* the client gave up before we got to it */
+            case ECONNABORTED:
+            case EAGAIN:
+            case EINTR:
+                return;
+
+            /* Out of fds. The connection stays in the backlog, so
+             * leave it there for a while rather than spinning on it;
+             * sessions finishing meanwhile will make room. */
+            case EMFILE:
+            case ENFILE:
+            case ENOBUFS:
+            case ENOMEM:
+                warn("can't accept connection, backing off");
+                KsfMODE_CLR(ksf, KSFm_IN);
+                timer_arm(&data->backoff, KSUDO_ACCEPT_BACKOFF,
+                    listen_wake, ksf);
+                return;
+
+            default:
+                warn("can't accept connection");
+                return;
+        }
+    }
+    kss_accept(cli, data);
 }
 
 ksudo_fdops ksudo_fdops_listen = {
@@ -83,112 +83,594 @@ read_asn1_length (ksudo_buf *buf, krb5_data *pkt)
     return 0;
 }
 
+size_t      msgq_bytes  = 0;
+
+static ksudo_msgq   *pktfree    = NULL;
+static int          npktfree    = 0;
+
+/* Returns a packet for a msg queue, with room for len bytes. With len 0
+ * the data is left for krb5 to fill in.
+ */
+krb5_data *
+pkt_get (size_t len)
+{
+    dKRBCHK;
+    ksudo_msgq  *q;
+
+    if ((q = pktfree)) {
+        pktfree = q->next;
+        npktfree--;
+    }
+    else {
+        New(q, 1);
+        mem_bytes += sizeof(*q);
+    }
+    q->next = NULL;
+
+    if (len > sizeof(q->buf))
+        KRBCHK(krb5_data_alloc(&q->pkt, len), "can't allocate packet");
+    else {
+        q->pkt.data     = len ? q->buf : NULL;
+        q->pkt.length   = len;
+    }
+    return &q->pkt;
+}
+
+void
+pkt_put (krb5_data *pkt)
+{
+    ksudo_msgq  *q  = (ksudo_msgq *)pkt;
+
+    if (pkt->data != q->buf)
+        krb5_data_free(pkt);
+
+    if (npktfree < KSUDO_PKT_CACHE) {
+        q->next = pktfree;
+        pktfree = q;
+        npktfree++;
+    }
+    else {
+        mem_bytes -= sizeof(*q);
+        Free(q);
+    }
+}
+
+static void
+mbf_consume (ksudo_msgbuf *b, size_t n)
+{
+    ksudo_msgq  *q;
+    size_t      l;
+
+    while (n) {
+        Assert(b->head);
+        l = MbfPTRl(b);
+        if (n < l) {
+            b->ptr += n;
+            return;
+        }
+        n -= l;
+
+        q = b->head;
+        b->head = q->next;
+        if (!b->head) b->tail = &b->head;
+        b->ptr = MbfCURp(b);
+        b->len--;
+
+        msgq_bytes -= q->pkt.length;
+        pkt_put(&q->pkt);
+    }
+}
+
+/* Take the packet off the head of a queue */
+static krb5_data *
+mbf_pop (ksudo_msgbuf *b)
+{
+    ksudo_msgq  *q;
+
+    if (!(q = b->head)) return NULL;
+
+    b->head = q->next;
+    if (!b->head) b->tail = &b->head;
+    b->ptr = MbfCURp(b);
+    b->len--;
+
+    msgq_bytes -= q->pkt.length;
+    return &q->pkt;
+}
+
+static void
+mbf_free (ksudo_msgbuf *b)
+{
+    krb5_data   *pkt;
+
+    while ((pkt = mbf_pop(b)))
+        pkt_put(pkt);
+}
+
+static void
+sched_advance (ksudo_msgsched *s)
+{
+    s->cur      = (s->cur + 1) % KSUDO_NFDS;
+    s->fresh    = 1;
+}
+
+/* The next message to send, by the rules above ksudo_msgsched */
+static krb5_data *
+sched_next (ksudo_msgsched *s)
+{
+    ksudo_msgbuf    *q;
+
+    if (s->ctl.head)
+        return mbf_pop(&s->ctl);
+
+    while (s->ndata) {
+        q = &s->data[s->cur];
+
+        if (!q->head) {
+            s->deficit[s->cur] = 0;
+            sched_advance(s);
+            continue;
+        }
+        if (s->fresh) {
+            s->deficit[s->cur] += KSUDO_SCHED_QUANTUM;
+            s->fresh = 0;
+        }
+        if (MbfCURl(q) > s->deficit[s->cur]) {
+            sched_advance(s);
+            continue;
+        }
+
+        s->deficit[s->cur] -= MbfCURl(q);
+        s->ndata--;
+        return mbf_pop(q);
+    }
+
+    return mbf_pop(&s->last);
+}
+
+/* Encrypt messages onto the wire queue until there's a writev's worth,
+ * or with all until the scheduler is empty. Keeping the wire queue
+ * short is what lets control messages past a stream in full flood.
+ */
+static void
+msg_sched_fill (ksudo_fddata_msg *data, int all)
+{
+    dKRBCHK;
+    krb5_data   *der, *packet;
+
+    while (all || data->wbuf.len < KSUDO_MSGQ_IOV) {
+        if (!(der = sched_next(&data->sched))) break;
+
+        packet = pkt_get(0);
+        KRBCHK(krb5_mk_priv(k5ctx, KssK5A(data->session), der, packet,
+                NULL),
+            "can't encrypt KSUDO-MSG");
+        pkt_put(der);
+
+        MbfPUSH(&data->wbuf, packet);
+    }
+}
+
+static int
+msg_pending (ksudo_fddata_msg *data)
+{
+    ksudo_msgsched  *s  = &data->sched;
+
+    return MbfLEFT(&data->wbuf) || s->ctl.head || s->ndata
+        || s->last.head;
+}
+
+/* Is there room to queue DATA for fd? */
+int
+kss_msg_room (int sess, int fd)
+{
+    if (KssMSGFD(sess) < 0) return 0;
+    return MbfAVAIL(&KsfDATA(KssMSGFD(sess), msg)->sched.data[fd]);
+}
+
+/* How many DATA and CLOSE messages for fd are waiting to be encrypted */
+int
+kss_msg_queued (int sess, int fd)
+{
+    if (KssMSGFD(sess) < 0) return 0;
+    return KsfDATA(KssMSGFD(sess), msg)->sched.data[fd].len;
+}
+
+/* Returns 0 if the message could not be queued. This only happens for
+ * DATA messages, when that stream's queue is full, or if the msg fd
+ * has gone.
+ */
 int
 write_msg (int sess, KSUDO_MSG *msg)
 {
     dKRBCHK;
-    ksudo_msgbuf    *buf;
+    ksudo_msgsched  *s;
+    ksudo_msgbuf    *q;
     size_t          len, outlen;
-    krb5_data       der, *packet;
-
-    buf = KssMBUF(sess);
-    if (!MbfAVAIL(buf)) return 0;
+    krb5_data       *der;
+    int             fd;
+
+    if (KssMSGFD(sess) < 0) return 0;
+    s = &KsfDATA(KssMSGFD(sess), msg)->sched;
+
+    switch (msg->element) {
+        case choice_KSUDO_MSG_data:
+            fd = msg->u.data.fd;
+            Assert(fd >= 0 && fd < KSUDO_NFDS);
+            q = &s->data[fd];
+            if (!MbfAVAIL(q)) return 0;
+            s->ndata++;
+            break;
+
+        case choice_KSUDO_MSG_close:
+            fd = msg->u.close;
+            if (fd < 0 || fd >= KSUDO_NFDS) {
+                q = &s->ctl;
+                break;
+            }
+            q = &s->data[fd];
+            s->ndata++;
+            break;
+
+        case choice_KSUDO_MSG_exit:
+        case choice_KSUDO_MSG_err:
+            q = &s->last;
+            break;
+
+        default:
+            q = &s->ctl;
+            break;
+    }
 
     len = length_KSUDO_MSG(msg);
-    KRBCHK(krb5_data_alloc(&der, len), "can't allocate DER buffer");
+    der = pkt_get(len);
 
     /* Because DER values are preceded by their lengths, Heimdal's
      * encode_ functions start at the end of the buffer and work
      * backwards.
      */
-    KRBCHK(encode_KSUDO_MSG(der.data + len - 1, len, msg, &outlen),
+    KRBCHK(encode_KSUDO_MSG((uchar *)der->data + len - 1, len, msg,
+            &outlen),
         "can't DER-encode KSUDO-MSG");
 
     if (outlen != len)
         Panic("DER-encoding came out the wrong length");
 
-    New(packet, 1);
-    KRBCHK(krb5_mk_priv(k5ctx, KssK5A(sess), &der, packet, NULL),
-        "can't encrypt KSUDO-MSG");
-    krb5_data_free(&der);
-
-    MbfPUSH(buf, packet);
-    debug("write_msg [%d]=[%d] [%lx][%ld]",
-        sess, KssMSGFD(sess), (long)packet->data, (long)packet->length);
+    MbfPUSH(q, der);
+    debug("write_msg [%d]=[%d] type [%d] [%ld]",
+        sess, KssMSGFD(sess), (int)msg->element, (long)der->length);
     KsfMODE_SET(KssMSGFD(sess), KSFm_OUT);
     return 1;
 }
 
+/* Decrypt and decode a packet from the peer. Returns 0 if it can't
+ * be, in which case msg_dispatch will close the session: a forged or
+ * garbled packet is only that peer's problem.
+ */
 int
 read_msg (int sess, krb5_data *pkt, KSUDO_MSG *msg)
 {
     dKRBCHK;
-    size_t      len;
     krb5_data   der;
 
-    KRBCHK(krb5_rd_priv(k5ctx, KssK5A(sess), pkt, &der, NULL),
-        "can't decrypt KRB5-PRIV");
+    if ((ke = krb5_rd_priv(k5ctx, KssK5A(sess), pkt, &der, NULL))) {
+        krb5_warn(k5ctx, ke, "can't decrypt KRB5-PRIV");
+        KssL(sess).badmsg = 1;
+        return 0;
+    }
 
-    KRBCHK(decode_KSUDO_MSG(der.data, der.length, msg, NULL),
-        "can't decode KSUDO-MSG");
+    ke = decode_KSUDO_MSG(der.data, der.length, msg, NULL);
     krb5_data_free(&der);
+    if (ke) {
+        krb5_warn(k5ctx, ke, "can't decode KSUDO-MSG");
+        KssL(sess).badmsg = 1;
+        return 0;
+    }
 
     return 1;
 }
 
-KSUDO_FDOP(msg_fd_read)
+/* Step into the DER value at *p, which must have tag tag and end by
+ * end. Returns the length of its contents, with *p pointing at them,
+ * or -1.
+ */
+static ssize_t
+der_enter (const uchar **p, const uchar *end, uchar tag)
+{
+    const uchar *q  = *p;
+    size_t      len, n;
+
+    if (end - q < 2 || *q++ != tag) return -1;
+
+    len = *q++;
+    if (len & 0x80) {
+        n = len & 0x7f;
+        if (!n || n > sizeof(size_t) || (size_t)(end - q) < n) return -1;
+        for (len = 0; n--; q++)
+            len = len * 256 + *q;
+    }
+    if (len > (size_t)(end - q)) return -1;
+
+    *p = q;
+    return len;
+}
+
+/* Pick a DATA message apart without copying the payload out of der.
+ * Returns 0 if der isn't a well-formed DATA, for decode_KSUDO_MSG to
+ * deal with.
+ */
+static int
+msg_peek_data (const krb5_data *der, KSUDO_MSG *msg)
+{
+    const uchar *p      = der->data;
+    const uchar *end    = p + der->length;
+    ssize_t     len;
+    long        fd;
+
+    /* [2] SEQUENCE { INTEGER, OCTET STRING } */
+    if ((len = der_enter(&p, end, 0xa2)) < 0 || p + len != end)
+        return 0;
+    if ((len = der_enter(&p, end, 0x30)) < 0 || p + len != end)
+        return 0;
+    if ((len = der_enter(&p, end, 0x02)) < 1 || len > 4)
+        return 0;
+    for (fd = (signed char)*p; --len; )
+        fd = fd * 256 + *++p;
+    p++;
+    if ((len = der_enter(&p, end, 0x04)) < 0 || p + len != end)
+        return 0;
+
+    msg->element            = choice_KSUDO_MSG_data;
+    msg->u.data.fd          = fd;
+    msg->u.data.data.data   = (void *)p;
+    msg->u.data.data.length = len;
+    return 1;
+}
+
+/* Like read_msg, but a DATA message is left where it was decrypted:
+ * its payload points into der. Returns 1 for a DATA, which the caller
+ * must not free_KSUDO_MSG, but must krb5_data_free(der) once it has
+ * finished with. Anything else is decoded just as read_msg does, and
+ * der is already freed. Returns -1, with nothing to free, if the
+ * packet can't be read, as read_msg does 0.
+ */
+int
+read_msg_inplace (int sess, krb5_data *pkt, KSUDO_MSG *msg, krb5_data *der)
+{
+    dKRBCHK;
+
+    if ((ke = krb5_rd_priv(k5ctx, KssK5A(sess), pkt, der, NULL))) {
+        krb5_warn(k5ctx, ke, "can't decrypt KRB5-PRIV");
+        KssL(sess).badmsg = 1;
+        return -1;
+    }
+
+    if (msg_peek_data(der, msg)) return 1;
+
+    ke = decode_KSUDO_MSG(der->data, der->length, msg, NULL);
+    krb5_data_free(der);
+    if (ke) {
+        krb5_warn(k5ctx, ke, "can't decode KSUDO-MSG");
+        KssL(sess).badmsg = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Pass complete packets in the read buffer to the session, until it
+ * goes away or asks us to hold them. Once the session is closing there
+ * is nothing left it can do with them, and the state it was left in
+ * may not understand them, so they are thrown away. An empty buffer
+ * goes back to the pool, so an idle session doesn't keep one.
+ */
+static void
+msg_dispatch (int ksf)
 {
     dFDOP(msg);  dKRBCHK;
+    ksudo_buf   *buf    = data->rbuf;
+    int         sess    = data->session;
+    krb5_data   pkt;
+
+    if (!buf) return;
+
+    /* There may be more than one packet in the buffer. Stop if the
+     * session goes away underneath us: by then the buffer has gone
+     * back to the pool.
+     */
+    while (!KssL(sess).held) {
+        if ((ke = read_asn1_length(buf, &pkt))) {
+            if (ke != ASN1_OVERRUN)
+                KRBCHK(ke, "can't read ASN.1 length");
+            break;
+        }
+        if (KssL(sess).closing)
+            debug("msg_dispatch: [%d] closing, dropping [%lu] bytes",
+                sess, (unsigned long)pkt.length);
+        else
+            KssCALL(sess, &pkt);
+        if (KssMSGFD(sess) != ksf) return;
+        if (KssL(sess).badmsg) {
+            kss_close(sess);
+            return;
+        }
+        BufCONSUME(buf, pkt.length);
+    }
+
+    if (!BufFILL(buf) && !KssL(sess).held) {
+        buf_put(buf);
+        data->rbuf = NULL;
+    }
+    if (!data->rbuf || BufFREE(buf)) KsfMODE_SET(ksf, KSFm_IN);
+}
+
+/* Carry on passing packets to a held session */
+void
+kss_resume (int sess)
+{
+    KssL(sess).held = 0;
+    if (KssMSGFD(sess) >= 0)
+        msg_dispatch(KssMSGFD(sess));
+}
+
+KSUDO_FDOP(msg_fd_read)
+{
+    dFDOP(msg);
     ksudo_buf   *buf;
     int         sess;
-    krb5_data   pkt;
 
     ckFDOP(msg);
-    buf     = &data->rbuf;
+    if (!data->rbuf) data->rbuf = buf_get();
+    buf     = data->rbuf;
     sess    = data->session;
 
     Assert(KssOK(sess));
 
-    ksf_read(ksf, buf);
-    ke = read_asn1_length(buf, &pkt);
-    if (ke == ASN1_OVERRUN) return;
-    KRBCHK(ke, "can't read ASN.1 length");
+    if (ksf_read(ksf, buf, BufSIZE(buf)) < 0) {
+        debug("msg_fd_read: connection closed for [%d]", sess);
+        kss_close(sess);
+        return;
+    }
+    KssL(sess).lastio = timer_now();
 
-    KssCALL(sess, &pkt);
-    BufCONSUME(buf, pkt.length);
-    if (BufFREE(buf)) KsfMODE_SET(ksf, KSFm_IN);
+    msg_dispatch(ksf);
 }
 
 KSUDO_FDOP(msg_fd_write)
 {
     dFDOP(msg);  dRV;
     ksudo_msgbuf    *b;
-    struct iovec    iov[2];
+    ksudo_msgq      *q;
+    struct iovec    iov[KSUDO_MSGQ_IOV];
+    int             n, ndata;
 
     ckFDOP(msg);
-    b   = &data->wbuf;
+    b       = &data->wbuf;
+    ndata   = data->sched.ndata;
 
+    /* Moving messages to the wire queue is what makes room for the
+     * streams, whether or not the writev gets anywhere. */
+    msg_sched_fill(data, 0);
+    if (data->sched.ndata < ndata) kss_unblock(data->session);
     if (!MbfLEFT(b)) goto out;
 
     iov[0].iov_base = MbfPTR(b);
     iov[0].iov_len  = MbfPTRl(b);
-    iov[1].iov_base = MbfNEXTp(b);
-    iov[1].iov_len  = MbfNEXTl(b);
-    rv = writev(KsfFD(ksf), iov, MbfNEXT(b) ? 2 : 1);
-    debug("msg_fd_write [%d] [%lx][%ld] ([%lx][%ld]) -> [%d]",
-        ksf, (long)MbfPTR(b), (long)MbfPTRl(b),
-            (long)MbfNEXTp(b), (long)MbfNEXTl(b), rv);
+    for (n = 1, q = b->head->next; q && n < KSUDO_MSGQ_IOV;
+            n++, q = q->next) {
+        iov[n].iov_base = q->pkt.data;
+        iov[n].iov_len  = q->pkt.length;
+    }
+    rv = writev(KsfFD(ksf), iov, n);
+    debug("msg_fd_write [%d] [%lx][%ld] +[%d] -> [%d]",
+        ksf, (long)MbfPTR(b), (long)MbfPTRl(b), n - 1, rv);
     
-    if (rv == EAGAIN) return;
-    SYSCHK(rv, "can't write to msg fd");
+    if (rv < 0 && errno == EAGAIN) return;
+    if (rv < 0) {
+        warn("can't write to msg fd");
+        kss_close(data->session);
+        return;
+    }
 
-    MbfCONSUME(b, rv);
+    mbf_consume(b, rv);
+    KssL(data->session).lastio = timer_now();
 
   out:
-    if (!MbfLEFT(b)) KsfMODE_CLR(ksf, KSFm_OUT);
+    if (!msg_pending(data)) {
+        KsfMODE_CLR(ksf, KSFm_OUT);
+        if (KssL(data->session).closing)
+            kss_close(data->session);
+    }
+}
+
+KSUDO_FDOP(msg_fd_close)
+{
+    dFDOP(msg);
+    ksudo_msgsched  *s;
+    int             i;
+
+    ckFDOP(msg);
+    s   = &data->sched;
+    buf_put(data->rbuf);
+    data->rbuf = NULL;
+    mbf_free(&data->wbuf);
+    mbf_free(&s->ctl);
+    mbf_free(&s->last);
+    for (i = 0; i < KSUDO_NFDS; i++)
+        mbf_free(&s->data[i]);
+    SchedINIT(s);
 }
 
 ksudo_fdops ksudo_fdops_msg = {
     .read       = msg_fd_read,
-    .write      = msg_fd_write
+    .write      = msg_fd_write,
+    .close      = msg_fd_close
 };
+
+/* Save the msg fd for an upgrade. Everything queued is encrypted, and
+ * the unsent part goes out as one lump, since nothing looks inside it
+ * again.
+ */
+void
+kss_msg_save (int sess, KSUDO_SAVED_SESSION *ss)
+{
+    dKRBCHK;
+    int                 ksf     = KssMSGFD(sess);
+    ksudo_fddata_msg    *data   = KsfDATA(ksf, msg);
+    ksudo_msgbuf        *b      = &data->wbuf;
+    ksudo_msgq          *q;
+    size_t              len;
+    char                *p;
+
+    ss->msgfd = KsfFD(ksf);
+    /* the new process starts with an empty scheduler */
+    msg_sched_fill(data, 1);
+
+    if (data->rbuf)
+        KRBCHK(krb5_data_copy(&ss->rbuf, BufSTART(data->rbuf),
+                BufFILL(data->rbuf)),
+            "can't save msg read buffer");
+    else
+        KRBCHK(krb5_data_alloc(&ss->rbuf, 0),
+            "can't save msg read buffer");
+
+    len = MbfLEFT(b);
+    if (b->head)
+        for (q = b->head->next; q; q = q->next)
+            len += q->pkt.length;
+
+    KRBCHK(krb5_data_alloc(&ss->wbuf, len),
+        "can't save msg write queue");
+    if (!len) return;
+
+    p = ss->wbuf.data;
+    Copy((char *)MbfPTR(b), p, MbfPTRl(b));
+    p += MbfPTRl(b);
+    for (q = b->head->next; q; q = q->next) {
+        Copy((char *)q->pkt.data, p, q->pkt.length);
+        p += q->pkt.length;
+    }
+}
+
+void
+kss_msg_restore (int sess, const KSUDO_SAVED_SESSION *ss)
+{
+    dKRBCHK;
+    int                 ksf     = KssMSGFD(sess);
+    ksudo_fddata_msg    *data   = KsfDATA(ksf, msg);
+    krb5_data           *packet;
+
+    if (ss->rbuf.length) {
+        data->rbuf = buf_get();
+        Assert(ss->rbuf.length <= BufFREE(data->rbuf));
+        Copy((uchar *)ss->rbuf.data, BufEND(data->rbuf), ss->rbuf.length);
+        BufEXTEND(data->rbuf, ss->rbuf.length);
+    }
+
+    if (ss->wbuf.length) {
+        packet = pkt_get(ss->wbuf.length);
+        Copy((char *)ss->wbuf.data, (char *)packet->data, ss->wbuf.length);
+        MbfPUSH(&data->wbuf, packet);
+        KsfMODE_SET(ksf, KSFm_OUT);
+    }
+}
@@ -0,0 +1,640 @@
+/*
+ * This file is part of ksudo, a system for limited remote command
+ * execution based on Kerberos principals.
+ *
+ * Copyright 2012 Ben Morrow <ben@morrow.me.uk>.
+ * Released under the 2-clause BSD licence.
+ *
+ * policy.c: deciding who may run what.
+ *
+ * The policy file is line-based. Blank lines and lines starting with #
+ * are ignored; otherwise each line is one of
+ *
+ *      group   name principal...
+ *      allow   who user pattern
+ *      cache   ttl user pattern
+ *
+ * who is a principal, %name for every member of a group, or * for
+ * anyone. user is a target user or *. pattern is an fnmatch(3) pattern
+ * matched against the command and its arguments joined with single
+ * spaces, and runs to the end of the line. Groups must be defined
+ * before they are used.
+ *
+ * Since the arguments are joined, a * or ? in a pattern can match
+ * across the boundary between two of them, and a space in a pattern
+ * matches either a space within an argument or the gap between two.
+ * "vi /etc/m*" also allows "vi /etc/motd /root/x", so put wildcards
+ * only where any number of arguments is acceptable. A user or an
+ * argument containing a NUL never matches anything.
+ *
+ * A cache line says the matching commands always give the same output
+ * for up to ttl seconds, whoever asks, so ksudod may answer from
+ * memory instead of running them again. A command run with a remote
+ * fd it can read, such as stdin, is never cached. The first
+ * matching cache line applies; it grants nothing by itself.
+ *
+ * At load time the rules are compiled into a hash keyed on (principal,
+ * user). A pattern without wildcards can only match one command line,
+ * so those go in a second hash keyed on the entry and the command, and
+ * a check costs at most four lookups in each however many of them
+ * there are. Only the wildcard patterns of the entries found need an
+ * fnmatch each. Cache lines are kept per user the same way, so a
+ * command is only matched against the wildcard cache patterns for its
+ * own user and for *.
+ */
+
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ksudo.h"
+
+#define POLICY_WS   " \t\n"
+
+typedef struct ksudo_pent {
+    struct ksudo_pent   *next;
+    unsigned long       hash;
+    char                *princ;
+    char                *user;
+    int                 npats;
+    char                **pats;
+} ksudo_pent;
+
+typedef struct ksudo_pcache {
+    struct ksudo_pcache *next;
+    unsigned            ttl;
+    /* the line's place in the file, since the first match wins */
+    unsigned            seq;
+    char                *pat;
+} ksudo_pcache;
+
+/* The cache lines for one user, or for * */
+typedef struct ksudo_pcuser {
+    struct ksudo_pcuser *next;
+    unsigned long       hash;
+    char                *user;
+    /* those with wildcards, in file order */
+    ksudo_pcache        *globs;
+    ksudo_pcache        **gtail;
+} ksudo_pcuser;
+
+/* A pattern without wildcards, belonging to owner, a ksudo_pent or a
+ * ksudo_pcuser. ttl and seq are for cache lines. */
+typedef struct ksudo_plit {
+    struct ksudo_plit   *next;
+    unsigned long       hash;
+    const void          *owner;
+    char                *cmd;
+    unsigned            ttl;
+    unsigned            seq;
+} ksudo_plit;
+
+typedef struct {
+    unsigned long   nbuckets;
+    unsigned long   n;
+    ksudo_plit      **buckets;
+} ksudo_ptab;
+
+struct ksudo_policy {
+    unsigned long   nbuckets;
+    unsigned long   nents;
+    ksudo_pent      **buckets;
+    ksudo_ptab      lits;
+
+    unsigned        ncaches;
+    ksudo_pcuser    *cusers;
+    ksudo_ptab      clits;
+};
+
+typedef struct ksudo_pgroup {
+    struct ksudo_pgroup *next;
+    char                *name;
+    int                 nmembers;
+    char                **members;
+} ksudo_pgroup;
+
+/* FNV-1a. Call with h = KSUDO_HASH_INIT to start a new hash. */
+unsigned long
+ksudo_hash (const char *s, unsigned long h)
+{
+    for (; *s; s++) {
+        h ^= (uchar)*s;
+        h *= 16777619UL;
+    }
+    /* hash the terminator too, so ("ab", "c") != ("a", "bc") */
+    return h * 16777619UL;
+}
+
+static unsigned long
+policy_key (const char *princ, const char *user)
+{
+    return ksudo_hash(user, ksudo_hash(princ, KSUDO_HASH_INIT));
+}
+
+/* Could fnmatch(pat, s, 0) match anything but s == pat? */
+static int
+policy_literal (const char *pat)
+{
+    return !strpbrk(pat, "*?[\\");
+}
+
+static void
+ptab_init (ksudo_ptab *t)
+{
+    t->nbuckets = 64;
+    t->n        = 0;
+    NewZ(t->buckets, t->nbuckets);
+}
+
+static ksudo_plit *
+ptab_find (ksudo_ptab *t, const void *owner, unsigned long h,
+    const char *cmd)
+{
+    ksudo_plit  *l;
+
+    for (l = t->buckets[h & (t->nbuckets - 1)]; l; l = l->next)
+        if (l->hash == h && l->owner == owner && !strcmp(l->cmd, cmd))
+            return l;
+    return NULL;
+}
+
+static void
+ptab_grow (ksudo_ptab *t)
+{
+    ksudo_plit      **old   = t->buckets, *l, *next;
+    unsigned long   nold    = t->nbuckets, i;
+
+    t->nbuckets *= 2;
+    NewZ(t->buckets, t->nbuckets);
+
+    for (i = 0; i < nold; i++) {
+        for (l = old[i]; l; l = next) {
+            next = l->next;
+            l->next = t->buckets[l->hash & (t->nbuckets - 1)];
+            t->buckets[l->hash & (t->nbuckets - 1)] = l;
+        }
+    }
+    Free(old);
+}
+
+/* Returns NULL if owner already has cmd, since the first one wins */
+static ksudo_plit *
+ptab_add (ksudo_ptab *t, const void *owner, unsigned long h,
+    const char *cmd)
+{
+    ksudo_plit  *l, **b;
+
+    if (ptab_find(t, owner, h, cmd)) return NULL;
+    if (t->n >= t->nbuckets) ptab_grow(t);
+
+    NewZ(l, 1);
+    l->hash     = h;
+    l->owner    = owner;
+    l->cmd      = strdup(cmd);
+
+    b           = &t->buckets[h & (t->nbuckets - 1)];
+    l->next     = *b;
+    *b          = l;
+    t->n++;
+    return l;
+}
+
+static void
+ptab_free (ksudo_ptab *t)
+{
+    ksudo_plit      *l, *next;
+    unsigned long   i;
+
+    for (i = 0; i < t->nbuckets; i++) {
+        for (l = t->buckets[i]; l; l = next) {
+            next = l->next;
+            Free(l->cmd);
+            Free(l);
+        }
+    }
+    Free(t->buckets);
+}
+
+static ksudo_pent *
+policy_find (ksudo_policy *pol, const char *princ, const char *user)
+{
+    unsigned long   h   = policy_key(princ, user);
+    ksudo_pent      *e;
+
+    for (e = pol->buckets[h & (pol->nbuckets - 1)]; e; e = e->next)
+        if (e->hash == h && !strcmp(e->princ, princ)
+            && !strcmp(e->user, user))
+            return e;
+
+    return NULL;
+}
+
+static void
+policy_grow (ksudo_policy *pol)
+{
+    ksudo_pent      **old   = pol->buckets, *e, *next;
+    unsigned long   nold    = pol->nbuckets, i;
+
+    pol->nbuckets *= 2;
+    NewZ(pol->buckets, pol->nbuckets);
+
+    for (i = 0; i < nold; i++) {
+        for (e = old[i]; e; e = next) {
+            next = e->next;
+            e->next = pol->buckets[e->hash & (pol->nbuckets - 1)];
+            pol->buckets[e->hash & (pol->nbuckets - 1)] = e;
+        }
+    }
+    Free(old);
+}
+
+static void
+policy_add (ksudo_policy *pol, const char *princ, const char *user,
+    const char *pat)
+{
+    ksudo_pent  *e, **b;
+
+    if (!(e = policy_find(pol, princ, user))) {
+        if (pol->nents >= pol->nbuckets)
+            policy_grow(pol);
+
+        NewZ(e, 1);
+        e->hash     = policy_key(princ, user);
+        e->princ    = strdup(princ);
+        e->user     = strdup(user);
+
+        b = &pol->buckets[e->hash & (pol->nbuckets - 1)];
+        e->next     = *b;
+        *b          = e;
+        pol->nents++;
+    }
+
+    /* a bare * makes any other patterns redundant */
+    if (e->npats == 1 && !strcmp(e->pats[0], "*")) return;
+    if (!strcmp(pat, "*")) {
+        while (e->npats) Free(e->pats[--e->npats]);
+    }
+
+    if (policy_literal(pat)) {
+        ptab_add(&pol->lits, e, ksudo_hash(pat, e->hash), pat);
+        return;
+    }
+
+    Renew(e->pats, e->npats + 1);
+    e->pats[e->npats++] = strdup(pat);
+}
+
+static ksudo_pcuser *
+policy_cuser (ksudo_policy *pol, const char *user)
+{
+    unsigned long   h   = ksudo_hash(user, KSUDO_HASH_INIT);
+    ksudo_pcuser    *cu;
+
+    for (cu = pol->cusers; cu; cu = cu->next)
+        if (cu->hash == h && !strcmp(cu->user, user))
+            return cu;
+    return NULL;
+}
+
+static void
+policy_add_cache (ksudo_policy *pol, const char *user, unsigned ttl,
+    const char *pat)
+{
+    ksudo_pcuser    *cu;
+    ksudo_pcache    *c;
+    ksudo_plit      *l;
+    unsigned        seq = pol->ncaches++;
+
+    if (!(cu = policy_cuser(pol, user))) {
+        NewZ(cu, 1);
+        cu->hash    = ksudo_hash(user, KSUDO_HASH_INIT);
+        cu->user    = strdup(user);
+        cu->gtail   = &cu->globs;
+        cu->next    = pol->cusers;
+        pol->cusers = cu;
+    }
+
+    if (policy_literal(pat)) {
+        if ((l = ptab_add(&pol->clits, cu, ksudo_hash(pat, cu->hash),
+                pat))
+        ) {
+            l->ttl  = ttl;
+            l->seq  = seq;
+        }
+        return;
+    }
+
+    NewZ(c, 1);
+    c->ttl      = ttl;
+    c->seq      = seq;
+    c->pat      = strdup(pat);
+    *cu->gtail  = c;
+    cu->gtail   = &c->next;
+}
+
+static ksudo_pgroup *
+policy_group (ksudo_pgroup *groups, const char *name)
+{
+    for (; groups; groups = groups->next)
+        if (!strcmp(groups->name, name))
+            return groups;
+    return NULL;
+}
+
+static void
+policy_free_groups (ksudo_pgroup *g)
+{
+    ksudo_pgroup    *next;
+
+    for (; g; g = next) {
+        next = g->next;
+        while (g->nmembers) Free(g->members[--g->nmembers]);
+        Free(g->members);
+        Free(g->name);
+        Free(g);
+    }
+}
+
+void
+policy_free (ksudo_policy *pol)
+{
+    ksudo_pent      *e, *next;
+    ksudo_pcuser    *cu, *cunext;
+    ksudo_pcache    *c, *cnext;
+    unsigned long   i;
+
+    if (!pol) return;
+
+    for (cu = pol->cusers; cu; cu = cunext) {
+        cunext = cu->next;
+        for (c = cu->globs; c; c = cnext) {
+            cnext = c->next;
+            Free(c->pat);
+            Free(c);
+        }
+        Free(cu->user);
+        Free(cu);
+    }
+    ptab_free(&pol->clits);
+    ptab_free(&pol->lits);
+
+    for (i = 0; i < pol->nbuckets; i++) {
+        for (e = pol->buckets[i]; e; e = next) {
+            next = e->next;
+            while (e->npats) Free(e->pats[--e->npats]);
+            Free(e->pats);
+            Free(e->princ);
+            Free(e->user);
+            Free(e);
+        }
+    }
+    Free(pol->buckets);
+    Free(pol);
+}
+
+/* Returns NULL (having warned) if the file can't be read or parsed, so
+ * a bad edit followed by a reload leaves the old policy in place.
+ */
+ksudo_policy *
+policy_load (const char *path)
+{
+    FILE            *f;
+    ksudo_policy    *pol;
+    ksudo_pgroup    *groups = NULL, *g;
+    char            *line = NULL, *p, *kw, *who, *user;
+    size_t          linesz = 0;
+    unsigned        lineno = 0;
+    int             i, ok = 1;
+
+    if (!(f = fopen(path, "r"))) {
+        warn("can't open policy file %s", path);
+        return NULL;
+    }
+
+    NewZ(pol, 1);
+    pol->nbuckets = 64;
+    NewZ(pol->buckets, pol->nbuckets);
+    ptab_init(&pol->lits);
+    ptab_init(&pol->clits);
+
+    while (getline(&line, &linesz, f) > 0) {
+        lineno++;
+
+        p = line;
+        kw = strsep(&p, POLICY_WS);
+        while (kw && !*kw) kw = strsep(&p, POLICY_WS);
+        if (!kw || *kw == '#') continue;
+
+        if (!strcmp(kw, "group")) {
+            char    *m;
+
+            if (!(who = strsep(&p, POLICY_WS)) || !*who) goto syntax;
+            if (policy_group(groups, who)) {
+                warnx("%s:%u: group %s already defined", path, lineno, who);
+                ok = 0;
+                break;
+            }
+
+            NewZ(g, 1);
+            g->name = strdup(who);
+            g->next = groups;
+            groups  = g;
+
+            while ((m = strsep(&p, POLICY_WS))) {
+                if (!*m) continue;
+                Renew(g->members, g->nmembers + 1);
+                g->members[g->nmembers++] = strdup(m);
+            }
+        }
+        else if (!strcmp(kw, "allow")) {
+            do who = strsep(&p, POLICY_WS); while (who && !*who);
+            do user = strsep(&p, POLICY_WS); while (user && !*user);
+            if (!who || !user || !p) goto syntax;
+
+            p += strspn(p, POLICY_WS);
+            p[strcspn(p, "\n")] = '\0';
+            if (!*p) goto syntax;
+
+            if (*who == '%') {
+                if (!(g = policy_group(groups, who + 1))) {
+                    warnx("%s:%u: unknown group %s", path, lineno, who + 1);
+                    ok = 0;
+                    break;
+                }
+                for (i = 0; i < g->nmembers; i++)
+                    policy_add(pol, g->members[i], user, p);
+            }
+            else
+                policy_add(pol, who, user, p);
+        }
+        else if (!strcmp(kw, "cache")) {
+            char            *ttl, *end;
+            long            n;
+
+            do ttl = strsep(&p, POLICY_WS); while (ttl && !*ttl);
+            do user = strsep(&p, POLICY_WS); while (user && !*user);
+            if (!ttl || !user || !p) goto syntax;
+
+            n = strtol(ttl, &end, 10);
+            if (end == ttl || *end || n < 1 || n > KSUDO_RCACHE_MAXTTL)
+                goto syntax;
+
+            p += strspn(p, POLICY_WS);
+            p[strcspn(p, "\n")] = '\0';
+            if (!*p) goto syntax;
+
+            policy_add_cache(pol, user, n, p);
+        }
+        else
+            goto syntax;
+
+        continue;
+
+      syntax:
+        warnx("%s:%u: syntax error", path, lineno);
+        ok = 0;
+        break;
+    }
+
+    if (ferror(f)) {
+        warn("can't read policy file %s", path);
+        ok = 0;
+    }
+
+    fclose(f);
+    Free(line);
+    policy_free_groups(groups);
+
+    if (!ok) {
+        policy_free(pol);
+        return NULL;
+    }
+
+    debug("policy_load: [%s] [%lu] entries [%lu] literals [%u] caches",
+        path, pol->nents, pol->lits.n, pol->ncaches);
+    return pol;
+}
+
+static int
+policy_match (ksudo_policy *pol, ksudo_pent *e, const char *cmdline)
+{
+    int     i;
+
+    if (!e) return 0;
+
+    if (ptab_find(&pol->lits, e, ksudo_hash(cmdline, e->hash), cmdline))
+        return 1;
+    for (i = 0; i < e->npats; i++)
+        if (!fnmatch(e->pats[i], cmdline, 0))
+            return 1;
+
+    return 0;
+}
+
+/* Make C strings of cmd's user, and of its command line with the
+ * arguments joined by single spaces. Both must be freed. Returns 0,
+ * having made neither, if any of them contains a NUL: the C string
+ * would stop there, but exec would still get the rest.
+ */
+static int
+policy_cmdline (KSUDO_CMD *cmd, char **user, char **cmdline)
+{
+    char        *p;
+    size_t      len = 0;
+    int         i;
+
+    if (memchr(cmd->user.data, '\0', cmd->user.length))
+        return 0;
+    for (i = 0; i < cmd->cmd.len; i++)
+        if (memchr(cmd->cmd.val[i].data, '\0', cmd->cmd.val[i].length))
+            return 0;
+
+    NewZ(*user, cmd->user.length + 1);
+    Copy((char *)cmd->user.data, *user, cmd->user.length);
+
+    for (i = 0; i < cmd->cmd.len; i++)
+        len += cmd->cmd.val[i].length + 1;
+    NewZ(*cmdline, len + 1);
+
+    for (i = 0, p = *cmdline; i < cmd->cmd.len; i++) {
+        if (i) *p++ = ' ';
+        Copy((char *)cmd->cmd.val[i].data, p, cmd->cmd.val[i].length);
+        p += cmd->cmd.val[i].length;
+    }
+    return 1;
+}
+
+/* Returns true if princ may run cmd as cmd->user */
+int
+policy_check (ksudo_policy *pol, const char *princ, KSUDO_CMD *cmd)
+{
+    char        *user, *cmdline;
+    int         ok;
+
+    if (!pol) return 0;
+
+    if (!policy_cmdline(cmd, &user, &cmdline)) {
+        debug("policy_check [%s]: NUL in command", princ);
+        return 0;
+    }
+
+    ok = policy_match(pol, policy_find(pol, princ, user), cmdline)
+        || policy_match(pol, policy_find(pol, princ, "*"), cmdline)
+        || policy_match(pol, policy_find(pol, "*", user), cmdline)
+        || policy_match(pol, policy_find(pol, "*", "*"), cmdline);
+
+    debug("policy_check [%s] [%s] [%s] -> [%d]",
+        princ, user, cmdline, ok);
+
+    Free(user);
+    Free(cmdline);
+    return ok;
+}
+
+/* Find the first of cu's cache lines to match cmdline, if it comes
+ * before *seq */
+static void
+policy_cache_match (ksudo_policy *pol, ksudo_pcuser *cu,
+    const char *cmdline, unsigned *seq, unsigned *ttl)
+{
+    ksudo_plit      *l;
+    ksudo_pcache    *c;
+
+    if (!cu) return;
+
+    l = ptab_find(&pol->clits, cu, ksudo_hash(cmdline, cu->hash), cmdline);
+    if (l && l->seq < *seq) {
+        *seq    = l->seq;
+        *ttl    = l->ttl;
+    }
+
+    for (c = cu->globs; c && c->seq < *seq; c = c->next) {
+        if (!fnmatch(c->pat, cmdline, 0)) {
+            *seq    = c->seq;
+            *ttl    = c->ttl;
+            break;
+        }
+    }
+}
+
+/* Returns how many seconds cmd's result may be reused for, or 0 */
+unsigned
+policy_cache_ttl (ksudo_policy *pol, KSUDO_CMD *cmd)
+{
+    char            *user, *cmdline;
+    unsigned        ttl = 0, seq = UINT_MAX;
+
+    if (!pol || !pol->ncaches) return 0;
+    if (!policy_cmdline(cmd, &user, &cmdline)) return 0;
+
+    policy_cache_match(pol, policy_cuser(pol, user), cmdline, &seq, &ttl);
+    policy_cache_match(pol, policy_cuser(pol, "*"), cmdline, &seq, &ttl);
+
+    debug("policy_cache_ttl [%s] [%s] -> [%u]", user, cmdline, ttl);
+
+    Free(user);
+    Free(cmdline);
+    return ttl;
+}
@@ -0,0 +1,169 @@
+/*
+ * This file is part of ksudo, a system for limited remote command
+ * execution based on Kerberos principals.
+ *
+ * Copyright 2012 Ben Morrow <ben@morrow.me.uk>.
+ * Released under the 2-clause BSD licence.
+ *
+ * pwcache.c: a cache of passwd and group data for target users.
+ *
+ * With NSS going over the network a getpwnam plus getgrouplist can
+ * take long enough to matter, and we'd otherwise pay it for every
+ * command. Entries are kept for KSUDO_PWCACHE_TTL seconds; users who
+ * don't exist are remembered for KSUDO_PWCACHE_NEGTTL. A lookup which
+ * fails, rather than finding no user, isn't remembered at all.
+ */
+
+#include <sys/types.h>
+
+#include <grp.h>
+#include <pwd.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ksudo.h"
+
+#define PWCACHE_BUCKETS 256
+
+static ksudo_pwent  *pwcache[PWCACHE_BUCKETS];
+static int          npwcache    = 0;
+
+static void
+pwent_free (ksudo_pwent *pw)
+{
+    Free(pw->name);
+    Free(pw->dir);
+    Free(pw->shell);
+    Free(pw->groups);
+    Free(pw);
+}
+
+void
+pwcache_flush ()
+{
+    ksudo_pwent *pw, *next;
+    int         i;
+
+    for (i = 0; i < PWCACHE_BUCKETS; i++) {
+        for (pw = pwcache[i]; pw; pw = next) {
+            next = pw->next;
+            pwent_free(pw);
+        }
+        pwcache[i] = NULL;
+    }
+    npwcache = 0;
+}
+
+/* Throw away expired entries. If that doesn't make enough room, throw
+ * away everything.
+ */
+static void
+pwcache_prune (time_t now)
+{
+    ksudo_pwent **pp, *pw;
+    int         i;
+
+    for (i = 0; i < PWCACHE_BUCKETS; i++) {
+        for (pp = &pwcache[i]; (pw = *pp); ) {
+            if (pw->expires > now) {
+                pp = &pw->next;
+                continue;
+            }
+            *pp = pw->next;
+            pwent_free(pw);
+            npwcache--;
+        }
+    }
+
+    if (npwcache >= KSUDO_PWCACHE_MAX)
+        pwcache_flush();
+}
+
+/* Returns NULL, with errno set, if the lookup itself failed. */
+static ksudo_pwent *
+pwcache_lookup (const char *user, unsigned long hash, time_t now)
+{
+    ksudo_pwent     *pw;
+    struct passwd   *p;
+    int             ngroups, rv;
+
+    errno = 0;
+    p = getpwnam(user);
+    if (!p && errno) {
+        warn("getpwnam(%s)", user);
+        return NULL;
+    }
+
+    NewZ(pw, 1);
+    pw->hash    = hash;
+    pw->name    = strdup(user);
+
+    if (!p) {
+        debug("pwcache_lookup: no user [%s]", user);
+        pw->expires = now + KSUDO_PWCACHE_NEGTTL;
+        return pw;
+    }
+
+    pw->found   = 1;
+    pw->uid     = p->pw_uid;
+    pw->gid     = p->pw_gid;
+    pw->dir     = strdup(p->pw_dir);
+    pw->shell   = strdup(p->pw_shell);
+
+    /* p points into static storage which getgrouplist may reuse */
+    for (ngroups = 64; ; ngroups *= 2) {
+        Renew(pw->groups, ngroups);
+        pw->ngroups = ngroups;
+        rv = getgrouplist(user, pw->gid, pw->groups, &pw->ngroups);
+        if (rv != -1) break;
+        if (ngroups >= 65536)
+            errx(EX_OSERR, "user %s is in too many groups", user);
+    }
+
+    debug("pwcache_lookup: [%s] uid [%ld] gid [%ld] ngroups [%d]",
+        user, (long)pw->uid, (long)pw->gid, pw->ngroups);
+    pw->expires = now + KSUDO_PWCACHE_TTL;
+    return pw;
+}
+
+/* Returns NULL if the user doesn't exist, with errno 0, or if we
+ * couldn't find out, with errno set. The entry is only valid until the
+ * next call.
+ */
+ksudo_pwent *
+pwcache_get (const char *user)
+{
+    unsigned long   h   = ksudo_hash(user, KSUDO_HASH_INIT);
+    ksudo_pwent     **pp, *pw;
+    time_t          now = time(NULL);
+
+    pp = &pwcache[h % PWCACHE_BUCKETS];
+    for (; (pw = *pp); pp = &pw->next) {
+        if (pw->hash != h || strcmp(pw->name, user)) continue;
+
+        if (pw->expires > now) {
+            debug("pwcache_get: hit for [%s]", user);
+            errno = 0;
+            return pw->found ? pw : NULL;
+        }
+
+        *pp = pw->next;
+        pwent_free(pw);
+        npwcache--;
+        break;
+    }
+
+    if (npwcache >= KSUDO_PWCACHE_MAX)
+        pwcache_prune(now);
+
+    if (!(pw = pwcache_lookup(user, h, now)))
+        return NULL;
+    pp = &pwcache[h % PWCACHE_BUCKETS];
+    pw->next    = *pp;
+    *pp         = pw;
+    npwcache++;
+
+    errno = 0;
+    return pw->found ? pw : NULL;
+}
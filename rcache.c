@@ -0,0 +1,387 @@
+/*
+ * This file is part of ksudo, a system for limited remote command
+ * execution based on Kerberos principals.
+ *
+ * Copyright 2012 Ben Morrow <ben@morrow.me.uk>.
+ * Released under the 2-clause BSD licence.
+ *
+ * rcache.c: reusing the results of commands the policy says may be.
+ *
+ * Results are keyed on the DER of the KSUDO-CMD, which covers the
+ * user, the arguments and the env opts but not the input, so a command
+ * given a remote fd to read is never cached; ksudo -r 0:/dev/null
+ * makes one which doesn't need stdin cacheable. The first session to
+ * ask for one runs the command as usual while we keep a copy of what
+ * it sends; anyone asking for the same thing meanwhile waits for that
+ * instead of running it again. If the command exits normally, having
+ * written no more than KSUDO_RCACHE_OUT bytes to fd 1 and nothing
+ * anywhere else, the output and status are kept for the policy's ttl
+ * and handed out without a fork. Otherwise the waiting sessions run
+ * their own.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <paths.h>
+#include <string.h>
+
+#include "ksudo.h"
+
+struct ksudo_rcache_ent {
+    ksudo_rcache_ent    *next;
+    unsigned long       hash;
+    krb5_data           key;
+    unsigned            ttl;
+    /* timer_now() when the result goes stale */
+    unsigned long       expires;
+
+    /* the session running the command, or NULL once there's a result */
+    ksudo_rcache_wait   *filler;
+    ksudo_rcache_wait   *waiters;
+    /* to start a new filler from ioloop */
+    ksudo_timer         wake;
+
+    /* the output can't be reproduced, so there will be no result */
+    unsigned            spoilt  : 1;
+    int                 status;
+    /* the remote fds the command writes to, as a bitmask */
+    unsigned            fds;
+    size_t              len;
+    uchar               *out;
+};
+
+ksudo_rcacheops         rcacheops;
+
+static ksudo_rcache_ent *ents[KSUDO_RCACHE_HASH];
+static int              nents   = 0;
+
+/* DER-encode cmd into key, and find which fds it writes to. Returns 0
+ * if cmd's result can't be replayed: local files and ttys have effects
+ * we can't see, and neither the key nor the result covers what the
+ * client sends on a stream the command reads.
+ */
+static int
+rcache_key (KSUDO_CMD *cmd, krb5_data *key, unsigned *fds)
+{
+    dKRBCHK;
+    KSUDO_ENV_OPT   *opt;
+    size_t          len, outlen;
+    int             i;
+
+    *fds = 0;
+    for (i = 0; i < cmd->env.len; i++) {
+        opt = &cmd->env.val[i];
+        switch (opt->element) {
+            case choice_KSUDO_ENV_OPT_cwd:
+            case choice_KSUDO_ENV_OPT_dup:
+                break;
+            case choice_KSUDO_ENV_OPT_rfd:
+                if (opt->u.rfd.fd < 0 || opt->u.rfd.fd >= KSUDO_NFDS)
+                    return 0;
+                if (opt->u.rfd.mode != KSUDO_FD_WRITE)
+                    return 0;
+                *fds |= 1U << opt->u.rfd.fd;
+                break;
+            case choice_KSUDO_ENV_OPT_lfd:
+                /* the one local file we know always reads the same */
+                if (opt->u.lfd.mode != KSUDO_FD_READ
+                    || opt->u.lfd.path.length != sizeof(_PATH_DEVNULL) - 1
+                    || memcmp(opt->u.lfd.path.data, _PATH_DEVNULL,
+                        opt->u.lfd.path.length)
+                )
+                    return 0;
+                break;
+            default:
+                return 0;
+        }
+    }
+
+    len = length_KSUDO_CMD(cmd);
+    KRBCHK(krb5_data_alloc(key, len), "can't allocate cache key");
+    KRBCHK(encode_KSUDO_CMD((uchar *)key->data + len - 1, len, cmd,
+            &outlen),
+        "can't DER-encode KSUDO-CMD");
+    if (outlen != len)
+        Panic("DER-encoding came out the wrong length");
+
+    return 1;
+}
+
+/* FNV-1a, as ksudo_hash, over the key's bytes */
+static unsigned long
+rcache_hash (const krb5_data *key)
+{
+    const uchar     *p  = key->data;
+    unsigned long   h   = KSUDO_HASH_INIT;
+    size_t          i;
+
+    for (i = 0; i < key->length; i++) {
+        h ^= p[i];
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+static int
+rcache_stale (ksudo_rcache_ent *e)
+{
+    return !e->filler && (long)(timer_now() - e->expires) >= 0;
+}
+
+static void
+rcache_free (ksudo_rcache_ent *e)
+{
+    Assert(!e->filler && !e->waiters);
+
+    mem_bytes -= sizeof(*e) + e->key.length + e->len;
+    timer_cancel(&e->wake);
+    krb5_data_free(&e->key);
+    Free(e->out);
+    Free(e);
+    nents--;
+}
+
+static void
+rcache_unlink (ksudo_rcache_ent *e)
+{
+    ksudo_rcache_ent    **ep;
+
+    for (ep = &ents[e->hash % KSUDO_RCACHE_HASH]; *ep != e;
+            ep = &(*ep)->next)
+        Assert(*ep);
+    *ep = e->next;
+}
+
+/* Find key's entry, throwing away stale ones on the way */
+static ksudo_rcache_ent *
+rcache_find (const krb5_data *key, unsigned long h)
+{
+    ksudo_rcache_ent    **ep, *e;
+
+    ep = &ents[h % KSUDO_RCACHE_HASH];
+    while ((e = *ep)) {
+        if (rcache_stale(e)) {
+            *ep = e->next;
+            rcache_free(e);
+            continue;
+        }
+        if (e->hash == h && e->key.length == key->length
+            && !memcmp(e->key.data, key->data, key->length))
+            return e;
+        ep = &e->next;
+    }
+    return NULL;
+}
+
+/* Throw away every stale entry, when we're full */
+static void
+rcache_purge ()
+{
+    ksudo_rcache_ent    **ep, *e;
+    int                 i;
+
+    for (i = 0; i < KSUDO_RCACHE_HASH; i++) {
+        ep = &ents[i];
+        while ((e = *ep)) {
+            if (rcache_stale(e)) {
+                *ep = e->next;
+                rcache_free(e);
+            }
+            else
+                ep = &e->next;
+        }
+    }
+}
+
+static void
+rcache_wait_push (ksudo_rcache_ent *e, ksudo_rcache_wait *w)
+{
+    ksudo_rcache_wait   **wp;
+
+    /* first come, first promoted */
+    for (wp = &e->waiters; *wp; wp = &(*wp)->next) ;
+    w->next     = NULL;
+    w->prevp    = wp;
+    *wp         = w;
+    w->ent      = e;
+}
+
+static void
+rcache_wait_pop (ksudo_rcache_wait *w)
+{
+    *w->prevp = w->next;
+    if (w->next) w->next->prevp = w->prevp;
+    w->next     = NULL;
+    w->prevp    = NULL;
+    w->ent      = NULL;
+}
+
+/* A command has arrived for sess which may be answered from the cache
+ * for ttl seconds. Returns 0 if the caller must run it, in which case
+ * w->filling says whether its output should go to rcache_tap and its
+ * status to rcache_done; 1 if rcacheops.hit has answered it already;
+ * or 2 if it is waiting for another session's command, and one of
+ * rcacheops will be called for it later.
+ */
+int
+rcache_submit (ksudo_rcache_wait *w, KSUDO_CMD *cmd, unsigned ttl,
+    int sess)
+{
+    ksudo_rcache_ent    *e, **b;
+    krb5_data           key;
+    unsigned long       h;
+    unsigned            fds;
+
+    w->ent      = NULL;
+    w->sess     = sess;
+    w->filling  = 0;
+
+    if (!rcache_key(cmd, &key, &fds)) return 0;
+    h = rcache_hash(&key);
+
+    if ((e = rcache_find(&key, h))) {
+        krb5_data_free(&key);
+
+        if (e->filler) {
+            debug("rcache_submit: [%d] waiting on [%d]",
+                sess, e->filler->sess);
+            rcache_wait_push(e, w);
+            return 2;
+        }
+
+        debug("rcache_submit: [%d] answered from cache", sess);
+        rcacheops.hit(sess, e->status, e->fds, e->out, e->len);
+        return 1;
+    }
+
+    if (nents >= KSUDO_RCACHE_NENT) rcache_purge();
+    if (nents >= KSUDO_RCACHE_NENT) {
+        debug("rcache_submit: cache full");
+        krb5_data_free(&key);
+        return 0;
+    }
+
+    NewZ(e, 1);
+    e->key      = key;
+    e->hash     = h;
+    e->ttl      = ttl;
+    e->fds      = fds;
+    e->filler   = w;
+    b           = &ents[h % KSUDO_RCACHE_HASH];
+    e->next     = *b;
+    *b          = e;
+    nents++;
+    mem_bytes  += sizeof(*e) + key.length;
+
+    w->ent      = e;
+    w->filling  = 1;
+    debug("rcache_submit: [%d] filling for [%u]s", sess, ttl);
+    return 0;
+}
+
+/* The filling command has sent len bytes on fd */
+void
+rcache_tap (ksudo_rcache_wait *w, int fd, const uchar *p, size_t len)
+{
+    ksudo_rcache_ent    *e  = w->ent;
+
+    if (!w->filling || e->spoilt) return;
+
+    if (fd != 1 || e->len + len > KSUDO_RCACHE_OUT) {
+        debug("rcache_tap: [%d] spoilt by [%lu] bytes on fd [%d]",
+            w->sess, (unsigned long)len, fd);
+        e->spoilt = 1;
+        return;
+    }
+
+    Renew(e->out, e->len + len);
+    Copy(p, e->out + e->len, len);
+    e->len     += len;
+    mem_bytes  += len;
+}
+
+/* The filling command has exited. Everyone waiting gets the result, or
+ * is told to go and run their own.
+ */
+void
+rcache_done (ksudo_rcache_wait *w, int status)
+{
+    ksudo_rcache_ent    *e  = w->ent;
+    ksudo_rcache_wait   *x;
+
+    if (!w->filling) return;
+
+    w->ent      = NULL;
+    w->filling  = 0;
+    e->filler   = NULL;
+
+    if (e->spoilt || !WIFEXITED(status)) {
+        debug("rcache_done: [%d] no result", w->sess);
+        rcache_unlink(e);
+        while ((x = e->waiters)) {
+            rcache_wait_pop(x);
+            rcacheops.miss(x->sess);
+        }
+        rcache_free(e);
+        return;
+    }
+
+    e->status   = status;
+    e->expires  = timer_now()
+        + (e->ttl * 1000UL + KSUDO_TICK_MS - 1) / KSUDO_TICK_MS;
+    debug("rcache_done: [%d] keeping [%lu] bytes for [%u]s",
+        w->sess, (unsigned long)e->len, e->ttl);
+
+    while ((x = e->waiters)) {
+        rcache_wait_pop(x);
+        rcacheops.hit(x->sess, e->status, e->fds, e->out, e->len);
+    }
+}
+
+static void
+rcache_wake (int sess)
+{
+    rcacheops.miss(sess);
+}
+
+/* The session has gone. If it was filling, the first in line takes
+ * over, from ioloop since we're in the middle of a kss_close.
+ */
+void
+rcache_cancel (ksudo_rcache_wait *w)
+{
+    ksudo_rcache_ent    *e  = w->ent;
+    ksudo_rcache_wait   *x;
+
+    if (!e) return;
+
+    if (!w->filling) {
+        rcache_wait_pop(w);
+        return;
+    }
+
+    w->ent      = NULL;
+    w->filling  = 0;
+    timer_cancel(&e->wake);
+
+    if (!(x = e->waiters)) {
+        e->filler = NULL;
+        rcache_unlink(e);
+        rcache_free(e);
+        return;
+    }
+
+    rcache_wait_pop(x);
+    x->ent      = e;
+    x->filling  = 1;
+    e->filler   = x;
+    e->spoilt   = 0;
+    mem_bytes  -= e->len;
+    e->len      = 0;
+    Free(e->out);
+    e->out      = NULL;
+
+    debug("rcache_cancel: [%d] takes over from [%d]", x->sess, w->sess);
+    timer_arm(&e->wake, 0, rcache_wake, x->sess);
+}
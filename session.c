@@ -10,8 +10,41 @@
 
 #include <sys/wait.h>
 
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+
 #include "ksudo.h"
 
+/* Find a free slot in sessions[], growing it if necessary */
+int
+kss_new ()
+{
+    int     i, j;
+
+    for (i = 0; i < nsessions; i++)
+        if (!KssOK(i))
+            return i;
+
+    if (sessions) {
+        nsessions *= 2;
+        Renew(sessions, nsessions);
+    }
+    else {
+        nsessions = 8; 
+        New(sessions, 8);
+    }
+
+    for (j = i; j < nsessions; j++) {
+        /* don't use NULL, since that might not be a function
+         * pointer type */
+        sessions[j].state = KSSs_NONE;
+        sessions[j].gen   = 0;
+    }
+
+    return i;
+}
+
 void
 kss_init (int sess, int fd, ksudo_sop start, void *data)
 {
@@ -19,16 +52,32 @@ kss_init (int sess, int fd, ksudo_sop start, void *data)
     ksudo_fddata_msg    *mdata;
     int                 ksf;
    
-    NewZ(mdata, 1);
+    ArNewZ(KssARENA(sess), mdata, 1);
     mdata->session = sess;
-    BufINIT(&mdata->rbuf);
+    mdata->rbuf = NULL;
+    MbfINIT(&mdata->wbuf);
+    SchedINIT(&mdata->sched);
    
     ksf = ksf_open(fd, KSUDO_FD_RDWR, KSFt(msg), mdata);
+    KsfL(ksf).arena = 1;
     KssMSGFDs(sess, ksf);
     KssNEXT(sess, start);
     KssL(sess).datafds  = NULL;
+    KssL(sess).nout     = 0;
+    KssL(sess).exited   = 0;
+    KssL(sess).closing  = 0;
+    KssL(sess).held     = 0;
+    KssL(sess).badmsg   = 0;
+    KssL(sess).gen++;
+    KssL(sess).endop    = NULL;
+    KssL(sess).tapop    = NULL;
+    KssL(sess).exitop   = NULL;
+    KssL(sess).timer    = NULL;
+    KssL(sess).lastio   = timer_now();
+    KssL(sess).rusage   = NULL;
     KssL(sess).data     = data;
-    Zero(KssL(sess).msgop, KSUDO_MSG_num);
+    KssL(sess).msgops   = NULL;
+    KssL(sess).dataops  = 0;
 
     KRBCHK(krb5_auth_con_init(k5ctx, &KssK5A(sess)),
         "can't allocate auth context");
@@ -37,19 +86,101 @@ kss_init (int sess, int fd, ksudo_sop start, void *data)
         sess, mdata, ksf);
 }
 
+void
+kss_err (int sess, KSUDO_ERR_CODE code, const char *fmt, ...)
+{
+    KSUDO_MSG   msg;
+    KSUDO_ERR   *e;
+    va_list     ap;
+    char        *str;
+
+    va_start(ap, fmt);
+    if (vasprintf(&str, fmt, ap) < 0)
+        err(EX_UNAVAILABLE, "can't format error message");
+    va_end(ap);
+
+    debug("kss_err [%d] [%d] [%s]", sess, code, str);
+
+    AsnChoice(&msg, MSG, e, err);
+    e->code         = code;
+    e->msg.length   = strlen(str);
+    e->msg.data     = str;
+
+    write_msg(sess, &msg);
+    free(str);
+
+    /* an error always ends the session */
+    KssL(sess).closing = 1;
+}
+
+/* Turn the session away because we're overloaded. The client can try
+ * again in retry seconds.
+ */
+void
+kss_busy (int sess, unsigned retry)
+{
+    KSUDO_MSG       msg;
+    KSUDO_ERR       *e;
+    ksudo_uint32    r   = retry;
+
+    debug("kss_busy [%d] retry [%u]", sess, retry);
+
+    AsnChoice(&msg, MSG, e, err);
+    e->code         = KSUDO_EBUSY;
+    e->msg.data     = "server busy";
+    e->msg.length   = strlen(e->msg.data);
+    e->retry        = &r;
+
+    write_msg(sess, &msg);
+    KssL(sess).closing = 1;
+}
+
+/* The child has exited. The EXIT must not overtake any output still
+ * in the pipes, so just remember the status until the last output
+ * stream has been closed.
+ */
+void
+kss_reap (int sess, int status, const KSUDO_RUSAGE *ru)
+{
+    KssL(sess).exited   = 1;
+    KssL(sess).status   = status;
+    if (ru) {
+        if (!KssL(sess).rusage)
+            ArNewZ(KssARENA(sess), KssL(sess).rusage, 1);
+        *KssL(sess).rusage = *ru;
+    }
+    kss_check_exit(sess);
+}
+
+void
+kss_check_exit (int sess)
+{
+    if (!KssL(sess).exited || KssL(sess).nout) return;
+
+    KssL(sess).exited = 0;
+    kss_exit(sess, KssL(sess).status);
+}
+
 void
 kss_exit (int sess, int status)
 {
     KSUDO_MSG       msg;
     KSUDO_EXIT      *exit;
     KSUDO_SIGNAL    *sig;
+    ksudo_exitop    op      = KssL(sess).exitop;
+
+    if (op) {
+        KssL(sess).exitop = NULL;
+        op(sess, status);
+    }
     
     AsnChoice(&msg, MSG, exit, exit);
+    exit->rusage = KssL(sess).rusage;
 
     if (WIFEXITED(status)) {
         int *stat;
 
-        AsnChoice(exit, EXIT, stat, status);
+        AsnChoice(&exit->how, EXIT_HOW, stat, status);
         *stat = WEXITSTATUS(status);
         debug("successful exit for [%d] [%d]", sess, *stat);
     }
@@ -57,7 +188,7 @@ kss_exit (int sess, int status)
         KSUDO_SIGNAL    *sig;
 
         debug("looking for signal [%d]", WTERMSIG(status));
-        AsnChoice(exit, EXIT, sig, signal);
+        AsnChoice(&exit->how, EXIT_HOW, sig, signal);
         for (*sig = KSUDO_SIGNAL_num - 1; *sig > 0; (*sig)--) {
             debug("  checking [%d] => [%d] [%s]",
                 *sig, ksudo_sigmap[*sig].ksig_sig,
@@ -71,20 +202,176 @@ kss_exit (int sess, int status)
     else {
         void *v;
 
-        AsnChoice(exit, EXIT, v, unknown);
+        AsnChoice(&exit->how, EXIT_HOW, v, unknown);
         debug("unknown exit for [%d]");
     }
 
     write_msg(sess, &msg);
+    KssL(sess).closing = 1;
+
+    /* nobody is going to read the child's input now */
+    kss_data_closeall(sess);
+}
+
+/* Tear the session down completely. Everything allocated from the
+ * session's arena goes at once; anything allocated by krb5 is freed
+ * here or by the endop.
+ */
+void
+kss_close (int sess)
+{
+    debug("kss_close [%d]", sess);
+    Assert(KssOK(sess));
+
+    if (KssL(sess).endop) KssL(sess).endop(sess);
+    if (KssL(sess).timer) {
+        timer_cancel(KssL(sess).timer);
+        KssL(sess).timer = NULL;
+    }
+
+    kss_data_closeall(sess);
+    if (KssMSGFD(sess) >= 0)
+        ksf_close(KssMSGFD(sess));
+    KssMSGFDs(sess, -1);
+
+    if (KssK5A(sess)) {
+        krb5_auth_con_free(k5ctx, KssK5A(sess));
+        KssK5A(sess) = NULL;
+    }
+
+    ar_free(KssARENA(sess));
+    KssL(sess).data     = NULL;
+    KssL(sess).datafds  = NULL;
+    KssNEXT(sess, KSSs_NONE);
 }
 
 KSUDO_SOP(sop_dispatch_msg)
 {
     KSUDO_MSG       msg;
+    krb5_data       der;
     unsigned int    type;
+    int             rv;
 
-    read_msg(sess, pkt, &msg);
+    /* DATA, the bulk of what we see, is handled straight out of the
+     * decrypted packet */
+    if ((rv = read_msg_inplace(sess, pkt, &msg, &der)) < 0) return;
+    if (rv) {
+        KssCALLOP(sess, msg);
+        krb5_data_free(&der);
+        return;
+    }
 
     KssCALLOP(sess, msg);
     free_KSUDO_MSG(&msg);
 }
+
+static void
+kss_save_key (krb5_keyblock *kb, KSUDO_SAVED_KEY *sk)
+{
+    dKRBCHK;
+
+    sk->keytype = kb->keytype;
+    KRBCHK(krb5_data_copy(&sk->keyvalue, kb->keyvalue.data,
+            kb->keyvalue.length),
+        "can't copy key");
+    krb5_free_keyblock(k5ctx, kb);
+}
+
+static void
+kss_restore_key (const KSUDO_SAVED_KEY *sk, krb5_keyblock *kb)
+{
+    kb->keytype     = sk->keytype;
+    kb->keyvalue    = sk->keyvalue;
+}
+
+/* Save the session for an upgrade: the auth context, the msg fd and
+ * the data streams. The caller saves whatever belongs to the server.
+ */
+void
+kss_save (int sess, KSUDO_SAVED_SESSION *ss)
+{
+    dKRBCHK;
+    krb5_auth_context   ac  = KssK5A(sess);
+    krb5_keyblock       *kb;
+    int32_t             seq;
+
+    ss->closing = KssL(sess).closing;
+    ss->exited  = KssL(sess).exited;
+    ss->status  = KssL(sess).status;
+    if (KssL(sess).rusage) {
+        New(ss->rusage, 1);
+        *ss->rusage = *KssL(sess).rusage;
+    }
+
+    KRBCHK(krb5_auth_con_getflags(k5ctx, ac, &ss->flags),
+        "can't get auth context flags");
+    KRBCHK(krb5_auth_con_getlocalseqnumber(k5ctx, ac, &seq),
+        "can't get local sequence number");
+    ss->lseq = seq;
+    KRBCHK(krb5_auth_con_getremoteseqnumber(k5ctx, ac, &seq),
+        "can't get remote sequence number");
+    ss->rseq = seq;
+
+    KRBCHK(krb5_auth_con_getkey(k5ctx, ac, &kb),
+        "can't get session key");
+    if (kb) kss_save_key(kb, &ss->key);
+
+    KRBCHK(krb5_auth_con_getlocalsubkey(k5ctx, ac, &kb),
+        "can't get local subkey");
+    if (kb) {
+        NewZ(ss->lsubkey, 1);
+        kss_save_key(kb, ss->lsubkey);
+    }
+    KRBCHK(krb5_auth_con_getremotesubkey(k5ctx, ac, &kb),
+        "can't get remote subkey");
+    if (kb) {
+        NewZ(ss->rsubkey, 1);
+        kss_save_key(kb, ss->rsubkey);
+    }
+
+    kss_msg_save(sess, ss);
+    kss_data_save(sess, ss);
+}
+
+/* The reverse of kss_save, for a session just created with KssINIT */
+void
+kss_restore (int sess, const KSUDO_SAVED_SESSION *ss)
+{
+    dKRBCHK;
+    krb5_auth_context   ac  = KssK5A(sess);
+    krb5_keyblock       kb;
+
+    KssL(sess).closing  = ss->closing;
+    KssL(sess).exited   = ss->exited;
+    KssL(sess).status   = ss->status;
+    if (ss->rusage) {
+        ArNewZ(KssARENA(sess), KssL(sess).rusage, 1);
+        *KssL(sess).rusage = *ss->rusage;
+    }
+
+    KRBCHK(krb5_auth_con_setflags(k5ctx, ac, ss->flags),
+        "can't set auth context flags");
+    KRBCHK(krb5_auth_con_setlocalseqnumber(k5ctx, ac, ss->lseq),
+        "can't set local sequence number");
+    KRBCHK(krb5_auth_con_setremoteseqnumber(k5ctx, ac, ss->rseq),
+        "can't set remote sequence number");
+
+    if (ss->key.keyvalue.length) {
+        kss_restore_key(&ss->key, &kb);
+        KRBCHK(krb5_auth_con_setkey(k5ctx, ac, &kb),
+            "can't set session key");
+    }
+    if (ss->lsubkey) {
+        kss_restore_key(ss->lsubkey, &kb);
+        KRBCHK(krb5_auth_con_setlocalsubkey(k5ctx, ac, &kb),
+            "can't set local subkey");
+    }
+    if (ss->rsubkey) {
+        kss_restore_key(ss->rsubkey, &kb);
+        KRBCHK(krb5_auth_con_setremotesubkey(k5ctx, ac, &kb),
+            "can't set remote subkey");
+    }
+
+    kss_msg_restore(sess, ss);
+    kss_data_restore(sess, ss);
+}
@@ -77,6 +77,28 @@ setup_signals ()
     }
 }
 
+/* Runs in a child about to exec. Put back everything we've changed,
+ * since ignored signals and the mask survive exec: a command with
+ * SIGPIPE ignored spins on EPIPE instead of dying.
+ */
+void
+reset_signals ()
+{
+    dRV;
+    int         i;
+    sigset_t    none;
+
+    SYSCHK(signal(SIGPIPE, SIG_DFL) == SIG_ERR ? -1 : 0,
+        "can't reset SIGPIPE");
+    for (i = 0; i < nsigs; i++)
+        SYSCHK(signal(sigwant[i], SIG_DFL) == SIG_ERR ? -1 : 0,
+            "can't reset signal handler");
+
+    sigemptyset(&none);
+    SYSCHK(sigprocmask(SIG_SETMASK, &none, NULL),
+        "can't clear signal mask");
+}
+
 void
 handle_signals ()
 {
@@ -86,7 +108,9 @@ handle_signals ()
     sigcaughtany = 0;
 
     for (i = 0; i < nsigs; i++) {
-        if (sigcaught[i])
+        if (sigcaught[i]) {
+            sigcaught[i] = 0;
             (sigops[i])();
+        }
     }
 }
@@ -9,20 +9,171 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <ifaddrs.h>
 
 #include <err.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
+#include <stdlib.h>
 #include <sysexits.h>
+#include <unistd.h>
 
 #include "ksudo.h"
 
+ksudo_sockopts  sockopts    = { .nodelay = 1 };
+/* the Unix-domain socket, or "" for none */
+const char      *sockpath   = KSUDO_SOCKET;
+
+/* With Fast Open the client's connect is put off until it has the
+ * AP-REQ to send with the SYN. This is where the address waits, with
+ * the host it came from in case it doesn't answer.
+ */
+static int                      tfo_sock    = -1;
+static struct sockaddr_storage  tfo_addr;
+static socklen_t                tfo_addrlen;
+static char                     *tfo_host;
+static int                      tfo_flags;
+
+static void sock_reconnect (int sock);
+
+/* Parse one -o argument, name[=value]. Returns 0 if it isn't valid. */
 int
-create_socket (const char *host, int flags, char **canon)
+sock_option (const char *opt)
+{
+    const char  *val;
+    char        *end;
+    size_t      len;
+    long        n   = 1;
+
+    if ((val = strchr(opt, '='))) {
+        len = val - opt;
+        n   = strtol(++val, &end, 10);
+        if (end == val || *end || n < 0 || n > INT_MAX)
+            return 0;
+    }
+    else
+        len = strlen(opt);
+
+#define OPT(s) (len == sizeof(s) - 1 && !strncmp(opt, (s), len))
+    if      (OPT("nodelay"))    sockopts.nodelay    = !!n;
+    else if (OPT("fastopen"))   sockopts.fastopen   = !!n;
+    else if (OPT("sndbuf"))     sockopts.sndbuf     = n;
+    else if (OPT("rcvbuf"))     sockopts.rcvbuf     = n;
+    else if (OPT("busypoll"))   sockopts.busypoll   = n;
+    else
+        return 0;
+#undef OPT
+
+    return 1;
+}
+
+/* Apply sockopts to a new socket. Buffer sizes need setting before
+ * listen or connect to affect the window scale. Returns -1, having
+ * warned, if the socket won't take them: an accepted connection may
+ * already have been reset, and that mustn't take the server down.
+ */
+int
+sock_tune (int sock)
+{
+    int     one = 1;
+
+    if (sockopts.nodelay && setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+            &one, sizeof(one)) < 0
+    ) {
+        warn("can't set TCP_NODELAY");
+        return -1;
+    }
+    if (sockopts.sndbuf && setsockopt(sock, SOL_SOCKET, SO_SNDBUF,
+            &sockopts.sndbuf, sizeof(sockopts.sndbuf)) < 0
+    ) {
+        warn("can't set SO_SNDBUF");
+        return -1;
+    }
+    if (sockopts.rcvbuf && setsockopt(sock, SOL_SOCKET, SO_RCVBUF,
+            &sockopts.rcvbuf, sizeof(sockopts.rcvbuf)) < 0
+    ) {
+        warn("can't set SO_RCVBUF");
+        return -1;
+    }
+
+    if (sockopts.busypoll) {
+#ifdef SO_BUSY_POLL
+        if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL,
+                &sockopts.busypoll, sizeof(sockopts.busypoll)) < 0)
+            warn("can't set SO_BUSY_POLL");
+#else
+        warnx("busypoll is not supported here");
+        sockopts.busypoll = 0;
+#endif
+    }
+
+    return 0;
+}
+
+/* Send the first packet on a client socket. If Fast Open is on this
+ * also connects, and the data goes in the SYN if the kernel has a
+ * cookie for the server. Otherwise this does nothing. Returns the
+ * number of bytes sent.
+ */
+ssize_t
+sock_sendfirst (int sock, const void *buf, size_t len)
 {
     dRV;
-    struct addrinfo     hint, *res, *r;
-    int                 sock;
+    ssize_t     n;
+    int         fl;
+
+    if (sock != tfo_sock) return 0;
+    tfo_sock = -1;
+
+    /* ksf_open has made it nonblocking, but we want to wait for the
+     * connection just as we would without Fast Open */
+    SYSCHK(fl = fcntl(sock, F_GETFL, 0), "can't read fd flags");
+    SYSCHK(fcntl(sock, F_SETFL, fl & ~O_NONBLOCK),
+        "can't set fd blocking");
+
+#if defined(MSG_FASTOPEN)
+    n = sendto(sock, buf, len, MSG_FASTOPEN,
+        (struct sockaddr *)&tfo_addr, tfo_addrlen);
+#elif defined(TCP_FASTOPEN)
+    {
+        int one = 1;
+
+        if (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN,
+                &one, sizeof(one)) < 0)
+            warn("can't set TCP_FASTOPEN");
+        n = sendto(sock, buf, len, 0,
+            (struct sockaddr *)&tfo_addr, tfo_addrlen);
+    }
+#else
+    n = -1;
+    errno = EOPNOTSUPP;
+#endif
+
+    if (n < 0 && errno != EISCONN) {
+        debug("sock_sendfirst: Fast Open failed: %s", strerror(errno));
+        if (connect(sock, (struct sockaddr *)&tfo_addr, tfo_addrlen) < 0)
+            sock_reconnect(sock);
+        n = 0;
+    }
+    debug("sock_sendfirst: [%d] sent [%ld] of [%lu]",
+        sock, (long)n, (unsigned long)len);
+
+    SYSCHK(fcntl(sock, F_SETFL, fl), "can't reset fd flags");
+    return n;
+}
+
+/* getaddrinfo for our service on host. Returns as getaddrinfo does. */
+static int
+sock_getaddrinfo (const char *host, int flags, struct addrinfo **res)
+{
+    struct addrinfo     hint;
+    int                 rv;
 
     bzero(&hint, sizeof hint);
     hint.ai_family      = PF_UNSPEC;
@@ -30,13 +181,23 @@ create_socket (const char *host, int flags, char **canon)
     hint.ai_protocol    = IPPROTO_TCP;
     hint.ai_flags       = flags;
     
-    rv = getaddrinfo(host, KSUDO_SRV, &hint, &res);
+    rv = getaddrinfo(host, KSUDO_SRV, &hint, res);
     if (rv == EAI_NONAME) {
         debug("named service not found, using default port");
         hint.ai_flags |= AI_NUMERICSERV;
-        rv = getaddrinfo(host, KSUDO_PORT, &hint, &res);
+        rv = getaddrinfo(host, KSUDO_PORT, &hint, res);
     }
-    GAICHK(rv, "can't find my local address");
+    return rv;
+}
+
+static struct addrinfo *
+sock_resolve (const char *host, int flags)
+{
+    dRV;
+    struct addrinfo     *res, *r;
+
+    GAICHK(sock_getaddrinfo(host, flags, &res),
+        "can't find my local address");
 
     for (r = res; r; r = r->ai_next) {
         char    host[NI_MAXHOST], port[NI_MAXSERV];
@@ -51,30 +212,379 @@ create_socket (const char *host, int flags, char **canon)
             (r->ai_canonname ? r->ai_canonname : "null"));
     }
 
-    SYSCHK(sock = socket(res->ai_family, res->ai_socktype, 
-            res->ai_protocol),
-        "can't create socket");
+    return res;
+}
 
-    if (flags & AI_PASSIVE) {
-#ifdef WITH_REUSEADDR
-        int one = 1;
+static int
+sock_unix_addr (const char *path, struct sockaddr_un *sun)
+{
+    bzero(sun, sizeof *sun);
+    sun->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun->sun_path))
+        errx(EX_USAGE, "socket path too long: %s", path);
+    strcpy(sun->sun_path, path);
+    return SUN_LEN(sun);
+}
+
+/* Is a an address of this host? */
+static int
+sock_addr_local (const struct sockaddr *a, struct ifaddrs *ifs)
+{
+    const struct sockaddr_in    *a4 = (const struct sockaddr_in *)a;
+    const struct sockaddr_in6   *a6 = (const struct sockaddr_in6 *)a;
+    struct ifaddrs              *i;
+
+    if (a->sa_family == AF_INET
+        && (ntohl(a4->sin_addr.s_addr) >> 24) == IN_LOOPBACKNET)
+        return 1;
+    if (a->sa_family == AF_INET6 && IN6_IS_ADDR_LOOPBACK(&a6->sin6_addr))
+        return 1;
+
+    for (i = ifs; i; i = i->ifa_next) {
+        if (!i->ifa_addr || i->ifa_addr->sa_family != a->sa_family)
+            continue;
+
+        if (a->sa_family == AF_INET
+            && ((struct sockaddr_in *)i->ifa_addr)->sin_addr.s_addr
+                == a4->sin_addr.s_addr)
+            return 1;
+        if (a->sa_family == AF_INET6
+            && IN6_ARE_ADDR_EQUAL(
+                &((struct sockaddr_in6 *)i->ifa_addr)->sin6_addr,
+                &a6->sin6_addr))
+            return 1;
+    }
+    return 0;
+}
+
+/* If host is this host, try the Unix-domain socket. Returns -1 if we
+ * can't use it, so the caller falls back to TCP.
+ */
+static int
+sock_connect_local (struct addrinfo *res)
+{
+    struct ifaddrs      *ifs;
+    struct addrinfo     *r;
+    struct sockaddr_un  sun;
+    socklen_t           len;
+    int                 local = 0, sock;
+
+    if (!*sockpath) return -1;
+
+    if (getifaddrs(&ifs) < 0) {
+        warn("can't list interface addresses");
+        return -1;
+    }
+    for (r = res; r && !local; r = r->ai_next)
+        local = sock_addr_local(r->ai_addr, ifs);
+    freeifaddrs(ifs);
+
+    if (!local) return -1;
+
+    len = sock_unix_addr(sockpath, &sun);
+    if ((sock = socket(PF_LOCAL, SOCK_STREAM, 0)) < 0) {
+        warn("can't create Unix-domain socket");
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&sun, len) < 0) {
+        debug("can't connect to [%s]: %s", sockpath, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    debug("connected to [%s]", sockpath);
+    return sock;
+}
+
+/* Connect to the first of the addresses in res which answers, or to
+ * sockpath if they are ours. Returns -1 if none of them do. An address
+ * matching skip, which has already failed, isn't tried again.
+ */
+static int
+sock_connect (struct addrinfo *res, const struct sockaddr *skip,
+    socklen_t skiplen)
+{
+    struct addrinfo     *r;
+    int                 sock;
+
+    if ((sock = sock_connect_local(res)) >= 0)
+        return sock;
+
+    for (r = res; r; r = r->ai_next) {
+        if (skip && r->ai_addrlen == skiplen
+            && !memcmp(r->ai_addr, skip, skiplen))
+            continue;
+
+        if ((sock = socket(r->ai_family, r->ai_socktype,
+                r->ai_protocol)) < 0
+        ) {
+            warn("can't create socket for family %d", r->ai_family);
+            continue;
+        }
+        if (sock_tune(sock) < 0) {
+            close(sock);
+            continue;
+        }
+
+        /* Fast Open can't tell us until the first send whether the
+         * address is any good, so take the first and leave it to
+         * sock_reconnect to try the rest */
+        if (sockopts.fastopen && !skip) {
+            Assert(r->ai_addrlen <= sizeof(tfo_addr));
+            Copy((char *)r->ai_addr, (char *)&tfo_addr, r->ai_addrlen);
+            tfo_addrlen = r->ai_addrlen;
+            tfo_sock    = sock;
+            return sock;
+        }
+
+        if (connect(sock, r->ai_addr, r->ai_addrlen) == 0)
+            return sock;
+
+        debug("sock_connect: family [%d]: %s",
+            r->ai_family, strerror(errno));
+        close(sock);
+    }
+
+    return -1;
+}
+
+/* Create a client socket connected to host. If host is this host and
+ * ksudod is listening on sockpath, that is used instead of TCP. With
+ * AI_CANONNAME the answer may come from the host cache, in which case
+ * we only go to the resolver if none of the cached addresses work.
+ */
+int
+create_socket (const char *host, int flags, char **canon)
+{
+    struct addrinfo     *res;
+    int                 sock;
+
+    if (sockopts.fastopen) {
+        free(tfo_host);
+        tfo_host    = strdup(host);
+        tfo_flags   = flags;
+    }
+
+    if ((flags & AI_CANONNAME) && (res = hcache_lookup(host))) {
+        sock = sock_connect(res, NULL, 0);
+        if (sock >= 0)
+            *canon = strdup(res->ai_canonname);
+        hcache_free(res);
+
+        if (sock >= 0) return sock;
+        debug("cached addresses for [%s] failed, resolving", host);
+    }
+
+    res = sock_resolve(host, flags);
+
+    if ((sock = sock_connect(res, NULL, 0)) < 0)
+        err(EX_UNAVAILABLE, "can't connect to %s", host);
+
+    if (flags & AI_CANONNAME) {
+        *canon = strdup(res->ai_canonname);
+        hcache_store(host, res);
+    }
+
+    freeaddrinfo(res);
+
+    return sock;
+}
+
+/* The Fast Open address create_socket gave us didn't answer. Resolve
+ * the host again, since the address may have come from the cache, and
+ * connect to any of the others as create_socket would have done. The
+ * new connection replaces the old one on the same fd, so the session
+ * using it needn't know.
+ */
+static void
+sock_reconnect (int sock)
+{
+    dRV;
+    struct addrinfo     *res;
+    int                 new;
+
+    debug("sock_reconnect: trying the other addresses for [%s]",
+        tfo_host);
+
+    res = sock_resolve(tfo_host, tfo_flags);
+    if ((new = sock_connect(res, (struct sockaddr *)&tfo_addr,
+            tfo_addrlen)) < 0)
+        err(EX_UNAVAILABLE, "can't connect to %s", tfo_host);
+
+    if (tfo_flags & AI_CANONNAME)
+        hcache_store(tfo_host, res);
+    freeaddrinfo(res);
+
+    SYSCHK(dup2(new, sock), "can't replace socket");
+    close(new);
+}
+
+/* The canonical name of host, which must be freed, or NULL if it can't
+ * be resolved. Like create_socket this goes through the host cache, so
+ * a later connect to host needn't wait for the resolver either.
+ */
+char *
+sock_canon (const char *host)
+{
+    struct addrinfo     *res;
+    char                *canon  = NULL;
+    int                 rv;
+
+    if ((res = hcache_lookup(host))) {
+        canon = strdup(res->ai_canonname);
+        hcache_free(res);
+        return canon;
+    }
+
+    if ((rv = sock_getaddrinfo(host, AI_CANONNAME, &res))) {
+        warnx("can't resolve %s: %s", host, (rv == EAI_SYSTEM
+            ? strerror(errno) : gai_strerror(rv)));
+        return NULL;
+    }
+
+    if (res->ai_canonname) {
+        canon = strdup(res->ai_canonname);
+        hcache_store(host, res);
+    }
+    freeaddrinfo(res);
+    return canon;
+}
+
+/* Create a listening socket on every address host has, typically one
+ * each for IPv4 and IPv6. Addresses we can't bind are skipped, so long
+ * as we get at least one. Returns the number of sockets, which are
+ * left in *socks.
+ */
+int
+create_listen_sockets (const char *host, int backlog, char **canon,
+    int **socks)
+{
+    dRV;
+    struct addrinfo     *res, *r;
+    int                 sock, one = 1, n = 0;
 
+    res     = sock_resolve(host, AI_PASSIVE|AI_CANONNAME);
+    *socks  = NULL;
+
+    for (r = res; r; r = r->ai_next) {
+        if ((sock = socket(r->ai_family, r->ai_socktype,
+                r->ai_protocol)) < 0
+        ) {
+            /* the kernel may not support this family */
+            warn("can't create socket for family %d", r->ai_family);
+            continue;
+        }
+        if (sock_tune(sock) < 0) {
+            close(sock);
+            continue;
+        }
+
+#ifdef WITH_REUSEADDR
         SYSCHK(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)),
             "can't set SO_REUSEADDR");
 #endif
-        SYSCHK(bind(sock, res->ai_addr, res->ai_addrlen),
-            "can't bind socket");
-    }
-    else {
-        SYSCHK(connect(sock, res->ai_addr, res->ai_addrlen),
-            "can't connect socket");
+#ifdef IPV6_V6ONLY
+        /* otherwise the v6 socket may take the v4 port too */
+        if (r->ai_family == AF_INET6)
+            SYSCHK(setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY,
+                    &one, sizeof(one)),
+                "can't set IPV6_V6ONLY");
+#endif
+
+        if (bind(sock, r->ai_addr, r->ai_addrlen) < 0) {
+            warn("can't bind socket for family %d", r->ai_family);
+            close(sock);
+            continue;
+        }
+
+#ifdef TCP_FASTOPEN
+        if (sockopts.fastopen) {
+            int qlen = KSUDO_TFO_QLEN;
+
+            if (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN,
+                    &qlen, sizeof(qlen)) < 0)
+                warn("can't set TCP_FASTOPEN");
+        }
+#endif
+
+        SYSCHK(listen(sock, backlog), "can't listen on socket");
+
+        Renew(*socks, n + 1);
+        (*socks)[n++] = sock;
     }
 
-    if (flags & AI_CANONNAME)
-        *canon = strdup(res->ai_canonname);
+    if (!n)
+        errx(EX_UNAVAILABLE, "can't listen on any address for %s", host);
 
+    *canon = strdup(res->ai_canonname);
     freeaddrinfo(res);
 
+    return n;
+}
+
+/* Create a listening Unix-domain socket at path. A socket left behind
+ * by a previous ksudod is removed first; anything else is left alone.
+ * Authentication is still by Kerberos, so anyone may connect.
+ */
+int
+create_unix_listen_socket (const char *path, int backlog)
+{
+    dRV;
+    struct sockaddr_un  sun;
+    struct stat         sb;
+    socklen_t           len;
+    int                 sock;
+
+    len = sock_unix_addr(path, &sun);
+
+    if (lstat(path, &sb) == 0) {
+        if (!S_ISSOCK(sb.st_mode))
+            errx(EX_CANTCREAT, "%s exists and is not a socket", path);
+        SYSCHK(unlink(path), "can't remove old socket");
+    }
+
+    SYSCHK(sock = socket(PF_LOCAL, SOCK_STREAM, 0),
+        "can't create Unix-domain socket");
+    SYSCHK(bind(sock, (struct sockaddr *)&sun, len),
+        "can't bind Unix-domain socket");
+    SYSCHK(chmod(path, 0666), "can't set socket permissions");
+    SYSCHK(listen(sock, backlog), "can't listen on socket");
+
     return sock;
 }
 
+/* Have the kernel probe idle connections, so a peer which has vanished
+ * without a FIN eventually shows up as a read error. Returns -1, having
+ * warned, if the connection has already gone.
+ */
+int
+sock_keepalive (int sock)
+{
+    int     one = 1;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one)) < 0) {
+        warn("can't set SO_KEEPALIVE");
+        return -1;
+    }
+
+#ifdef TCP_KEEPIDLE
+    {
+        int idle    = KSUDO_KEEPIDLE;
+        int intvl   = KSUDO_KEEPINTVL;
+        int cnt     = KSUDO_KEEPCNT;
+
+        if (setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE,
+                &idle, sizeof(idle)) < 0
+            || setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL,
+                &intvl, sizeof(intvl)) < 0
+            || setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT,
+                &cnt, sizeof(cnt)) < 0
+        ) {
+            warn("can't set TCP keepalive times");
+            return -1;
+        }
+    }
+#endif
+
+    return 0;
+}
@@ -0,0 +1,210 @@
+/*
+ * This file is part of ksudo, a system for limited remote command
+ * execution based on Kerberos principals.
+ *
+ * Copyright 2012 Ben Morrow <ben@morrow.me.uk>.
+ * Released under the 2-clause BSD licence.
+ *
+ * timer.c: a hierarchical timer wheel for ioloop.
+ *
+ * Time is counted in ticks of KSUDO_TICK_MS. There are TW_LEVELS
+ * wheels of TW_SLOTS slots; a timer goes in the lowest wheel whose
+ * range covers it, and is cascaded down a level each time the wheel
+ * below wraps. Timers are on doubly-linked lists, so both arming and
+ * cancelling are O(1).
+ */
+
+#include <time.h>
+
+#include "ksudo.h"
+
+#define TW_BITS     6
+#define TW_SLOTS    (1 << TW_BITS)
+#define TW_MASK     (TW_SLOTS - 1)
+#define TW_LEVELS   4
+#define TW_MAX      ((1UL << (TW_BITS * TW_LEVELS)) - 1)
+
+#define TwINDEX(t, l)   (((t) >> ((l) * TW_BITS)) & TW_MASK)
+
+static ksudo_timer      *wheel[TW_LEVELS][TW_SLOTS];
+static ksudo_timer      *running;
+/* the next tick to be run */
+static unsigned long    now_tick;
+static int              ntimers     = 0;
+static int              started     = 0;
+
+static unsigned long
+timer_clock ()
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        err(EX_OSERR, "can't read the clock");
+
+    return ts.tv_sec * (1000 / KSUDO_TICK_MS)
+        + ts.tv_nsec / (KSUDO_TICK_MS * 1000000L);
+}
+
+static void
+timer_start ()
+{
+    if (started) return;
+
+    now_tick    = timer_clock();
+    started     = 1;
+}
+
+static void
+timer_link (ksudo_timer **head, ksudo_timer *t)
+{
+    t->next     = *head;
+    t->prevp    = head;
+    if (t->next) t->next->prevp = &t->next;
+    *head       = t;
+}
+
+static void
+timer_insert (ksudo_timer *t)
+{
+    long    delta   = t->expires - now_tick;
+    int     lvl;
+
+    if (delta < 0) {
+        /* already due */
+        timer_link(&wheel[0][now_tick & TW_MASK], t);
+        return;
+    }
+
+    if (delta > TW_MAX) {
+        t->expires  = now_tick + TW_MAX;
+        delta       = TW_MAX;
+    }
+
+    for (lvl = 0; lvl < TW_LEVELS - 1; lvl++)
+        if (delta < (1L << ((lvl + 1) * TW_BITS)))
+            break;
+
+    timer_link(&wheel[lvl][TwINDEX(t->expires, lvl)], t);
+}
+
+void
+timer_cancel (ksudo_timer *t)
+{
+    if (!t->prevp) return;
+
+    *t->prevp = t->next;
+    if (t->next) t->next->prevp = t->prevp;
+    t->next     = NULL;
+    t->prevp    = NULL;
+    ntimers--;
+}
+
+/* Arm t to call op(arg) in ms milliseconds, cancelling it first if it's
+ * already armed.
+ */
+void
+timer_arm (ksudo_timer *t, unsigned long ms, ksudo_timerop op, int arg)
+{
+    timer_start();
+    timer_cancel(t);
+
+    t->op       = op;
+    t->arg      = arg;
+    t->expires  = timer_clock() + (ms + KSUDO_TICK_MS - 1) / KSUDO_TICK_MS;
+
+    timer_insert(t);
+    ntimers++;
+}
+
+/* The current time in ticks, as of the last pass round ioloop. This is
+ * cheap enough to call for every packet.
+ */
+unsigned long
+timer_now ()
+{
+    timer_start();
+    return now_tick;
+}
+
+/* Move everything in one slot of an upper wheel down to the wheels
+ * below. Returns the slot index, so the caller knows whether the
+ * next wheel up needs cascading too.
+ */
+static int
+timer_cascade (int lvl, int idx)
+{
+    ksudo_timer     *t, *list;
+
+    list = wheel[lvl][idx];
+    wheel[lvl][idx] = NULL;
+
+    while ((t = list)) {
+        list = t->next;
+        timer_insert(t);
+    }
+
+    return idx;
+}
+
+/* Run everything which is due */
+void
+timer_run ()
+{
+    unsigned long   target;
+    ksudo_timer     *t;
+    int             idx, lvl;
+
+    if (!started) return;
+    target = timer_clock();
+
+    /* nothing to do, so don't crawl through the ticks we slept for */
+    if (!ntimers) {
+        now_tick = target + 1;
+        return;
+    }
+
+    while ((long)(target - now_tick) >= 0) {
+        idx = now_tick & TW_MASK;
+
+        /* when a wheel wraps, refill it from the one above */
+        if (!idx)
+            for (lvl = 1; lvl < TW_LEVELS; lvl++)
+                if (timer_cascade(lvl, TwINDEX(now_tick, lvl)))
+                    break;
+
+        /* Take the whole list and move on a tick first, so timers
+         * re-armed from their ops wait for the next tick.
+         */
+        running = wheel[0][idx];
+        wheel[0][idx] = NULL;
+        if (running) running->prevp = &running;
+        now_tick++;
+
+        while ((t = running)) {
+            timer_cancel(t);
+            debug("timer_run: [%lx] op [%lx] arg [%d]",
+                (long)t, (long)t->op, t->arg);
+            t->op(t->arg);
+        }
+    }
+}
+
+/* How long poll should wait, in ms. -1 (INFTIM) if nothing is armed. */
+int
+timer_next ()
+{
+    unsigned long   t;
+    int             i;
+
+    if (!ntimers) return INFTIM;
+
+    /* Look for the next non-empty slot in the bottom wheel. If there
+     * isn't one we must at least wake up for the next cascade.
+     */
+    for (i = 0, t = now_tick; i < TW_SLOTS - 1; i++, t++) {
+        if (wheel[0][t & TW_MASK]) break;
+        if (i && !(t & TW_MASK)) break;
+    }
+
+    return (i + 1) * KSUDO_TICK_MS;
+}
@@ -0,0 +1,158 @@
+/*
+ * This file is part of ksudo, a system for limited remote command
+ * execution based on Kerberos principals.
+ *
+ * Copyright 2012 Ben Morrow <ben@morrow.me.uk>.
+ * Released under the 2-clause BSD licence.
+ *
+ * worker.c: a pool of threads for Kerberos work too slow for ioloop.
+ *
+ * A job's run op is called on a worker, with that worker's own krb5
+ * context and keytab, and its done op back on the event loop. Workers
+ * take jobs in order from one queue; finished jobs go on another, and
+ * a byte down a pipe wakes ioloop to collect them. With no workers,
+ * worker_submit runs both ops there and then.
+ */
+
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "ksudo.h"
+
+static int              nworkers    = 0;
+static ksudo_wctx       *workers;
+
+static pthread_mutex_t  lock        = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   wakeup      = PTHREAD_COND_INITIALIZER;
+/* jobs waiting for a worker, and jobs waiting for ioloop */
+static ksudo_job        *todo, **todotail   = &todo;
+static ksudo_job        *done, **donetail   = &done;
+
+static int              donepipe[2] = { -1, -1 };
+
+static void
+job_push (ksudo_job ***tail, ksudo_job *job)
+{
+    job->next   = NULL;
+    **tail      = job;
+    *tail       = &job->next;
+}
+
+static void *
+worker_main (void *arg)
+{
+    dKRBCHK;
+    ksudo_wctx  *w  = arg;
+    ksudo_job   *job;
+
+    if ((ke = krb5_init_context(&w->ctx)))
+        errx(EX_UNAVAILABLE, "can't create krb5 context for worker");
+    if ((ke = krb5_kt_default(w->ctx, &w->kt)))
+        krb5_err(w->ctx, EX_UNAVAILABLE, ke, "can't open keytab");
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (!todo)
+            pthread_cond_wait(&wakeup, &lock);
+        job = todo;
+        if (!(todo = job->next)) todotail = &todo;
+        pthread_mutex_unlock(&lock);
+
+        job->run(job, w);
+
+        pthread_mutex_lock(&lock);
+        job_push(&donetail, job);
+        pthread_mutex_unlock(&lock);
+
+        /* if the pipe is full ioloop has been told already */
+        write(donepipe[1], "", 1);
+    }
+
+    return NULL;
+}
+
+KSUDO_FDOP(worker_fd_read)
+{
+    char        buf[64];
+    ksudo_job   *list, *job;
+
+    while (read(KsfFD(ksf), buf, sizeof(buf)) > 0) ;
+
+    pthread_mutex_lock(&lock);
+    list        = done;
+    done        = NULL;
+    donetail    = &done;
+    pthread_mutex_unlock(&lock);
+
+    while ((job = list)) {
+        list = job->next;
+        debug("worker_fd_read: job [%lx] done", (long)job);
+        job->done(job);
+    }
+}
+
+ksudo_fdops ksudo_fdops_worker = {
+    .read       = worker_fd_read,
+    .write      = NULL,
+    .unblock    = NULL
+};
+
+/* Start n workers. They get every signal blocked, so signals keep
+ * arriving at the event loop.
+ */
+void
+worker_start (int n)
+{
+    dRV;
+    pthread_t   thr;
+    sigset_t    all, old;
+    int         i;
+
+    if (n <= 0) return;
+
+    SYSCHK(pipe(donepipe), "can't create worker pipe");
+    SYSCHK(fcntl(donepipe[1], F_SETFL, O_NONBLOCK),
+        "can't set worker pipe nonblocking");
+    SYSCHK(fcntl(donepipe[1], F_SETFD, FD_CLOEXEC),
+        "can't set worker pipe close-on-exec");
+    ksf_open(donepipe[0], KSUDO_FD_READ, KSFt(worker), NULL);
+
+    NewZ(workers, n);
+    nworkers = n;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 0; i < n; i++) {
+        if ((rv = pthread_create(&thr, NULL, worker_main, &workers[i]))) {
+            errno = rv;
+            err(EX_OSERR, "can't start worker");
+        }
+        pthread_detach(thr);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    debug("worker_start: [%d] workers", n);
+}
+
+/* Returns 1 if the job has been queued, so done will be called later
+ * from ioloop, or 0 if it has already run.
+ */
+int
+worker_submit (ksudo_job *job)
+{
+    if (!nworkers) {
+        job->run(job, NULL);
+        job->done(job);
+        return 0;
+    }
+
+    pthread_mutex_lock(&lock);
+    job_push(&todotail, job);
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+    return 1;
+}